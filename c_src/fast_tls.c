@@ -19,6 +19,8 @@
 #include <string.h>
 #include <erl_nif.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,11 +30,102 @@
 #include "uthash.h"
 
 #define BUF_SIZE 1024
+/* Largest decrypt buffer kept between calls; one TLS record plus slack */
+#define READ_BUFFER_KEEP (2 * 16384)
 
 #define enif_alloc malloc
 #define enif_free free
 #define enif_realloc realloc
 
+/*
+ * Accesses to the counters and pointers read without locks. Compilers
+ * without the GCC atomic builtins, i.e. MSVC, make them under a global
+ * mutex, and take profile contexts under the profile mutex instead,
+ * see take_profile_ctx().
+ */
+#ifdef __GNUC__
+#define HAS_ATOMICS
+#define ATOMIC_GET(var, p) ((var) = __atomic_load_n(p, __ATOMIC_SEQ_CST))
+#define ATOMIC_SET(p, val) __atomic_store_n(p, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_INC(p) __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+#else
+static ErlNifMutex *atomic_mtx = NULL;
+#define ATOMIC_GET(var, p)                                              \
+    do {                                                                \
+        enif_mutex_lock(atomic_mtx);                                    \
+        (var) = *(p);                                                   \
+        enif_mutex_unlock(atomic_mtx);                                  \
+    } while (0)
+#define ATOMIC_SET(p, val)                                              \
+    do {                                                                \
+        enif_mutex_lock(atomic_mtx);                                    \
+        *(p) = (val);                                                   \
+        enif_mutex_unlock(atomic_mtx);                                  \
+    } while (0)
+#define ATOMIC_INC(p)                                                   \
+    do {                                                                \
+        enif_mutex_lock(atomic_mtx);                                    \
+        (*(p))++;                                                       \
+        enif_mutex_unlock(atomic_mtx);                                  \
+    } while (0)
+#endif
+
+#if ERL_NIF_MAJOR_VERSION > 2 || \
+    (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 13)
+#define HAS_IOQ
+#else
+typedef struct write_chunk_s {
+    struct write_chunk_s *next;
+    SysIOVec iov;
+    unsigned char data[1];
+} write_chunk_t;
+#endif
+
+/*
+ * Key of the SSL context cache: a SHA-256 digest of everything
+ * create_new_ctx() depends on. The profile part is computed once
+ * per socket, the certificate is mixed in per context.
+ */
+typedef struct {
+    unsigned char digest[32];
+} ctx_key_t;
+
+/*
+ * Socket settings parsed from the options of tcp_to_tls/2. A profile
+ * made by new_profile_nif() is shared by all sockets opened with it
+ * and keeps its SSL context, so that opening a socket only needs
+ * SSL_new() until the context cache is cleared. The context is read
+ * without locks, see take_profile_ctx(); mtx only orders the threads
+ * replacing it.
+ */
+typedef struct {
+    unsigned int flags;
+    long options;
+    long command;
+    char *cert_file;
+    char *ciphers;
+    char *dh_file;
+    char *ca_file;
+    char *sni;
+    unsigned char *alpn;
+    size_t alpn_len;
+    char *session_key;
+    ctx_key_t profile_key;
+    ctx_key_t ctx_key;
+    ErlNifMutex *mtx;
+    SSL_CTX *ctx;
+    unsigned long generation;
+    unsigned int epoch;
+    unsigned int readers[2];
+} profile_t;
+
 typedef struct {
     BIO *bio_read;
     BIO *bio_write;
@@ -40,19 +133,36 @@ typedef struct {
     int handshakes;
     ErlNifMutex *mtx;
     int valid;
-    char *send_buffer;
-    int send_buffer_size;
-    int send_buffer_len;
-    char *send_buffer2;
-    int send_buffer2_size;
-    int send_buffer2_len;
-    char *cert_file;
-    char *ciphers;
-    char *dh_file;
-    char *ca_file;
-    long options;
+#ifdef HAS_IOQ
+    ErlNifIOQueue *write_queue;
+#else
+    write_chunk_t *write_queue;
+    write_chunk_t *write_queue_tail;
+    size_t write_queue_size;
+#endif
+    size_t send_queue_high;
+    size_t send_queue_low;
+    int send_queue_busy;
+    int notify_writable;
+    ErlNifPid writable_pid;
+    int has_receiver;
+    ErlNifPid receiver;
+    unsigned char *read_buffer;
+    size_t read_buffer_size;
+    int fd;
+    /* A select message may arrive after a recv timed out */
+    int stale_select;
+#if ERL_NIF_MAJOR_VERSION > 2 || \
+    (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 12)
+    /* Monitored owner of the socket in NIF socket mode */
+    int has_owner;
+    ErlNifPid owner;
+    ErlNifMonitor owner_mon;
+#endif
+    int early_data;
+    size_t early_data_sent;
+    profile_t *profile;
     char *sni_error;
-    long command;
 } state_t;
 
 static int ssl_index;
@@ -73,6 +183,115 @@ typedef unsigned __int32 uint32_t;
 #define SSL_is_server(s) (s)->server
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSL_SESSION_up_ref(s) \
+    CRYPTO_add(&(s)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+#define SSL_CTX_up_ref(c) \
+    CRYPTO_add(&(c)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+#if defined(SSL_READ_EARLY_DATA_SUCCESS) && !defined(LIBRESSL_VERSION_NUMBER)
+#define HAS_EARLY_DATA
+/* Early data accepted by the server, one record */
+#define MAX_EARLY_DATA 16384
+/* Replayed ClientHellos are detected for this many seconds, longer
+ * than the ticket age skew OpenSSL tolerates */
+#define EARLY_DATA_WINDOW 15
+#define EARLY_DATA_MAX_HELLOS 65536
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define HAS_TICKET_EVP_CB
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#elif defined(SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+#include <openssl/hmac.h>
+#endif
+
+#if ERL_NIF_MAJOR_VERSION > 2 || \
+    (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 12)
+#define HAS_DIRTY_SCHEDULERS
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define HAS_BIO_METHOD
+#endif
+
+#if defined(HAS_IOQ) && defined(HAS_BIO_METHOD)
+#define HAS_IOQ_BIO
+#endif
+
+/*
+ * Kernel TLS needs OpenSSL 3.0 built with KTLS support, which hands
+ * the traffic keys to the BIO instead of encrypting records itself.
+ * The BIO controls for this are internal to OpenSSL, only reserved
+ * in bio.h, so it is limited to the 3.x releases known to use them,
+ * both when building and at run time.
+ */
+#define KTLS_MIN_OPENSSL 0x30000000L
+#define KTLS_MAX_OPENSSL 0x40000000L
+#if defined(HAS_BIO_METHOD) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS) && defined(__linux__) && \
+    defined(__has_include) && OPENSSL_VERSION_NUMBER >= KTLS_MIN_OPENSSL && \
+    OPENSSL_VERSION_NUMBER < KTLS_MAX_OPENSSL
+#if __has_include(<linux/tls.h>)
+#define HAS_KTLS
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+/* Internal OpenSSL BIO controls used by KTLS, reserved in bio.h */
+#define BIO_CTRL_SET_KTLS 72
+#define BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG 74
+#define BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG 75
+#ifndef TLS_SET_RECORD_TYPE
+#define TLS_SET_RECORD_TYPE 1
+#endif
+#endif
+#endif
+
+#if defined(HAS_BIO_METHOD) && !defined(_WIN32) && \
+    (ERL_NIF_MAJOR_VERSION > 2 || \
+     (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 12))
+#define HAS_SOCKET_MODE
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(SSL_MODE_ASYNC) && !defined(_WIN32)
+#define HAS_ASYNC_MODE
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#define ASYNC_WAIT_TIMEOUT 5000
+/* Delay before retrying when the engine exposes no fds to wait on */
+#define ASYNC_BACKOFF 1
+#define ASYNC_MAX_RETRIES 1000
+#endif
+
+#ifdef __linux__
+#define HAS_INOTIFY
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+/* Quiet time after the last change before contexts are reloaded */
+#define WATCHER_SETTLE_TIME 500
+#endif
+
 void __free(void *ptr, size_t size) {
     enif_free(ptr);
 }
@@ -91,7 +310,64 @@ void __free(void *ptr, size_t size) {
 #define PROTOCOL_OPTIONS "no_sslv3|cipher_server_preference|no_compression"
 
 static ErlNifResourceType *tls_state_t = NULL;
+static ErlNifResourceType *tls_profile_t = NULL;
 static ErlNifMutex **mtx_buf = NULL;
+#ifdef HAS_DIRTY_SCHEDULERS
+static int dirty_schedulers = 0;
+#endif
+
+#define JOB_HANDSHAKE 1
+#define JOB_ASYNC_WAIT 2
+#define JOB_RELOAD 3
+#define JOB_PREWARM 4
+#define JOB_ASYNC_HANDSHAKE 5
+
+/* Domains of certfiles_map being built by prewarm_all_nif() */
+typedef struct {
+    ErlNifMutex *mtx;
+    profile_t *profile;
+    char **files;
+    size_t total;
+    size_t next;
+    size_t done;
+    size_t failed;
+    size_t step;
+    int refs;
+    ErlNifPid pid;
+    ErlNifEnv *env;
+    ERL_NIF_TERM ref;
+} prewarm_t;
+
+typedef struct tls_job_s {
+    int type;
+    int retries;
+    state_t *state;
+    prewarm_t *prewarm;
+    ErlNifPid pid;
+    ErlNifEnv *env;
+    ERL_NIF_TERM ref;
+#ifdef HAS_ASYNC_MODE
+    /* Engine fds of a paused job, see park_async_job() */
+    OSSL_ASYNC_FD *fds;
+    size_t numfds;
+    ErlNifTime deadline;
+#endif
+    struct tls_job_s *next;
+} tls_job_t;
+
+typedef struct {
+    ErlNifCond *cond;
+    tls_job_t *head;
+    tls_job_t *tail;
+} job_queue_t;
+
+static ErlNifMutex *workers_mtx = NULL;
+static ErlNifTid *workers = NULL;
+static int workers_num = 0;
+static int workers_stop = 0;
+/* Handshakes, and jobs that run long, see queue_job() */
+static job_queue_t handshake_jobs;
+static job_queue_t bulk_jobs;
 
 /**
  * Prepare the SSL options flag.
@@ -107,9 +383,26 @@ static int set_option_flag(const unsigned char *opt, size_t len, long *flag) {
     return 0;
 }
 
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+} file_stamp_t;
+
+/*
+ * Entries of certfiles_map only use key and file. Entries of certs_map
+ * also keep what their context was built from, see reload_certs().
+ */
 typedef struct {
     char *key;
     char *file;
+    char *ciphers;
+    char *dh_file;
+    char *ca_file;
+    unsigned int command;
+    file_stamp_t stamps[3];
+    ctx_key_t ctx_key;
     SSL_CTX *ssl_ctx;
     UT_hash_handle hh;
 } cert_info_t;
@@ -120,6 +413,182 @@ static cert_info_t *certfiles_map = NULL;
 static ErlNifRWLock *certs_map_lock = NULL;
 static ErlNifRWLock *certfiles_map_lock = NULL;
 
+/* Bumped whenever contexts in certs_map are dropped or replaced,
+ * see get_profile_ctx() */
+static unsigned long ctx_generation = 0;
+static ErlNifMutex *reload_mtx = NULL;
+
+#ifdef HAS_INOTIFY
+static ErlNifMutex *watcher_mtx = NULL;
+static ErlNifTid watcher_tid;
+static int watcher_fd = -1;
+static int watcher_pipe[2] = {-1, -1};
+static int watcher_failed = 0;
+#endif
+
+/*
+ * Contexts being built right now. Concurrent misses on the same key
+ * wait for the one builder instead of reading the same files again,
+ * and the builder reads them without holding certs_map_lock. A build
+ * that invalidate_cache_nif() matches is marked stale, and its context
+ * is handed to the waiters but not cached.
+ */
+typedef struct {
+    ctx_key_t key;
+    cert_info_t files;
+    ErlNifCond *cond;
+    int done;
+    int waiters;
+    int stale;
+    SSL_CTX *ctx;
+    char *error;
+    UT_hash_handle hh;
+} ctx_build_t;
+
+static ctx_build_t *ctx_builds = NULL;
+static ErlNifMutex *ctx_builds_mtx = NULL;
+
+/*
+ * Profiles made by open_nif() for tcp_to_tls/2, so that sockets opened
+ * with the same options share one instead of parsing and digesting
+ * the options every time. Direct-mapped and keyed by the raw arguments.
+ */
+#define PROFILE_CACHE_SIZE 64
+#define PROFILE_CACHE_KEY_MAX 1024
+
+typedef struct {
+    unsigned char *key;
+    size_t key_len;
+    profile_t *profile;
+} profile_slot_t;
+
+static profile_slot_t profile_cache[PROFILE_CACHE_SIZE];
+static ErlNifRWLock *profile_cache_lock = NULL;
+
+static void flush_profile_cache() {
+    int i;
+
+    for (i = 0; i < PROFILE_CACHE_SIZE; i++) {
+        if (profile_cache[i].profile) {
+            enif_release_resource(profile_cache[i].profile);
+            enif_free(profile_cache[i].key);
+        }
+        memset(&profile_cache[i], 0, sizeof(profile_slot_t));
+    }
+}
+
+/*
+ * SHA-256 contexts for the cache keys, one per thread, so that keys
+ * are computed without allocating. All of them are kept in a list to
+ * be freed on unload.
+ */
+typedef struct md_ctx_s {
+    EVP_MD_CTX *md;
+    struct md_ctx_s *next;
+} md_ctx_t;
+
+static ErlNifTSDKey md_ctx_key;
+static md_ctx_t *md_ctxs = NULL;
+static ErlNifMutex *md_ctxs_mtx = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static EVP_MD *sha256_md = NULL;
+#else
+static const EVP_MD *sha256_md = NULL;
+#endif
+
+static EVP_MD_CTX *get_md_ctx() {
+    md_ctx_t *entry = enif_tsd_get(md_ctx_key);
+
+    if (entry)
+        return entry->md;
+    entry = enif_alloc(sizeof(md_ctx_t));
+    if (!entry)
+        return NULL;
+    entry->md = EVP_MD_CTX_new();
+    if (!entry->md) {
+        enif_free(entry);
+        return NULL;
+    }
+    enif_mutex_lock(md_ctxs_mtx);
+    entry->next = md_ctxs;
+    md_ctxs = entry;
+    enif_mutex_unlock(md_ctxs_mtx);
+    enif_tsd_set(md_ctx_key, entry);
+    return entry->md;
+}
+
+static int init_md_ctxs() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    /* Fetched once instead of on every EVP_DigestInit_ex() */
+    sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#else
+    sha256_md = EVP_sha256();
+#endif
+    md_ctxs_mtx = enif_mutex_create("md_ctxs_mtx");
+    return sha256_md && md_ctxs_mtx &&
+           enif_tsd_key_create("fast_tls_md_ctx", &md_ctx_key) == 0;
+}
+
+static void free_md_ctxs() {
+    md_ctx_t *entry;
+
+    while ((entry = md_ctxs)) {
+        md_ctxs = entry->next;
+        EVP_MD_CTX_free(entry->md);
+        enif_free(entry);
+    }
+    enif_tsd_key_destroy(md_ctx_key);
+    enif_mutex_destroy(md_ctxs_mtx);
+    md_ctxs_mtx = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free(sha256_md);
+#endif
+    sha256_md = NULL;
+}
+
+/*
+ * Certificates loaded from memory by load_certificate_nif(), parsed
+ * once and shared by all SSL contexts built from them. They are named
+ * "mem:" followed by the hex SHA-256 of the loaded data, and the name
+ * is accepted wherever a certificate file name is.
+ */
+#define MEM_CERT_PREFIX "mem:"
+
+typedef struct {
+    char *id;
+    X509 *cert;
+    STACK_OF(X509) *chain;
+    EVP_PKEY *key;
+    UT_hash_handle hh;
+} mem_cert_t;
+
+static mem_cert_t *mem_certs = NULL;
+static ErlNifRWLock *mem_certs_lock = NULL;
+
+static void free_mem_cert(mem_cert_t *mc) {
+    if (mc) {
+        if (mc->cert)
+            X509_free(mc->cert);
+        if (mc->chain)
+            sk_X509_pop_free(mc->chain, X509_free);
+        if (mc->key)
+            EVP_PKEY_free(mc->key);
+        enif_free(mc->id);
+        enif_free(mc);
+    }
+}
+
+static void flush_mem_certs() {
+    mem_cert_t *mc, *tmp;
+
+    enif_rwlock_rwlock(mem_certs_lock);
+    HASH_ITER(hh, mem_certs, mc, tmp) {
+        HASH_DEL(mem_certs, mc);
+        free_mem_cert(mc);
+    }
+    enif_rwlock_rwunlock(mem_certs_lock);
+}
+
 static void free_cert_info(cert_info_t *info) {
     if (info) {
         enif_free(info->key);
@@ -139,14 +608,280 @@ static void clear_certs_map() {
         HASH_DEL(certs_map, info);
         free_cert_info(info);
     }
+    ATOMIC_INC(&ctx_generation);
     enif_rwlock_rwunlock(certs_map_lock);
 }
 
+/*
+ * SNI index of certfiles_map: a trie of the domain labels in reverse
+ * order, so that "www.example.com" is found under com, example, www.
+ * A node points to the entries of its exact name, of "*.name" which
+ * matches exactly one more label, and of ".name" which matches any
+ * number of more labels. An exact name wins over a wildcard, which
+ * wins over the longest suffix. Names are lowercased when added.
+ *
+ * Names not found are remembered in a small negative cache, so that
+ * repeated unknown names skip the walk. Entries are hashed with
+ * SipHash under a key chosen at load, so names colliding with a
+ * cached one can't be crafted, and with the index generation, which
+ * is bumped on every change.
+ *
+ * Everything is protected by certfiles_map_lock, except the negative
+ * cache, which is also updated by readers.
+ */
+#define SNI_NEG_CACHE_SIZE 4096
+#define SNI_MAX_NAME 255
+
+typedef struct sni_node_s {
+    char *label;
+    cert_info_t *exact;
+    cert_info_t *wildcard;
+    cert_info_t *suffix;
+    struct sni_node_s *parent;
+    struct sni_node_s *children;
+    UT_hash_handle hh;
+} sni_node_t;
+
+static sni_node_t sni_root;
+static uint64_t sni_generation = 0;
+static uint64_t sni_neg_cache[SNI_NEG_CACHE_SIZE];
+static uint64_t sni_neg_key[2];
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)                                       \
+    do {                                                                \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;                      \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;                      \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+/* SipHash-2-4 of the name under sni_neg_key */
+static uint64_t sni_hash(const char *name, size_t len) {
+    const unsigned char *p = (const unsigned char *) name;
+    uint64_t v0 = sni_neg_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = sni_neg_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = sni_neg_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = sni_neg_key[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        for (m = 0, j = 7; j >= 0; j--)
+            m = (m << 8) | p[i + j];
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (m = (uint64_t) len << 56, j = 0; i + j < len; j++)
+        m |= (uint64_t) p[i + j] << (8 * j);
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    for (j = 0; j < 4; j++)
+        SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void lower_name(char *name) {
+    for (; *name; name++)
+        *name = tolower((unsigned char) *name);
+}
+
+static void free_sni_node(sni_node_t *node) {
+    sni_node_t *child = NULL;
+    sni_node_t *tmp = NULL;
+
+    HASH_ITER(hh, node->children, child, tmp) {
+        HASH_DEL(node->children, child);
+        free_sni_node(child);
+    }
+    if (node != &sni_root) {
+        enif_free(node->label);
+        enif_free(node);
+    }
+}
+
+/* Frees the nodes left without entries, from node up to the root */
+static void prune_sni_node(sni_node_t *node) {
+    sni_node_t *parent;
+
+    while (node != &sni_root && !node->exact && !node->wildcard &&
+           !node->suffix && !node->children) {
+        parent = node->parent;
+        HASH_DEL(parent->children, node);
+        enif_free(node->label);
+        enif_free(node);
+        node = parent;
+    }
+}
+
+/*
+ * Returns the pointer to the entry of a lowercase name in its node,
+ * creating the missing nodes if create is set, or NULL if the name
+ * is malformed or the nodes can't be allocated.
+ */
+static cert_info_t **get_sni_slot(const char *name, int create,
+                                  sni_node_t **node_out) {
+    sni_node_t *node = &sni_root;
+    sni_node_t *child = NULL;
+    const char *start, *end;
+    size_t len;
+    int kind = 0;
+
+    if (name[0] == '*' && (name[1] == '.' || !name[1])) {
+        kind = 1;
+        name += name[1] ? 2 : 1;
+    } else if (name[0] == '.') {
+        kind = 2;
+        name++;
+    }
+    end = name + strlen(name);
+    if (end == name) {
+        /* Bare "*" or "." */
+        *node_out = node;
+        if (kind == 1)
+            return &node->wildcard;
+        return kind == 2 ? &node->suffix : NULL;
+    }
+
+    while (end > name) {
+        start = end;
+        while (start > name && start[-1] != '.')
+            start--;
+        len = end - start;
+        if (!len)
+            break;
+        HASH_FIND(hh, node->children, start, len, child);
+        if (!child) {
+            if (!create)
+                return NULL;
+            child = enif_alloc(sizeof(sni_node_t));
+            if (!child)
+                break;
+            memset(child, 0, sizeof(sni_node_t));
+            child->label = enif_alloc(len);
+            if (!child->label) {
+                enif_free(child);
+                break;
+            }
+            memcpy(child->label, start, len);
+            child->parent = node;
+            HASH_ADD_KEYPTR(hh, node->children, child->label, len, child);
+        }
+        node = child;
+        if (start == name) {
+            *node_out = node;
+            if (kind == 1)
+                return &node->wildcard;
+            if (kind == 2)
+                return &node->suffix;
+            return &node->exact;
+        }
+        end = start - 1;
+    }
+
+    /* Empty label or out of memory */
+    prune_sni_node(node);
+    return NULL;
+}
+
+/* Must be called with certfiles_map_lock held for writing */
+static int add_sni_entry(cert_info_t *info) {
+    sni_node_t *node = NULL;
+    cert_info_t **slot = get_sni_slot(info->key, 1, &node);
+
+    if (!slot)
+        return 0;
+    *slot = info;
+    sni_generation++;
+    return 1;
+}
+
+/* Must be called with certfiles_map_lock held for writing */
+static void del_sni_entry(cert_info_t *info) {
+    sni_node_t *node = NULL;
+    cert_info_t **slot = get_sni_slot(info->key, 0, &node);
+
+    if (slot && *slot == info) {
+        *slot = NULL;
+        prune_sni_node(node);
+    }
+    sni_generation++;
+}
+
+/* Must be called with certfiles_map_lock held */
+static cert_info_t *lookup_certfile(const char *domain) {
+    sni_node_t *node = &sni_root;
+    sni_node_t *child = NULL;
+    cert_info_t *wildcard = NULL;
+    cert_info_t *suffix = NULL;
+    char name[SNI_MAX_NAME];
+    uint64_t hash, *neg, cached;
+    size_t len, start, end;
+
+    if (!domain)
+        return NULL;
+    for (len = 0; domain[len]; len++) {
+        if (len == SNI_MAX_NAME)
+            return NULL;
+        name[len] = tolower((unsigned char) domain[len]);
+    }
+    if (!len)
+        return NULL;
+
+    hash = sni_hash(name, len);
+    hash = (hash ^ (sni_generation * 0x9e3779b97f4a7c15ULL)) | 1;
+    neg = &sni_neg_cache[(hash >> 32) % SNI_NEG_CACHE_SIZE];
+    ATOMIC_GET(cached, neg);
+    if (cached == hash)
+        return NULL;
+
+    end = len;
+    for (;;) {
+        start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+        if (start == end) {
+            /* Empty label */
+            wildcard = suffix = NULL;
+            break;
+        }
+        if (node->suffix)
+            suffix = node->suffix;
+        if (start == 0 && node->wildcard)
+            wildcard = node->wildcard;
+        HASH_FIND(hh, node->children, name + start, end - start, child);
+        if (!child)
+            break;
+        node = child;
+        if (start == 0) {
+            if (node->exact)
+                return node->exact;
+            break;
+        }
+        end = start - 1;
+    }
+
+    if (wildcard)
+        return wildcard;
+    if (!suffix)
+        ATOMIC_SET(neg, hash);
+    return suffix;
+}
+
 static void clear_certfiles_map() {
     cert_info_t *info = NULL;
     cert_info_t *tmp = NULL;
 
     enif_rwlock_rwlock(certfiles_map_lock);
+    free_sni_node(&sni_root);
+    memset(&sni_root, 0, sizeof(sni_node_t));
+    sni_generation++;
     HASH_ITER(hh, certfiles_map, info, tmp) {
         HASH_DEL(certfiles_map, info);
         free_cert_info(info);
@@ -154,643 +889,4979 @@ static void clear_certfiles_map() {
     enif_rwlock_rwunlock(certfiles_map_lock);
 }
 
-static state_t *init_tls_state() {
-    state_t *state = enif_alloc_resource(tls_state_t, sizeof(state_t));
-    if (!state) return NULL;
-    memset(state, 0, sizeof(state_t));
-    state->mtx = enif_mutex_create("");
-    if (!state->mtx) {
-        enif_release_resource(state);
-        return NULL;
-    }
-    state->valid = 1;
-    return state;
-}
+/*
+ * Server session cache shared by all SSL contexts, so sessions survive
+ * SNI context switches and clear_cache(). It is split into shards by
+ * session ID, each an LRU list bounded to its share of the total size:
+ * uthash keeps insertion order, so the least recently used entries
+ * come first.
+ */
+typedef struct session_entry_s {
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int id_len;
+    SSL_SESSION *session;
+    time_t expires;
+    UT_hash_handle hh;
+} session_entry_t;
 
-static void destroy_tls_state(ErlNifEnv *env, void *data) {
-    state_t *state = (state_t *) data;
-    if (state) {
-        if (state->ssl)
-            SSL_free(state->ssl);
-        if (state->mtx)
-            enif_mutex_destroy(state->mtx);
-        if (state->send_buffer)
-            enif_free(state->send_buffer);
-        if (state->send_buffer2)
-            enif_free(state->send_buffer2);
-        if (state->cert_file)
-            enif_free(state->cert_file);
-        memset(state, 0, sizeof(state_t));
-    }
+typedef struct {
+    ErlNifMutex *mtx;
+    session_entry_t *entries;
+    size_t count;
+} session_shard_t;
+
+static session_shard_t *session_shards = NULL;
+static unsigned int session_shards_num = 0;
+static size_t session_cache_size = 0;
+static long session_cache_timeout = 300;
+
+static session_shard_t *session_shard(const unsigned char *id,
+                                      unsigned int len) {
+    unsigned int i, hash = 0;
+
+    for (i = 0; i < len; i++)
+        hash = hash * 31 + id[i];
+    return &session_shards[hash % session_shards_num];
 }
 
-static void locking_callback(int mode, int n, const char *file, int line) {
-    if (mode & CRYPTO_LOCK)
-        enif_mutex_lock(mtx_buf[n]);
-    else
-        enif_mutex_unlock(mtx_buf[n]);
+/* Must be called with shard->mtx held */
+static void session_shard_del(session_shard_t *shard, session_entry_t *e) {
+    HASH_DEL(shard->entries, e);
+    shard->count--;
+    SSL_SESSION_free(e->session);
+    enif_free(e);
 }
 
-static void thread_id_callback(CRYPTO_THREADID *id) {
-    CRYPTO_THREADID_set_pointer(id, enif_thread_self());
+static void flush_session_cache() {
+    session_entry_t *e = NULL;
+    session_entry_t *tmp = NULL;
+    unsigned int i;
+
+    for (i = 0; i < session_shards_num; i++) {
+        enif_mutex_lock(session_shards[i].mtx);
+        HASH_ITER(hh, session_shards[i].entries, e, tmp) {
+            session_shard_del(&session_shards[i], e);
+        }
+        enif_mutex_unlock(session_shards[i].mtx);
+    }
 }
 
-static int atomic_add_callback(int *pointer, int amount, int type, const char *file, int line) {
-    return __sync_add_and_fetch(pointer, amount);
+/* Keeps the reference OpenSSL passes to us */
+static int session_new_cb(SSL *ssl, SSL_SESSION *sess) {
+    unsigned int len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &len);
+    size_t limit = session_cache_size / session_shards_num;
+    session_shard_t *shard;
+    session_entry_t *e, *old = NULL;
+
+    if (!session_cache_size || len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return 0;
+    if (limit == 0)
+        limit = 1;
+
+    e = enif_alloc(sizeof(session_entry_t));
+    if (!e) return 0;
+    memset(e, 0, sizeof(session_entry_t));
+    memcpy(e->id, id, len);
+    e->id_len = len;
+    e->session = sess;
+    e->expires = time(NULL) + session_cache_timeout;
+
+    shard = session_shard(id, len);
+    enif_mutex_lock(shard->mtx);
+    HASH_FIND(hh, shard->entries, e->id, len, old);
+    if (old)
+        session_shard_del(shard, old);
+    while (shard->count >= limit && shard->entries)
+        session_shard_del(shard, shard->entries);
+    HASH_ADD(hh, shard->entries, id, len, e);
+    shard->count++;
+    enif_mutex_unlock(shard->mtx);
+
+    return 1;
 }
 
-static int load(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info) {
-    int i;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *session_get_cb(SSL *ssl, const unsigned char *id,
+                                   int len, int *copy) {
+#else
+static SSL_SESSION *session_get_cb(SSL *ssl, unsigned char *id,
+                                   int len, int *copy) {
+#endif
+    session_shard_t *shard;
+    session_entry_t *e = NULL;
+    SSL_SESSION *sess = NULL;
+
+    /* The reference is taken under the shard lock, before the entry
+     * can be evicted */
+    *copy = 0;
+    if (!session_cache_size || len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
 
-    OpenSSL_add_ssl_algorithms();
-    SSL_load_error_strings();
+    shard = session_shard(id, len);
+    enif_mutex_lock(shard->mtx);
+    HASH_FIND(hh, shard->entries, id, len, e);
+    if (e) {
+        if (e->expires <= time(NULL)) {
+            session_shard_del(shard, e);
+        } else {
+            /* Move it to the most recently used end */
+            HASH_DEL(shard->entries, e);
+            HASH_ADD(hh, shard->entries, id, e->id_len, e);
+            sess = e->session;
+            SSL_SESSION_up_ref(sess);
+        }
+    }
+    enif_mutex_unlock(shard->mtx);
 
-    mtx_buf = enif_alloc(CRYPTO_num_locks() * sizeof(ErlNifMutex *));
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        mtx_buf[i] = enif_mutex_create("");
+    return sess;
+}
 
-    CRYPTO_set_add_lock_callback(atomic_add_callback);
-    CRYPTO_set_locking_callback(locking_callback);
-    CRYPTO_THREADID_set_callback(thread_id_callback);
+static void session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess) {
+    unsigned int len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &len);
+    session_shard_t *shard;
+    session_entry_t *e = NULL;
 
-    certs_map_lock = enif_rwlock_create("certs_map_lock");
-    certfiles_map_lock = enif_rwlock_create("certfiles_map_lock");
+    if (len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
 
-    ssl_index = SSL_get_ex_new_index(0, "ssl index", NULL, NULL, NULL);
-    ErlNifResourceFlags flags = ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER;
-    tls_state_t = enif_open_resource_type(env, NULL, "tls_state_t",
-                                          destroy_tls_state,
-                                          flags, NULL);
-    return 0;
+    shard = session_shard(id, len);
+    enif_mutex_lock(shard->mtx);
+    HASH_FIND(hh, shard->entries, id, len, e);
+    if (e && e->session == sess)
+        session_shard_del(shard, e);
+    enif_mutex_unlock(shard->mtx);
 }
 
-static void unload(ErlNifEnv *env, void *priv) {
-    int i;
+/*
+ * Makes a server SSL context use the session cache. The session ID
+ * context is the context key, so sessions are resumed only with the
+ * certificate and settings they were negotiated with.
+ */
+static void setup_session_cache(SSL_CTX *ctx, const ctx_key_t *key) {
+    /* Also needed to resume sessions from tickets */
+    SSL_CTX_set_session_id_context(ctx, key->digest, sizeof(key->digest));
 
-    clear_certs_map();
-    clear_certfiles_map();
-    enif_rwlock_destroy(certs_map_lock);
-    enif_rwlock_destroy(certfiles_map_lock);
-    certs_map = NULL;
-    certs_map_lock = NULL;
-    certfiles_map = NULL;
-    certfiles_map_lock = NULL;
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        enif_mutex_destroy(mtx_buf[i]);
-    enif_free(mtx_buf);
-    mtx_buf = NULL;
-}
+    if (!session_cache_size)
+        return;
 
-static int verify_callback(int preverify_ok, X509_STORE_CTX *ctx) {
-    return 1;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                        SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(ctx, session_cache_timeout);
+    SSL_CTX_sess_set_new_cb(ctx, session_new_cb);
+    SSL_CTX_sess_set_get_cb(ctx, session_get_cb);
+    SSL_CTX_sess_set_remove_cb(ctx, session_remove_cb);
 }
 
 /*
- * ECDHE is enabled only on OpenSSL 1.0.0e and later.
- * See http://www.openssl.org/news/secadv_20110906.txt
- * for details.
+ * Client session store, so outgoing connections to the same server
+ * resume the last session. Sessions are keyed by SNI and the settings
+ * of the socket (state->session_key), kept in LRU order and saved
+ * whenever OpenSSL gets a new one, which for TLS 1.3 is when a ticket
+ * arrives after the handshake.
  */
-#ifndef OPENSSL_NO_ECDH
+typedef struct {
+    char *key;
+    SSL_SESSION *session;
+    time_t expires;
+    UT_hash_handle hh;
+} client_session_t;
+
+static client_session_t *client_sessions = NULL;
+static size_t client_sessions_num = 0;
+static ErlNifMutex *client_sessions_mtx = NULL;
+static size_t client_session_cache_size = 0;
+static long client_session_cache_timeout = 300;
+
+/* Must be called with client_sessions_mtx held */
+static void client_session_del(client_session_t *e) {
+    HASH_DEL(client_sessions, e);
+    client_sessions_num--;
+    SSL_SESSION_free(e->session);
+    enif_free(e->key);
+    enif_free(e);
+}
 
-static void setup_ecdh(SSL_CTX *ctx) {
-#if OPENSSL_VERSION_NUMBER < 0x10002000
-    EC_KEY *ecdh;
+static void flush_client_sessions() {
+    client_session_t *e = NULL;
+    client_session_t *tmp = NULL;
 
-    if (SSLeay() < 0x1000005fL) {
-        return;
+    enif_mutex_lock(client_sessions_mtx);
+    HASH_ITER(hh, client_sessions, e, tmp) {
+        client_session_del(e);
     }
+    enif_mutex_unlock(client_sessions_mtx);
+}
 
-    ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
-    SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+static int client_session_new_cb(SSL *ssl, SSL_SESSION *sess) {
+    state_t *state = (state_t *) SSL_get_ex_data(ssl, ssl_index);
+    client_session_t *e, *old = NULL;
+    size_t key_size;
+
+    if (!client_session_cache_size || !state || !state->profile->session_key)
+        return 0;
+
+    e = enif_alloc(sizeof(client_session_t));
+    if (!e) return 0;
+    key_size = strlen(state->profile->session_key) + 1;
+    e->key = enif_alloc(key_size);
+    if (!e->key) {
+        enif_free(e);
+        return 0;
+    }
+    memcpy(e->key, state->profile->session_key, key_size);
+    e->session = sess;
+    e->expires = time(NULL) + client_session_cache_timeout;
+
+    enif_mutex_lock(client_sessions_mtx);
+    HASH_FIND_STR(client_sessions, e->key, old);
+    if (old)
+        client_session_del(old);
+    while (client_sessions_num >= client_session_cache_size &&
+           client_sessions)
+        client_session_del(client_sessions);
+    HASH_ADD_KEYPTR(hh, client_sessions, e->key, key_size - 1, e);
+    client_sessions_num++;
+    enif_mutex_unlock(client_sessions_mtx);
 
-    EC_KEY_free(ecdh);
-#else
-    SSL_CTX_set_ecdh_auto(ctx, 1);
-#endif
+    return 1;
 }
 
-#endif
+static void reuse_client_session(state_t *state) {
+    client_session_t *e = NULL;
 
-#ifndef OPENSSL_NO_DH
+    enif_mutex_lock(client_sessions_mtx);
+    HASH_FIND_STR(client_sessions, state->profile->session_key, e);
+    if (e) {
+        if (e->expires <= time(NULL)) {
+            client_session_del(e);
+        } else {
+            /* Move it to the most recently used end */
+            HASH_DEL(client_sessions, e);
+            HASH_ADD_KEYPTR(hh, client_sessions, e->key, strlen(e->key), e);
+            SSL_set_session(state->ssl, e->session);
+        }
+    }
+    enif_mutex_unlock(client_sessions_mtx);
+}
+
+static void setup_client_session_cache(SSL_CTX *ctx) {
+    if (!client_session_cache_size)
+        return;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(ctx, client_session_cache_timeout);
+    SSL_CTX_sess_set_new_cb(ctx, client_session_new_cb);
+}
+
+static ErlNifRWLock *ticket_keys_lock = NULL;
+/* Set while a key ring from set_ticket_keys/1 is installed */
+static int ticket_keys_shared = 0;
+
+#ifdef HAS_EARLY_DATA
 /*
-  2048-bit MODP Group with 256-bit Prime Order Subgroup (RFC5114)
-*/
-static unsigned char dh2048_p[] = {
-        0x87, 0xA8, 0xE6, 0x1D, 0xB4, 0xB6, 0x66, 0x3C,
-        0xFF, 0xBB, 0xD1, 0x9C, 0x65, 0x19, 0x59, 0x99,
-        0x8C, 0xEE, 0xF6, 0x08, 0x66, 0x0D, 0xD0, 0xF2,
-        0x5D, 0x2C, 0xEE, 0xD4, 0x43, 0x5E, 0x3B, 0x00,
-        0xE0, 0x0D, 0xF8, 0xF1, 0xD6, 0x19, 0x57, 0xD4,
-        0xFA, 0xF7, 0xDF, 0x45, 0x61, 0xB2, 0xAA, 0x30,
-        0x16, 0xC3, 0xD9, 0x11, 0x34, 0x09, 0x6F, 0xAA,
-        0x3B, 0xF4, 0x29, 0x6D, 0x83, 0x0E, 0x9A, 0x7C,
-        0x20, 0x9E, 0x0C, 0x64, 0x97, 0x51, 0x7A, 0xBD,
-        0x5A, 0x8A, 0x9D, 0x30, 0x6B, 0xCF, 0x67, 0xED,
-        0x91, 0xF9, 0xE6, 0x72, 0x5B, 0x47, 0x58, 0xC0,
-        0x22, 0xE0, 0xB1, 0xEF, 0x42, 0x75, 0xBF, 0x7B,
-        0x6C, 0x5B, 0xFC, 0x11, 0xD4, 0x5F, 0x90, 0x88,
-        0xB9, 0x41, 0xF5, 0x4E, 0xB1, 0xE5, 0x9B, 0xB8,
-        0xBC, 0x39, 0xA0, 0xBF, 0x12, 0x30, 0x7F, 0x5C,
-        0x4F, 0xDB, 0x70, 0xC5, 0x81, 0xB2, 0x3F, 0x76,
-        0xB6, 0x3A, 0xCA, 0xE1, 0xCA, 0xA6, 0xB7, 0x90,
-        0x2D, 0x52, 0x52, 0x67, 0x35, 0x48, 0x8A, 0x0E,
-        0xF1, 0x3C, 0x6D, 0x9A, 0x51, 0xBF, 0xA4, 0xAB,
-        0x3A, 0xD8, 0x34, 0x77, 0x96, 0x52, 0x4D, 0x8E,
-        0xF6, 0xA1, 0x67, 0xB5, 0xA4, 0x18, 0x25, 0xD9,
-        0x67, 0xE1, 0x44, 0xE5, 0x14, 0x05, 0x64, 0x25,
-        0x1C, 0xCA, 0xCB, 0x83, 0xE6, 0xB4, 0x86, 0xF6,
-        0xB3, 0xCA, 0x3F, 0x79, 0x71, 0x50, 0x60, 0x26,
-        0xC0, 0xB8, 0x57, 0xF6, 0x89, 0x96, 0x28, 0x56,
-        0xDE, 0xD4, 0x01, 0x0A, 0xBD, 0x0B, 0xE6, 0x21,
-        0xC3, 0xA3, 0x96, 0x0A, 0x54, 0xE7, 0x10, 0xC3,
-        0x75, 0xF2, 0x63, 0x75, 0xD7, 0x01, 0x41, 0x03,
-        0xA4, 0xB5, 0x43, 0x30, 0xC1, 0x98, 0xAF, 0x12,
-        0x61, 0x16, 0xD2, 0x27, 0x6E, 0x11, 0x71, 0x5F,
-        0x69, 0x38, 0x77, 0xFA, 0xD7, 0xEF, 0x09, 0xCA,
-        0xDB, 0x09, 0x4A, 0xE9, 0x1E, 0x1A, 0x15, 0x97,
-};
-static unsigned char dh2048_g[] = {
-        0x3F, 0xB3, 0x2C, 0x9B, 0x73, 0x13, 0x4D, 0x0B,
-        0x2E, 0x77, 0x50, 0x66, 0x60, 0xED, 0xBD, 0x48,
-        0x4C, 0xA7, 0xB1, 0x8F, 0x21, 0xEF, 0x20, 0x54,
-        0x07, 0xF4, 0x79, 0x3A, 0x1A, 0x0B, 0xA1, 0x25,
-        0x10, 0xDB, 0xC1, 0x50, 0x77, 0xBE, 0x46, 0x3F,
-        0xFF, 0x4F, 0xED, 0x4A, 0xAC, 0x0B, 0xB5, 0x55,
-        0xBE, 0x3A, 0x6C, 0x1B, 0x0C, 0x6B, 0x47, 0xB1,
-        0xBC, 0x37, 0x73, 0xBF, 0x7E, 0x8C, 0x6F, 0x62,
-        0x90, 0x12, 0x28, 0xF8, 0xC2, 0x8C, 0xBB, 0x18,
-        0xA5, 0x5A, 0xE3, 0x13, 0x41, 0x00, 0x0A, 0x65,
-        0x01, 0x96, 0xF9, 0x31, 0xC7, 0x7A, 0x57, 0xF2,
-        0xDD, 0xF4, 0x63, 0xE5, 0xE9, 0xEC, 0x14, 0x4B,
-        0x77, 0x7D, 0xE6, 0x2A, 0xAA, 0xB8, 0xA8, 0x62,
-        0x8A, 0xC3, 0x76, 0xD2, 0x82, 0xD6, 0xED, 0x38,
-        0x64, 0xE6, 0x79, 0x82, 0x42, 0x8E, 0xBC, 0x83,
-        0x1D, 0x14, 0x34, 0x8F, 0x6F, 0x2F, 0x91, 0x93,
-        0xB5, 0x04, 0x5A, 0xF2, 0x76, 0x71, 0x64, 0xE1,
-        0xDF, 0xC9, 0x67, 0xC1, 0xFB, 0x3F, 0x2E, 0x55,
-        0xA4, 0xBD, 0x1B, 0xFF, 0xE8, 0x3B, 0x9C, 0x80,
-        0xD0, 0x52, 0xB9, 0x85, 0xD1, 0x82, 0xEA, 0x0A,
-        0xDB, 0x2A, 0x3B, 0x73, 0x13, 0xD3, 0xFE, 0x14,
-        0xC8, 0x48, 0x4B, 0x1E, 0x05, 0x25, 0x88, 0xB9,
-        0xB7, 0xD2, 0xBB, 0xD2, 0xDF, 0x01, 0x61, 0x99,
-        0xEC, 0xD0, 0x6E, 0x15, 0x57, 0xCD, 0x09, 0x15,
-        0xB3, 0x35, 0x3B, 0xBB, 0x64, 0xE0, 0xEC, 0x37,
-        0x7F, 0xD0, 0x28, 0x37, 0x0D, 0xF9, 0x2B, 0x52,
-        0xC7, 0x89, 0x14, 0x28, 0xCD, 0xC6, 0x7E, 0xB6,
-        0x18, 0x4B, 0x52, 0x3D, 0x1D, 0xB2, 0x46, 0xC3,
-        0x2F, 0x63, 0x07, 0x84, 0x90, 0xF0, 0x0E, 0xF8,
-        0xD6, 0x47, 0xD1, 0x48, 0xD4, 0x79, 0x54, 0x51,
-        0x5E, 0x23, 0x27, 0xCF, 0xEF, 0x98, 0xC5, 0x82,
-        0x66, 0x4B, 0x4C, 0x0F, 0x6C, 0xC4, 0x16, 0x59,
-};
+ * 0-RTT replay protection: early data is only accepted with a
+ * ClientHello random not seen within the window. OpenSSL rejects
+ * tickets older than the window by itself. The window is local to
+ * the node, while a shared key ring lets other nodes accept the same
+ * ticket, so early data is refused while one is installed.
+ */
+typedef struct {
+    unsigned char random[SSL3_RANDOM_SIZE];
+    time_t expires;
+    UT_hash_handle hh;
+} client_hello_t;
 
-static int setup_dh(SSL_CTX *ctx, char *dh_file) {
-    DH *dh;
-    int res;
+static client_hello_t *client_hellos = NULL;
+static size_t client_hellos_num = 0;
+static ErlNifMutex *client_hellos_mtx = NULL;
 
-    if (dh_file != NULL) {
-        BIO *bio = BIO_new_file(dh_file, "r");
+static void client_hello_del(client_hello_t *e) {
+    HASH_DEL(client_hellos, e);
+    client_hellos_num--;
+    enif_free(e);
+}
 
-        if (bio == NULL) {
-            return 0;
-        }
-        dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-        BIO_free(bio);
-        if (dh == NULL) {
-            return 0;
-        }
-    } else {
-        dh = DH_new();
-        if (dh == NULL) {
-            return 0;
-        }
-        BIGNUM *dh_p = BN_bin2bn(dh2048_p, sizeof(dh2048_p), NULL);
-        BIGNUM *dh_g = BN_bin2bn(dh2048_g, sizeof(dh2048_g), NULL);
-        if (dh_p == NULL || dh_g == NULL) {
-            BN_free(dh_p);
-            BN_free(dh_g);
-            DH_free(dh);
-            return 0;
-        }
+static void flush_client_hellos() {
+    client_hello_t *e = NULL;
+    client_hello_t *tmp = NULL;
 
-        DH_set0_pqg(dh, dh_p, NULL, dh_g);
+    enif_mutex_lock(client_hellos_mtx);
+    HASH_ITER(hh, client_hellos, e, tmp) {
+        client_hello_del(e);
     }
+    enif_mutex_unlock(client_hellos_mtx);
+}
 
-    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
-    res = (int) SSL_CTX_set_tmp_dh(ctx, dh);
+static int allow_early_data_cb(SSL *ssl, void *arg) {
+    unsigned char random[SSL3_RANDOM_SIZE];
+    client_hello_t *e = NULL;
+    time_t now = time(NULL);
+    int ret = 0;
+
+    if (SSL_get_client_random(ssl, random, sizeof(random)) != sizeof(random))
+        return 0;
+
+    enif_rwlock_rlock(ticket_keys_lock);
+    ret = !ticket_keys_shared;
+    enif_rwlock_runlock(ticket_keys_lock);
+    if (!ret)
+        return 0;
+    ret = 0;
+
+    enif_mutex_lock(client_hellos_mtx);
+    /* Entries are in arrival order, so the expired ones come first */
+    while (client_hellos && client_hellos->expires <= now)
+        client_hello_del(client_hellos);
+    HASH_FIND(hh, client_hellos, random, sizeof(random), e);
+    /* When the window is full, early data is rejected rather than
+     * risking a replay */
+    if (!e && client_hellos_num < EARLY_DATA_MAX_HELLOS) {
+        e = enif_alloc(sizeof(client_hello_t));
+        if (e) {
+            memcpy(e->random, random, sizeof(random));
+            e->expires = now + EARLY_DATA_WINDOW;
+            HASH_ADD(hh, client_hellos, random, sizeof(random), e);
+            client_hellos_num++;
+            ret = 1;
+        }
+    }
+    enif_mutex_unlock(client_hellos_mtx);
 
-    DH_free(dh);
-    return res;
+    return ret;
 }
-
 #endif
 
-#ifndef SSL_OP_NO_RENEGOTIATION
-static void ssl_info_callback(const SSL *s, int where, int ret) {
-    state_t *d = (state_t *) SSL_get_ex_data(s, ssl_index);
-    if ((where & SSL_CB_HANDSHAKE_START)) {
-        d->handshakes++;
-    }
+/*
+ * Session ticket keys, in the 48 or 80 byte format used by nginx:
+ * a 16 byte key name followed by the HMAC-SHA256 and AES-CBC keys,
+ * 16 bytes each (AES-128) or 32 bytes each (AES-256). New tickets are
+ * encrypted with the first key, the others are only accepted so keys
+ * can be rotated across nodes. Contexts look the ring up on each
+ * ticket, so a new ring applies to all of them at once.
+ */
+typedef struct {
+    unsigned char name[16];
+    unsigned char hmac_key[32];
+    unsigned char aes_key[32];
+    size_t size;
+} ticket_key_t;
+
+static ticket_key_t *ticket_keys = NULL;
+static unsigned int ticket_keys_num = 0;
+
+static int parse_ticket_key(const unsigned char *data, size_t len,
+                            ticket_key_t *key) {
+    if (len != 48 && len != 80)
+        return 0;
+    key->size = (len - 16) / 2;
+    memcpy(key->name, data, 16);
+    memcpy(key->hmac_key, data + 16, key->size);
+    memcpy(key->aes_key, data + 16 + key->size, key->size);
+    return 1;
 }
-#endif
 
-static char *create_ssl_for_cert(char *, state_t *);
+static void set_ticket_keys(ticket_key_t *keys, unsigned int num,
+                            int shared) {
+    ticket_key_t *old;
+    unsigned int old_num;
+
+    enif_rwlock_rwlock(ticket_keys_lock);
+    old = ticket_keys;
+    old_num = ticket_keys_num;
+    ticket_keys = keys;
+    ticket_keys_num = num;
+    ticket_keys_shared = shared;
+    enif_rwlock_rwunlock(ticket_keys_lock);
+
+    if (old) {
+        OPENSSL_cleanse(old, old_num * sizeof(ticket_key_t));
+        enif_free(old);
+    }
+}
 
-static cert_info_t *lookup_certfile(const char *domain) {
-    cert_info_t *ret = NULL;
-    cert_info_t *info = NULL;
+/* Used until set_ticket_keys/1 is called, good for a single node */
+static int init_ticket_keys() {
+    unsigned char data[80];
+    ticket_key_t *key = enif_alloc(sizeof(ticket_key_t));
+
+    if (!key)
+        return 0;
+    if (RAND_bytes(data, sizeof(data)) <= 0 ||
+        !parse_ticket_key(data, sizeof(data), key)) {
+        enif_free(key);
+        return 0;
+    }
+    OPENSSL_cleanse(data, sizeof(data));
+    set_ticket_keys(key, 1, 0);
+    return 1;
+}
 
-    if (domain) {
-        size_t len = strlen(domain);
-        if (len) {
-            char name[len + 1];
-            name[len] = 0;
-            size_t i = 0;
-            for (i = 0; i < len; i++)
-                name[i] = tolower(domain[i]);
-            HASH_FIND_STR(certfiles_map, name, info);
-            if (info && info->file)
-                ret = info;
-            else {
-                /* Replace the first domain part with '*' and retry */
-                char *dot = strchr(name, '.');
-                if (dot != NULL && name[0] != '.') {
-                    char *glob = dot - 1;
-                    glob[0] = '*';
-                    HASH_FIND_STR(certfiles_map, glob, info);
-                    if (info && info->file)
-                        ret = info;
-                }
-            }
+/*
+ * Copies the key to use into *key. Returns 0 if there is none,
+ * 2 if the ticket should be renewed with the current key, 1 otherwise.
+ */
+static int find_ticket_key(const unsigned char *name, int enc,
+                           ticket_key_t *key) {
+    unsigned int i;
+    int ret = 0;
+
+    enif_rwlock_rlock(ticket_keys_lock);
+    for (i = 0; i < ticket_keys_num; i++) {
+        if (enc || !memcmp(ticket_keys[i].name, name, 16)) {
+            *key = ticket_keys[i];
+            ret = i == 0 ? 1 : 2;
+            break;
         }
     }
+    enif_rwlock_runlock(ticket_keys_lock);
+
     return ret;
 }
 
-static int ssl_sni_callback(const SSL *s, int *foo, void *data) {
-    cert_info_t *info = NULL;
-    char *err_str = NULL;
-    const char *servername = NULL;
-    int ret = SSL_TLSEXT_ERR_OK;
-    state_t *state = (state_t *) SSL_get_ex_data(s, ssl_index);
+#if defined(HAS_TICKET_EVP_CB) || defined(SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+#ifdef HAS_TICKET_EVP_CB
+static int set_ticket_hmac_key(EVP_MAC_CTX *hctx, ticket_key_t *key) {
+    OSSL_PARAM params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  key->hmac_key, key->size);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
 
-    servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
-    enif_rwlock_rlock(certfiles_map_lock);
-    info = lookup_certfile(servername);
-    if (info) {
-        if (strcmp(info->file, state->cert_file))
-            err_str = create_ssl_for_cert(info->file, state);
-        if (err_str) {
-            state->sni_error = err_str;
-            ret = SSL_TLSEXT_ERR_ALERT_FATAL;
-        }
-    } else if (strlen(state->cert_file) == 0) {
-        state->sni_error =
-                "Failed to find a certificate matching the domain in SNI extension";
-        ret = SSL_TLSEXT_ERR_ALERT_FATAL;
+static int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc) {
+#else
+static int set_ticket_hmac_key(HMAC_CTX *hctx, ticket_key_t *key) {
+    return HMAC_Init_ex(hctx, key->hmac_key, key->size, EVP_sha256(), NULL);
+}
+
+static int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc) {
+#endif
+    ticket_key_t key;
+    const EVP_CIPHER *cipher;
+    int ret = find_ticket_key(name, enc, &key);
+
+    if (ret == 0)
+        return enc ? -1 : 0;
+
+    cipher = key.size == 16 ? EVP_aes_128_cbc() : EVP_aes_256_cbc();
+    if (enc) {
+        memcpy(name, key.name, 16);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) <= 0 ||
+            !EVP_EncryptInit_ex(ctx, cipher, NULL, key.aes_key, iv))
+            ret = -1;
+    } else if (!EVP_DecryptInit_ex(ctx, cipher, NULL, key.aes_key, iv)) {
+        ret = -1;
     }
-    enif_rwlock_runlock(certfiles_map_lock);
+    if (ret > 0 && !set_ticket_hmac_key(hctx, &key))
+        ret = -1;
 
+    OPENSSL_cleanse(&key, sizeof(key));
     return ret;
 }
+#endif
 
-#define ERR_T(T) enif_make_tuple2(env, enif_make_atom(env, "error"), T)
-#define OK_T(T) enif_make_tuple2(env, enif_make_atom(env, "ok"), T)
-#define SEND_T(T) enif_make_tuple2(env, enif_make_atom(env, "send"), T)
+#ifdef HAS_IOQ_BIO
+/*
+ * BIO reading encrypted input directly from an ErlNifIOQueue of
+ * the binaries received from the peer, so the input does not need
+ * to be flattened and copied to a memory BIO first.
+ */
+static BIO_METHOD *ioq_bio_method = NULL;
+
+static int ioq_bio_create(BIO *bio) {
+    ErlNifIOQueue *q = enif_ioq_create(ERL_NIF_IOQ_NORMAL);
+    if (!q)
+        return 0;
+    BIO_set_data(bio, q);
+    BIO_set_init(bio, 1);
+    return 1;
+}
 
-#define SET_CERTIFICATE_FILE_ACCEPT 1
-#define SET_CERTIFICATE_FILE_CONNECT 2
-#define VERIFY_NONE 0x10000
-#define COMPRESSION_NONE 0x100000
+static int ioq_bio_destroy(BIO *bio) {
+    ErlNifIOQueue *q = BIO_get_data(bio);
+    if (q)
+        enif_ioq_destroy(q);
+    BIO_set_data(bio, NULL);
+    BIO_set_init(bio, 0);
+    return 1;
+}
 
-static ERL_NIF_TERM ssl_error(ErlNifEnv *env, const char *errstr) {
-    size_t rlen;
-    ErlNifBinary err;
-    size_t errstrlen = strlen(errstr);
-    unsigned long error_code = ERR_get_error();
-    char *error_string = error_code ? ERR_error_string(error_code, NULL) : NULL;
-    size_t error_string_length = error_string ? strlen(error_string) : 0;
-    if (error_code)
-        rlen = errstrlen + error_string_length + 2;
-    else
-        rlen = errstrlen;
-    enif_alloc_binary(rlen, &err);
-    memcpy(err.data, errstr, errstrlen);
-    if (error_code) {
-        memcpy(err.data + errstrlen, ": ", 2);
-        memcpy(err.data + 2 + errstrlen, error_string, error_string_length);
+static int ioq_bio_read(BIO *bio, char *buf, int len) {
+    ErlNifIOQueue *q = BIO_get_data(bio);
+    SysIOVec *iov;
+    int iovlen, i;
+    size_t rlen = 0;
+
+    BIO_clear_retry_flags(bio);
+    iov = enif_ioq_peek(q, &iovlen);
+    for (i = 0; i < iovlen && rlen < len; i++) {
+        size_t size = iov[i].iov_len;
+        if (size > len - rlen)
+            size = len - rlen;
+        memcpy(buf + rlen, iov[i].iov_base, size);
+        rlen += size;
     }
-    return ERR_T(enif_make_binary(env, &err));
+    if (rlen == 0) {
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    enif_ioq_deq(q, rlen, NULL);
+    return rlen;
 }
 
-static SSL_CTX *create_new_ctx(char *cert_file, char *ciphers,
-                               char *dh_file, char *ca_file,
-                               unsigned int command,
-                               char **err_str) {
-    long verifyopts;
-    int res = 0;
-
-    SSL_CTX *ctx = SSL_CTX_new(SSLv23_method());
-    if (!ctx) {
-        *err_str = "SSL_CTX_new failed";
-        return NULL;
+static long ioq_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    switch (cmd) {
+        case BIO_CTRL_PENDING:
+            return enif_ioq_size(BIO_get_data(bio));
+        case BIO_CTRL_FLUSH:
+            return 1;
+        default:
+            return 0;
     }
-    if (cert_file) {
-        res = SSL_CTX_use_certificate_chain_file(ctx, cert_file);
-        if (res <= 0) {
-            SSL_CTX_free(ctx);
-            *err_str = "SSL_CTX_use_certificate_file failed";
-            return NULL;
-        }
-        res = SSL_CTX_use_PrivateKey_file(ctx, cert_file, SSL_FILETYPE_PEM);
-        if (res <= 0) {
-            SSL_CTX_free(ctx);
-            *err_str = "SSL_CTX_use_PrivateKey_file failed";
-            return NULL;
-        }
-        res = SSL_CTX_check_private_key(ctx);
-        if (res <= 0) {
-            SSL_CTX_free(ctx);
-            *err_str = "SSL_CTX_check_private_key failed";
-            return NULL;
+}
+
+static int init_ioq_bio_method() {
+    ioq_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                  "erlang ioq");
+    if (!ioq_bio_method)
+        return 0;
+    BIO_meth_set_create(ioq_bio_method, ioq_bio_create);
+    BIO_meth_set_destroy(ioq_bio_method, ioq_bio_destroy);
+    BIO_meth_set_read(ioq_bio_method, ioq_bio_read);
+    BIO_meth_set_ctrl(ioq_bio_method, ioq_bio_ctrl);
+    return 1;
+}
+
+/*
+ * Passes the encrypted data to OpenSSL. Must be called with state->mtx held.
+ * Returns 0 if the data is not an iolist.
+ */
+static int write_encrypted_input(ErlNifEnv *env, state_t *state,
+                                 ERL_NIF_TERM data) {
+    ErlNifIOQueue *q = BIO_get_data(state->bio_read);
+    ErlNifIOVec vec, *iovec = &vec;
+    ErlNifBinary input, bin;
+    ERL_NIF_TERM tail;
+
+    if (enif_is_binary(env, data))
+        data = enif_make_list1(env, data);
+
+    /* Flat lists of binaries are queued by reference */
+    if (enif_inspect_iovec(env, ~((size_t) 0), data, &tail, &iovec))
+        return enif_ioq_enqv(q, iovec, 0);
+
+    if (!enif_inspect_iolist_as_binary(env, data, &input))
+        return 0;
+    if (input.size == 0)
+        return 1;
+    if (!enif_alloc_binary(input.size, &bin))
+        return 0;
+    memcpy(bin.data, input.data, input.size);
+    return enif_ioq_enq_binary(q, &bin, 0);
+}
+
+/* Takes ownership of the binary. Must be called with state->mtx held. */
+static int feed_encrypted_input(state_t *state, ErlNifBinary *bin) {
+    return enif_ioq_enq_binary(BIO_get_data(state->bio_read), bin, 0);
+}
+#else
+static int write_encrypted_input(ErlNifEnv *env, state_t *state,
+                                 ERL_NIF_TERM data) {
+    ErlNifBinary input;
+
+    if (!enif_inspect_iolist_as_binary(env, data, &input))
+        return 0;
+    if (input.size > 0)
+        BIO_write(state->bio_read, input.data, input.size);
+    return 1;
+}
+
+static int feed_encrypted_input(state_t *state, ErlNifBinary *bin) {
+    BIO_write(state->bio_read, bin->data, bin->size);
+    enif_release_binary(bin);
+    return 1;
+}
+#endif
+
+#ifdef HAS_BIO_METHOD
+/*
+ * BIO collecting the encrypted records written by OpenSSL, each in its
+ * own exactly sized binary, so they can be handed to Erlang without
+ * another copy.
+ */
+#ifdef HAS_KTLS
+#define KTLS_OFF 0
+#define KTLS_READY 1
+#define KTLS_ON 2
+/* The kernel keys can't be used anymore, every write fails */
+#define KTLS_FAILED 3
+
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+    struct tls12_crypto_info_aes_ccm_128 ccm128;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20;
+#endif
+} ktls_crypto_info_t;
+#endif
+
+typedef struct {
+    ErlNifBinary *chunks;
+    int len;
+    int size;
+    size_t pending;
+    /* Bytes of chunks[0] already written to the socket */
+    size_t skip;
+#ifdef HAS_KTLS
+    /*
+     * Once OpenSSL switches to KTLS it writes plaintext records,
+     * which are held back from chunks[ktls_held] on until the keys
+     * are installed on the socket.
+     */
+    int ktls;
+    int ktls_fd;
+    int ktls_held;
+    int ktls_ctrl_msg;
+    /* A KeyUpdate was sent, the next write needs the new keys */
+    int ktls_rekey;
+    size_t ktls_info_len;
+    ktls_crypto_info_t ktls_info;
+#endif
+} chunk_bio_t;
+
+static BIO_METHOD *chunk_bio_method = NULL;
+
+static int chunk_bio_create(BIO *bio) {
+    chunk_bio_t *out = enif_alloc(sizeof(chunk_bio_t));
+    if (!out)
+        return 0;
+    memset(out, 0, sizeof(chunk_bio_t));
+#ifdef HAS_KTLS
+    out->ktls_fd = -1;
+#endif
+    BIO_set_data(bio, out);
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static int chunk_bio_destroy(BIO *bio) {
+    chunk_bio_t *out = BIO_get_data(bio);
+    int i;
+
+    if (out) {
+        for (i = 0; i < out->len; i++)
+            enif_release_binary(&out->chunks[i]);
+        enif_free(out->chunks);
+#ifdef HAS_KTLS
+        OPENSSL_cleanse(&out->ktls_info, sizeof(out->ktls_info));
+#endif
+        enif_free(out);
+    }
+    BIO_set_data(bio, NULL);
+    BIO_set_init(bio, 0);
+    return 1;
+}
+
+#ifdef HAS_KTLS
+/*
+ * Records other than application data need a control message giving
+ * their type, which cannot be passed through gen_tcp, so they are
+ * written to the socket directly. The kernel encrypts each write when
+ * it is made, so a record overtaking data still queued in the inet
+ * driver is encrypted with the right keys. A short write would leave
+ * a partial record behind and fails the connection.
+ */
+static int ktls_send_ctrl_msg(chunk_bio_t *out, const char *buf, int len) {
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *((unsigned char *) CMSG_DATA(cmsg)) = out->ktls_ctrl_msg;
+
+    if (sendmsg(out->ktls_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        out->ktls = KTLS_FAILED;
+        return -1;
+    }
+    /* With TLS 1.3 the only handshake message sent now is KeyUpdate */
+    if (out->ktls_ctrl_msg == SSL3_RT_HANDSHAKE)
+        out->ktls_rekey = 1;
+    return len;
+}
+#endif
+
+static int chunk_bio_write(BIO *bio, const char *buf, int len) {
+    chunk_bio_t *out = BIO_get_data(bio);
+
+    BIO_clear_retry_flags(bio);
+    if (len <= 0)
+        return 0;
+#ifdef HAS_KTLS
+    if (out->ktls == KTLS_FAILED)
+        return -1;
+    if (out->ktls != KTLS_OFF && out->ktls_ctrl_msg) {
+        /* Before the keys are installed the record type can't be kept */
+        if (out->ktls != KTLS_ON) {
+            out->ktls = KTLS_FAILED;
+            return -1;
         }
+        return ktls_send_ctrl_msg(out, buf, len);
+    }
+    /*
+     * OpenSSL releases that don't hand over the new keys after a
+     * KeyUpdate keep writing plaintext the kernel would encrypt with
+     * the old keys, which the peer can't decrypt anymore.
+     */
+    if (out->ktls_rekey) {
+        out->ktls = KTLS_FAILED;
+        return -1;
+    }
+#endif
+    if (out->len == out->size) {
+        int size = out->size ? out->size * 2 : 4;
+        ErlNifBinary *chunks = enif_realloc(out->chunks,
+                                            size * sizeof(ErlNifBinary));
+        if (!chunks)
+            return -1;
+        out->chunks = chunks;
+        out->size = size;
     }
+    if (!enif_alloc_binary(len, &out->chunks[out->len]))
+        return -1;
+    memcpy(out->chunks[out->len].data, buf, len);
+    out->len++;
+    out->pending += len;
+    return len;
+}
 
-    if (command == SET_CERTIFICATE_FILE_ACCEPT) {
-        SSL_CTX_set_tlsext_servername_callback(ctx, &ssl_sni_callback);
-        verifyopts = SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE;
-        if (ca_file) {
-            SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(ca_file));
+#ifdef HAS_KTLS
+static size_t ktls_crypto_info_len(struct tls_crypto_info *info) {
+    switch (info->cipher_type) {
+        case TLS_CIPHER_AES_GCM_128:
+            return sizeof(struct tls12_crypto_info_aes_gcm_128);
+        case TLS_CIPHER_AES_GCM_256:
+            return sizeof(struct tls12_crypto_info_aes_gcm_256);
+        case TLS_CIPHER_AES_CCM_128:
+            return sizeof(struct tls12_crypto_info_aes_ccm_128);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        case TLS_CIPHER_CHACHA20_POLY1305:
+            return sizeof(struct tls12_crypto_info_chacha20_poly1305);
+#endif
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Called by OpenSSL when it switches to new traffic keys. Only TLS 1.3
+ * transmit keys are taken: TLS 1.2 would send its Finished message
+ * while the keys are held back. The keys after a KeyUpdate replace
+ * the installed ones, which needs Linux 6.14; the socket can't go back
+ * to userspace encryption, so if the kernel refuses the connection
+ * fails.
+ */
+static long chunk_bio_set_ktls(chunk_bio_t *out, long tx,
+                               struct tls_crypto_info *info) {
+    size_t len;
+
+    if (!tx || out->ktls_fd < 0 || info->version != TLS_1_3_VERSION)
+        return 0;
+    len = ktls_crypto_info_len(info);
+    if (len == 0 || len > sizeof(ktls_crypto_info_t))
+        return 0;
+    if (out->ktls == KTLS_ON) {
+        if (setsockopt(out->ktls_fd, SOL_TLS, TLS_TX, info, len) < 0) {
+            out->ktls = KTLS_FAILED;
+            return 0;
         }
+        out->ktls_rekey = 0;
+        return 1;
+    }
+    if (out->ktls != KTLS_OFF)
+        return 0;
+    memcpy(&out->ktls_info, info, len);
+    out->ktls_info_len = len;
+    out->ktls_held = out->len;
+    out->ktls = KTLS_READY;
+    return 1;
+}
+#endif
+
+static long chunk_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    chunk_bio_t *out = BIO_get_data(bio);
+
+    switch (cmd) {
+        case BIO_CTRL_PENDING:
+            return out->pending;
+        case BIO_CTRL_FLUSH:
+            return 1;
+#ifdef HAS_KTLS
+        case BIO_CTRL_SET_KTLS:
+            return chunk_bio_set_ktls(out, num, ptr);
+        case BIO_CTRL_GET_KTLS_SEND:
+            return out->ktls != KTLS_OFF;
+        case BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG:
+            out->ktls_ctrl_msg = num;
+            return 1;
+        case BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG:
+            out->ktls_ctrl_msg = 0;
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+static int init_chunk_bio_method() {
+    chunk_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                    "erlang chunks");
+    if (!chunk_bio_method)
+        return 0;
+    BIO_meth_set_create(chunk_bio_method, chunk_bio_create);
+    BIO_meth_set_destroy(chunk_bio_method, chunk_bio_destroy);
+    BIO_meth_set_write(chunk_bio_method, chunk_bio_write);
+    BIO_meth_set_ctrl(chunk_bio_method, chunk_bio_ctrl);
+    return 1;
+}
+
+/*
+ * Returns the pending encrypted output as a binary, or as an iolist
+ * of binaries if OpenSSL wrote several records.
+ * Must be called with state->mtx held.
+ */
+static ERL_NIF_TERM encrypted_output(ErlNifEnv *env, state_t *state) {
+    chunk_bio_t *out = BIO_get_data(state->bio_write);
+    ERL_NIF_TERM output;
+    int i, len = out->len;
+
+#ifdef HAS_KTLS
+    if (out->ktls == KTLS_READY)
+        len = out->ktls_held;
+#endif
+    if (len == 0) {
+        enif_make_new_binary(env, 0, &output);
+    } else if (len == 1) {
+        out->pending -= out->chunks[0].size;
+        output = enif_make_binary(env, &out->chunks[0]);
     } else {
-        verifyopts = SSL_VERIFY_PEER;
+        output = enif_make_list(env, 0);
+        for (i = len - 1; i >= 0; i--) {
+            out->pending -= out->chunks[i].size;
+            output = enif_make_list_cell(env,
+                                         enif_make_binary(env, &out->chunks[i]),
+                                         output);
+        }
     }
+    if (len < out->len)
+        memmove(out->chunks, out->chunks + len,
+                (out->len - len) * sizeof(ErlNifBinary));
+    out->len -= len;
+#ifdef HAS_KTLS
+    out->ktls_held = 0;
+#endif
+    return output;
+}
+#else
+/* Must be called with state->mtx held */
+static ERL_NIF_TERM encrypted_output(ErlNifEnv *env, state_t *state) {
+    ERL_NIF_TERM output;
+    size_t size = BIO_ctrl_pending(state->bio_write);
+    unsigned char *buf = enif_make_new_binary(env, size, &output);
+
+    if (size > 0)
+        BIO_read(state->bio_write, buf, size);
+    return output;
+}
+#endif
 
-    if (ciphers[0] == 0)
-        SSL_CTX_set_cipher_list(ctx, CIPHERS);
-    else
-        SSL_CTX_set_cipher_list(ctx, ciphers);
+#ifdef HAS_KTLS
+static int ktls_status(state_t *state) {
+    return ((chunk_bio_t *) BIO_get_data(state->bio_write))->ktls;
+}
 
-#ifndef OPENSSL_NO_ECDH
-    setup_ecdh(ctx);
+/*
+ * Wipes the keys and the plaintext held for the kernel if they were
+ * never installed. Must be called with state->mtx held.
+ */
+static void ktls_discard(state_t *state) {
+    chunk_bio_t *out = BIO_get_data(state->bio_write);
+    int i;
+
+    if (out->ktls != KTLS_READY)
+        return;
+    OPENSSL_cleanse(&out->ktls_info, sizeof(out->ktls_info));
+    for (i = out->ktls_held; i < out->len; i++) {
+        OPENSSL_cleanse(out->chunks[i].data, out->chunks[i].size);
+        out->pending -= out->chunks[i].size;
+        enif_release_binary(&out->chunks[i]);
+    }
+    out->len = out->ktls_held;
+    out->ktls = KTLS_FAILED;
+}
+#else
+#define KTLS_OFF 0
+#define KTLS_READY 1
+#define KTLS_ON 2
+#define ktls_status(state) KTLS_OFF
 #endif
-#ifndef OPENSSL_NO_DH
-    res = setup_dh(ctx, dh_file);
-    if (res <= 0) {
-        SSL_CTX_free(ctx);
-        *err_str = "Setting DH parameters failed";
+
+static state_t *init_tls_state() {
+    state_t *state = enif_alloc_resource(tls_state_t, sizeof(state_t));
+    if (!state) return NULL;
+    memset(state, 0, sizeof(state_t));
+    state->fd = -1;
+    state->mtx = enif_mutex_create("");
+    if (!state->mtx) {
+        enif_release_resource(state);
+        return NULL;
+    }
+#ifdef HAS_IOQ
+    state->write_queue = enif_ioq_create(ERL_NIF_IOQ_NORMAL);
+    if (!state->write_queue) {
+        enif_release_resource(state);
         return NULL;
     }
 #endif
+    state->valid = 1;
+    return state;
+}
 
-    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
-    if (ca_file)
-        SSL_CTX_load_verify_locations(ctx, ca_file, NULL);
+#ifdef HAS_SOCKET_MODE
+static void stop_tls_state(ErlNifEnv *env, void *data, ErlNifEvent fd,
+                           int is_direct_call);
+#endif
+
+static void destroy_tls_state(ErlNifEnv *env, void *data) {
+    state_t *state = (state_t *) data;
+    if (state) {
+        if (state->ssl)
+            SSL_free(state->ssl);
+        if (state->mtx)
+            enif_mutex_destroy(state->mtx);
+#ifdef HAS_IOQ
+        if (state->write_queue)
+            enif_ioq_destroy(state->write_queue);
+#else
+        while (state->write_queue) {
+            write_chunk_t *chunk = state->write_queue;
+            state->write_queue = chunk->next;
+            enif_free(chunk);
+        }
+#endif
+        if (state->read_buffer)
+            enif_free(state->read_buffer);
+#ifdef HAS_SOCKET_MODE
+        /* A descriptor in a select set keeps the resource alive, so
+         * this one was never selected and can be stopped directly */
+        if (state->fd >= 0)
+            stop_tls_state(env, state, state->fd, 1);
+#endif
+        if (state->profile)
+            enif_release_resource(state->profile);
+        memset(state, 0, sizeof(state_t));
+    }
+}
+
+static void destroy_profile(ErlNifEnv *env, void *data) {
+    profile_t *profile = (profile_t *) data;
+    if (profile) {
+        if (profile->ctx)
+            SSL_CTX_free(profile->ctx);
+        if (profile->mtx)
+            enif_mutex_destroy(profile->mtx);
+        if (profile->cert_file)
+            enif_free(profile->cert_file);
+        if (profile->session_key)
+            enif_free(profile->session_key);
+        memset(profile, 0, sizeof(profile_t));
+    }
+}
+
+#ifdef HAS_SOCKET_MODE
+static void stop_tls_state(ErlNifEnv *env, void *data, ErlNifEvent fd,
+                           int is_direct_call) {
+    close(fd);
+}
+
+/*
+ * Takes the socket out of the NIF, it is closed in stop_tls_state().
+ * Must be called with state->mtx held.
+ */
+static void stop_socket(ErlNifEnv *env, state_t *state) {
+    if (state->has_owner) {
+        enif_demonitor_process(env, state, &state->owner_mon);
+        state->has_owner = 0;
+    }
+    if (state->fd >= 0) {
+        enif_select(env, state->fd, ERL_NIF_SELECT_STOP, state, NULL,
+                    enif_make_atom(env, "undefined"));
+        state->fd = -1;
+    }
+}
+
+/*
+ * Monitors the process owning the TCP socket: the duplicate held by
+ * the NIF would otherwise outlive the port if the owner exits without
+ * closing the TLS socket. Must be called with state->mtx held.
+ */
+static void monitor_socket_owner(ErlNifEnv *env, state_t *state,
+                                 const ErlNifPid *pid) {
+    if (state->fd < 0)
+        return;
+    if (state->has_owner)
+        enif_demonitor_process(env, state, &state->owner_mon);
+    state->owner = *pid;
+    state->has_owner = 1;
+    if (enif_monitor_process(env, state, pid, &state->owner_mon) != 0) {
+        /* Already gone */
+        state->has_owner = 0;
+        state->valid = 0;
+        stop_socket(env, state);
+    }
+}
+
+static void down_tls_state(ErlNifEnv *env, void *data, ErlNifPid *pid,
+                           ErlNifMonitor *mon) {
+    state_t *state = (state_t *) data;
+
+    if (!state->mtx)
+        return;
+    enif_mutex_lock(state->mtx);
+    /* The down message of a replaced owner may still arrive */
+    if (state->has_owner &&
+        enif_is_identical(enif_make_pid(env, pid),
+                          enif_make_pid(env, &state->owner))) {
+        state->has_owner = 0;
+        state->valid = 0;
+#ifdef HAS_KTLS
+        ktls_discard(state);
+#endif
+        stop_socket(env, state);
+    }
+    enif_mutex_unlock(state->mtx);
+}
+#endif
+
+static void locking_callback(int mode, int n, const char *file, int line) {
+    if (mode & CRYPTO_LOCK)
+        enif_mutex_lock(mtx_buf[n]);
     else
-        SSL_CTX_set_default_verify_paths(ctx);
+        enif_mutex_unlock(mtx_buf[n]);
+}
+
+static void thread_id_callback(CRYPTO_THREADID *id) {
+    CRYPTO_THREADID_set_pointer(id, enif_thread_self());
+}
+
+static int atomic_add_callback(int *pointer, int amount, int type, const char *file, int line) {
+    return __sync_add_and_fetch(pointer, amount);
+}
+
+static void stop_workers();
+static int queue_job(tls_job_t *job);
+#ifdef HAS_ASYNC_MODE
+static ErlNifMutex *async_mtx = NULL;
+static void stop_async_poller();
+static int park_async_job(tls_job_t *job);
+#endif
+#ifdef HAS_INOTIFY
+static void stop_watcher();
+#endif
+
+static int load(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info) {
+    int i;
+    ErlNifSysInfo sys_info;
+
+#ifndef HAS_ATOMICS
+    atomic_mtx = enif_mutex_create("atomic_mtx");
+#endif
+    enif_system_info(&sys_info, sizeof(ErlNifSysInfo));
+#ifdef HAS_DIRTY_SCHEDULERS
+    dirty_schedulers = sys_info.dirty_scheduler_support;
+#endif
+
+    OpenSSL_add_ssl_algorithms();
+    SSL_load_error_strings();
+
+    mtx_buf = enif_alloc(CRYPTO_num_locks() * sizeof(ErlNifMutex *));
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        mtx_buf[i] = enif_mutex_create("");
+
+    CRYPTO_set_add_lock_callback(atomic_add_callback);
+    CRYPTO_set_locking_callback(locking_callback);
+    CRYPTO_THREADID_set_callback(thread_id_callback);
+
+    certs_map_lock = enif_rwlock_create("certs_map_lock");
+    certfiles_map_lock = enif_rwlock_create("certfiles_map_lock");
+    workers_mtx = enif_mutex_create("workers_mtx");
+#ifdef HAS_ASYNC_MODE
+    async_mtx = enif_mutex_create("async_mtx");
+#endif
+    handshake_jobs.cond = enif_cond_create("handshake_jobs_cond");
+    bulk_jobs.cond = enif_cond_create("bulk_jobs_cond");
+    ticket_keys_lock = enif_rwlock_create("ticket_keys_lock");
+    client_sessions_mtx = enif_mutex_create("client_sessions_mtx");
+    ctx_builds_mtx = enif_mutex_create("ctx_builds_mtx");
+    profile_cache_lock = enif_rwlock_create("profile_cache_lock");
+    mem_certs_lock = enif_rwlock_create("mem_certs_lock");
+    reload_mtx = enif_mutex_create("reload_mtx");
+#ifdef HAS_INOTIFY
+    watcher_mtx = enif_mutex_create("watcher_mtx");
+#endif
+#ifdef HAS_EARLY_DATA
+    client_hellos_mtx = enif_mutex_create("client_hellos_mtx");
+#endif
+    if (!init_ticket_keys())
+        return 1;
+    if (RAND_bytes((unsigned char *) sni_neg_key, sizeof(sni_neg_key)) <= 0)
+        return 1;
+    if (!init_md_ctxs())
+        return 1;
+
+    /* Two session cache shards per scheduler keep lock contention low */
+    session_shards_num = sys_info.scheduler_threads > 0 ?
+                         2 * sys_info.scheduler_threads : 1;
+    session_shards = enif_alloc(session_shards_num * sizeof(session_shard_t));
+    if (!session_shards)
+        return 1;
+    memset(session_shards, 0, session_shards_num * sizeof(session_shard_t));
+    for (i = 0; i < session_shards_num; i++)
+        session_shards[i].mtx = enif_mutex_create("session_shard");
+
+#ifdef HAS_BIO_METHOD
+    if (!init_chunk_bio_method())
+        return 1;
+#endif
+#ifdef HAS_IOQ_BIO
+    if (!init_ioq_bio_method())
+        return 1;
+#endif
+
+    ssl_index = SSL_get_ex_new_index(0, "ssl index", NULL, NULL, NULL);
+    ErlNifResourceFlags flags = ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER;
+#ifdef HAS_SOCKET_MODE
+    ErlNifResourceTypeInit init = {destroy_tls_state, stop_tls_state,
+                                   down_tls_state};
+    tls_state_t = enif_open_resource_type_x(env, "tls_state_t", &init,
+                                            flags, NULL);
+#else
+    tls_state_t = enif_open_resource_type(env, NULL, "tls_state_t",
+                                          destroy_tls_state,
+                                          flags, NULL);
+#endif
+    tls_profile_t = enif_open_resource_type(env, NULL, "tls_profile_t",
+                                            destroy_profile,
+                                            flags, NULL);
+    return 0;
+}
+
+static void unload(ErlNifEnv *env, void *priv) {
+    int i;
+
+    stop_workers();
+#ifdef HAS_ASYNC_MODE
+    /* After the workers, which park jobs, and the poller queues none
+     * once they're stopped */
+    stop_async_poller();
+    enif_mutex_destroy(async_mtx);
+    async_mtx = NULL;
+#endif
+    flush_profile_cache();
+    enif_rwlock_destroy(profile_cache_lock);
+    profile_cache_lock = NULL;
+    enif_cond_destroy(handshake_jobs.cond);
+    enif_cond_destroy(bulk_jobs.cond);
+    enif_mutex_destroy(workers_mtx);
+    handshake_jobs.cond = NULL;
+    bulk_jobs.cond = NULL;
+    workers_mtx = NULL;
+#ifdef HAS_INOTIFY
+    stop_watcher();
+    enif_mutex_destroy(watcher_mtx);
+    watcher_mtx = NULL;
+#endif
+    enif_mutex_destroy(reload_mtx);
+    reload_mtx = NULL;
+    clear_certs_map();
+    clear_certfiles_map();
+    enif_rwlock_destroy(certs_map_lock);
+    enif_rwlock_destroy(certfiles_map_lock);
+    certs_map = NULL;
+    certs_map_lock = NULL;
+    certfiles_map = NULL;
+    certfiles_map_lock = NULL;
+    set_ticket_keys(NULL, 0, 0);
+    flush_client_sessions();
+    enif_mutex_destroy(client_sessions_mtx);
+    client_sessions_mtx = NULL;
+    enif_mutex_destroy(ctx_builds_mtx);
+    ctx_builds_mtx = NULL;
+    free_md_ctxs();
+    flush_mem_certs();
+    enif_rwlock_destroy(mem_certs_lock);
+    mem_certs_lock = NULL;
+#ifdef HAS_EARLY_DATA
+    flush_client_hellos();
+    enif_mutex_destroy(client_hellos_mtx);
+    client_hellos_mtx = NULL;
+#endif
+    enif_rwlock_destroy(ticket_keys_lock);
+    ticket_keys_lock = NULL;
+    flush_session_cache();
+    for (i = 0; i < session_shards_num; i++)
+        enif_mutex_destroy(session_shards[i].mtx);
+    enif_free(session_shards);
+    session_shards = NULL;
+    session_shards_num = 0;
+#ifdef HAS_IOQ_BIO
+    BIO_meth_free(ioq_bio_method);
+    ioq_bio_method = NULL;
+#endif
+#ifdef HAS_BIO_METHOD
+    BIO_meth_free(chunk_bio_method);
+    chunk_bio_method = NULL;
+#endif
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        enif_mutex_destroy(mtx_buf[i]);
+    enif_free(mtx_buf);
+    mtx_buf = NULL;
+#ifndef HAS_ATOMICS
+    enif_mutex_destroy(atomic_mtx);
+    atomic_mtx = NULL;
+#endif
+}
+
+static int verify_callback(int preverify_ok, X509_STORE_CTX *ctx) {
+    return 1;
+}
+
+/*
+ * ECDHE is enabled only on OpenSSL 1.0.0e and later.
+ * See http://www.openssl.org/news/secadv_20110906.txt
+ * for details.
+ */
+#ifndef OPENSSL_NO_ECDH
+
+static void setup_ecdh(SSL_CTX *ctx) {
+#if OPENSSL_VERSION_NUMBER < 0x10002000
+    EC_KEY *ecdh;
+
+    if (SSLeay() < 0x1000005fL) {
+        return;
+    }
+
+    ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
+    SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+
+    EC_KEY_free(ecdh);
+#else
+    SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+}
+
+#endif
+
+#ifndef OPENSSL_NO_DH
+/*
+  2048-bit MODP Group with 256-bit Prime Order Subgroup (RFC5114)
+*/
+static unsigned char dh2048_p[] = {
+        0x87, 0xA8, 0xE6, 0x1D, 0xB4, 0xB6, 0x66, 0x3C,
+        0xFF, 0xBB, 0xD1, 0x9C, 0x65, 0x19, 0x59, 0x99,
+        0x8C, 0xEE, 0xF6, 0x08, 0x66, 0x0D, 0xD0, 0xF2,
+        0x5D, 0x2C, 0xEE, 0xD4, 0x43, 0x5E, 0x3B, 0x00,
+        0xE0, 0x0D, 0xF8, 0xF1, 0xD6, 0x19, 0x57, 0xD4,
+        0xFA, 0xF7, 0xDF, 0x45, 0x61, 0xB2, 0xAA, 0x30,
+        0x16, 0xC3, 0xD9, 0x11, 0x34, 0x09, 0x6F, 0xAA,
+        0x3B, 0xF4, 0x29, 0x6D, 0x83, 0x0E, 0x9A, 0x7C,
+        0x20, 0x9E, 0x0C, 0x64, 0x97, 0x51, 0x7A, 0xBD,
+        0x5A, 0x8A, 0x9D, 0x30, 0x6B, 0xCF, 0x67, 0xED,
+        0x91, 0xF9, 0xE6, 0x72, 0x5B, 0x47, 0x58, 0xC0,
+        0x22, 0xE0, 0xB1, 0xEF, 0x42, 0x75, 0xBF, 0x7B,
+        0x6C, 0x5B, 0xFC, 0x11, 0xD4, 0x5F, 0x90, 0x88,
+        0xB9, 0x41, 0xF5, 0x4E, 0xB1, 0xE5, 0x9B, 0xB8,
+        0xBC, 0x39, 0xA0, 0xBF, 0x12, 0x30, 0x7F, 0x5C,
+        0x4F, 0xDB, 0x70, 0xC5, 0x81, 0xB2, 0x3F, 0x76,
+        0xB6, 0x3A, 0xCA, 0xE1, 0xCA, 0xA6, 0xB7, 0x90,
+        0x2D, 0x52, 0x52, 0x67, 0x35, 0x48, 0x8A, 0x0E,
+        0xF1, 0x3C, 0x6D, 0x9A, 0x51, 0xBF, 0xA4, 0xAB,
+        0x3A, 0xD8, 0x34, 0x77, 0x96, 0x52, 0x4D, 0x8E,
+        0xF6, 0xA1, 0x67, 0xB5, 0xA4, 0x18, 0x25, 0xD9,
+        0x67, 0xE1, 0x44, 0xE5, 0x14, 0x05, 0x64, 0x25,
+        0x1C, 0xCA, 0xCB, 0x83, 0xE6, 0xB4, 0x86, 0xF6,
+        0xB3, 0xCA, 0x3F, 0x79, 0x71, 0x50, 0x60, 0x26,
+        0xC0, 0xB8, 0x57, 0xF6, 0x89, 0x96, 0x28, 0x56,
+        0xDE, 0xD4, 0x01, 0x0A, 0xBD, 0x0B, 0xE6, 0x21,
+        0xC3, 0xA3, 0x96, 0x0A, 0x54, 0xE7, 0x10, 0xC3,
+        0x75, 0xF2, 0x63, 0x75, 0xD7, 0x01, 0x41, 0x03,
+        0xA4, 0xB5, 0x43, 0x30, 0xC1, 0x98, 0xAF, 0x12,
+        0x61, 0x16, 0xD2, 0x27, 0x6E, 0x11, 0x71, 0x5F,
+        0x69, 0x38, 0x77, 0xFA, 0xD7, 0xEF, 0x09, 0xCA,
+        0xDB, 0x09, 0x4A, 0xE9, 0x1E, 0x1A, 0x15, 0x97,
+};
+static unsigned char dh2048_g[] = {
+        0x3F, 0xB3, 0x2C, 0x9B, 0x73, 0x13, 0x4D, 0x0B,
+        0x2E, 0x77, 0x50, 0x66, 0x60, 0xED, 0xBD, 0x48,
+        0x4C, 0xA7, 0xB1, 0x8F, 0x21, 0xEF, 0x20, 0x54,
+        0x07, 0xF4, 0x79, 0x3A, 0x1A, 0x0B, 0xA1, 0x25,
+        0x10, 0xDB, 0xC1, 0x50, 0x77, 0xBE, 0x46, 0x3F,
+        0xFF, 0x4F, 0xED, 0x4A, 0xAC, 0x0B, 0xB5, 0x55,
+        0xBE, 0x3A, 0x6C, 0x1B, 0x0C, 0x6B, 0x47, 0xB1,
+        0xBC, 0x37, 0x73, 0xBF, 0x7E, 0x8C, 0x6F, 0x62,
+        0x90, 0x12, 0x28, 0xF8, 0xC2, 0x8C, 0xBB, 0x18,
+        0xA5, 0x5A, 0xE3, 0x13, 0x41, 0x00, 0x0A, 0x65,
+        0x01, 0x96, 0xF9, 0x31, 0xC7, 0x7A, 0x57, 0xF2,
+        0xDD, 0xF4, 0x63, 0xE5, 0xE9, 0xEC, 0x14, 0x4B,
+        0x77, 0x7D, 0xE6, 0x2A, 0xAA, 0xB8, 0xA8, 0x62,
+        0x8A, 0xC3, 0x76, 0xD2, 0x82, 0xD6, 0xED, 0x38,
+        0x64, 0xE6, 0x79, 0x82, 0x42, 0x8E, 0xBC, 0x83,
+        0x1D, 0x14, 0x34, 0x8F, 0x6F, 0x2F, 0x91, 0x93,
+        0xB5, 0x04, 0x5A, 0xF2, 0x76, 0x71, 0x64, 0xE1,
+        0xDF, 0xC9, 0x67, 0xC1, 0xFB, 0x3F, 0x2E, 0x55,
+        0xA4, 0xBD, 0x1B, 0xFF, 0xE8, 0x3B, 0x9C, 0x80,
+        0xD0, 0x52, 0xB9, 0x85, 0xD1, 0x82, 0xEA, 0x0A,
+        0xDB, 0x2A, 0x3B, 0x73, 0x13, 0xD3, 0xFE, 0x14,
+        0xC8, 0x48, 0x4B, 0x1E, 0x05, 0x25, 0x88, 0xB9,
+        0xB7, 0xD2, 0xBB, 0xD2, 0xDF, 0x01, 0x61, 0x99,
+        0xEC, 0xD0, 0x6E, 0x15, 0x57, 0xCD, 0x09, 0x15,
+        0xB3, 0x35, 0x3B, 0xBB, 0x64, 0xE0, 0xEC, 0x37,
+        0x7F, 0xD0, 0x28, 0x37, 0x0D, 0xF9, 0x2B, 0x52,
+        0xC7, 0x89, 0x14, 0x28, 0xCD, 0xC6, 0x7E, 0xB6,
+        0x18, 0x4B, 0x52, 0x3D, 0x1D, 0xB2, 0x46, 0xC3,
+        0x2F, 0x63, 0x07, 0x84, 0x90, 0xF0, 0x0E, 0xF8,
+        0xD6, 0x47, 0xD1, 0x48, 0xD4, 0x79, 0x54, 0x51,
+        0x5E, 0x23, 0x27, 0xCF, 0xEF, 0x98, 0xC5, 0x82,
+        0x66, 0x4B, 0x4C, 0x0F, 0x6C, 0xC4, 0x16, 0x59,
+};
+
+static int setup_dh(SSL_CTX *ctx, char *dh_file) {
+    DH *dh;
+    int res;
+
+    if (dh_file != NULL) {
+        BIO *bio = BIO_new_file(dh_file, "r");
+
+        if (bio == NULL) {
+            return 0;
+        }
+        dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+        if (dh == NULL) {
+            return 0;
+        }
+    } else {
+        dh = DH_new();
+        if (dh == NULL) {
+            return 0;
+        }
+        BIGNUM *dh_p = BN_bin2bn(dh2048_p, sizeof(dh2048_p), NULL);
+        BIGNUM *dh_g = BN_bin2bn(dh2048_g, sizeof(dh2048_g), NULL);
+        if (dh_p == NULL || dh_g == NULL) {
+            BN_free(dh_p);
+            BN_free(dh_g);
+            DH_free(dh);
+            return 0;
+        }
+
+        DH_set0_pqg(dh, dh_p, NULL, dh_g);
+    }
+
+    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
+    res = (int) SSL_CTX_set_tmp_dh(ctx, dh);
+
+    DH_free(dh);
+    return res;
+}
+
+#endif
+
+#ifndef SSL_OP_NO_RENEGOTIATION
+static void ssl_info_callback(const SSL *s, int where, int ret) {
+    state_t *d = (state_t *) SSL_get_ex_data(s, ssl_index);
+    if ((where & SSL_CB_HANDSHAKE_START)) {
+        d->handshakes++;
+    }
+}
+#endif
+
+static char *create_ssl_for_cert(char *, state_t *);
+
+/*
+ * The certificate file is copied, so that the context is looked up or
+ * built without holding certfiles_map_lock.
+ */
+static int ssl_sni_callback(const SSL *s, int *foo, void *data) {
+    cert_info_t *info = NULL;
+    char *err_str = NULL;
+    char *file = NULL;
+    const char *servername = NULL;
+    size_t len;
+    int found;
+    state_t *state = (state_t *) SSL_get_ex_data(s, ssl_index);
+
+    servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+    enif_rwlock_rlock(certfiles_map_lock);
+    info = lookup_certfile(servername);
+    found = info != NULL;
+    if (info && strcmp(info->file, state->profile->cert_file)) {
+        len = strlen(info->file) + 1;
+        file = enif_alloc(len);
+        if (file)
+            memcpy(file, info->file, len);
+        else
+            err_str = "Failed to allocate memory";
+    }
+    enif_rwlock_runlock(certfiles_map_lock);
+
+    if (file) {
+        err_str = create_ssl_for_cert(file, state);
+        enif_free(file);
+    } else if (!found && strlen(state->profile->cert_file) == 0) {
+        err_str =
+                "Failed to find a certificate matching the domain in SNI extension";
+    }
+    if (err_str) {
+        state->sni_error = err_str;
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+#define ERR_T(T) enif_make_tuple2(env, enif_make_atom(env, "error"), T)
+#define OK_T(T) enif_make_tuple2(env, enif_make_atom(env, "ok"), T)
+#define SEND_T(T) enif_make_tuple2(env, enif_make_atom(env, "send"), T)
+
+#define SET_CERTIFICATE_FILE_ACCEPT 1
+#define SET_CERTIFICATE_FILE_CONNECT 2
+#define VERIFY_NONE 0x10000
+#define COMPRESSION_NONE 0x100000
+#define ASYNC_MODE 0x200000
+#define TICKETS 0x400000
+#define EARLY_DATA 0x800000
+
+static ERL_NIF_TERM ssl_error(ErlNifEnv *env, const char *errstr) {
+    size_t rlen;
+    ErlNifBinary err;
+    size_t errstrlen = strlen(errstr);
+    unsigned long error_code = ERR_get_error();
+    char *error_string = error_code ? ERR_error_string(error_code, NULL) : NULL;
+    size_t error_string_length = error_string ? strlen(error_string) : 0;
+    if (error_code)
+        rlen = errstrlen + error_string_length + 2;
+    else
+        rlen = errstrlen;
+    enif_alloc_binary(rlen, &err);
+    memcpy(err.data, errstr, errstrlen);
+    if (error_code) {
+        memcpy(err.data + errstrlen, ": ", 2);
+        memcpy(err.data + 2 + errstrlen, error_string, error_string_length);
+    }
+    return ERR_T(enif_make_binary(env, &err));
+}
+
+/* Must be called with mem_certs_lock held */
+static char *use_mem_cert(SSL_CTX *ctx, const char *id) {
+    mem_cert_t *mc = NULL;
+
+    HASH_FIND_STR(mem_certs, id, mc);
+    if (!mc)
+        return "Certificate is not loaded";
+    if (SSL_CTX_use_certificate(ctx, mc->cert) <= 0)
+        return "SSL_CTX_use_certificate failed";
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    if (!SSL_CTX_set1_chain(ctx, mc->chain))
+        return "SSL_CTX_set1_chain failed";
+#else
+    int i;
+    for (i = 0; i < sk_X509_num(mc->chain); i++) {
+        X509 *x = sk_X509_value(mc->chain, i);
+        CRYPTO_add(&x->references, 1, CRYPTO_LOCK_X509);
+        if (!SSL_CTX_add_extra_chain_cert(ctx, x)) {
+            X509_free(x);
+            return "SSL_CTX_add_extra_chain_cert failed";
+        }
+    }
+#endif
+    if (SSL_CTX_use_PrivateKey(ctx, mc->key) <= 0)
+        return "SSL_CTX_use_PrivateKey failed";
+    return NULL;
+}
+
+static SSL_CTX *create_new_ctx(char *cert_file, char *ciphers,
+                               char *dh_file, char *ca_file,
+                               unsigned int command,
+                               char **err_str) {
+    long verifyopts;
+    int res = 0;
+
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_method());
+    if (!ctx) {
+        *err_str = "SSL_CTX_new failed";
+        return NULL;
+    }
+    if (cert_file && !strncmp(cert_file, MEM_CERT_PREFIX,
+                              strlen(MEM_CERT_PREFIX))) {
+        enif_rwlock_rlock(mem_certs_lock);
+        *err_str = use_mem_cert(ctx, cert_file);
+        enif_rwlock_runlock(mem_certs_lock);
+        if (*err_str) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+    } else if (cert_file) {
+        res = SSL_CTX_use_certificate_chain_file(ctx, cert_file);
+        if (res <= 0) {
+            SSL_CTX_free(ctx);
+            *err_str = "SSL_CTX_use_certificate_file failed";
+            return NULL;
+        }
+        res = SSL_CTX_use_PrivateKey_file(ctx, cert_file, SSL_FILETYPE_PEM);
+        if (res <= 0) {
+            SSL_CTX_free(ctx);
+            *err_str = "SSL_CTX_use_PrivateKey_file failed";
+            return NULL;
+        }
+    }
+    if (cert_file) {
+        res = SSL_CTX_check_private_key(ctx);
+        if (res <= 0) {
+            SSL_CTX_free(ctx);
+            *err_str = "SSL_CTX_check_private_key failed";
+            return NULL;
+        }
+    }
+
+    if (command == SET_CERTIFICATE_FILE_ACCEPT) {
+        SSL_CTX_set_tlsext_servername_callback(ctx, &ssl_sni_callback);
+#ifdef HAS_TICKET_EVP_CB
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#elif defined(SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB)
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+        verifyopts = SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE;
+        if (ca_file) {
+            SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(ca_file));
+        }
+    } else {
+        verifyopts = SSL_VERIFY_PEER;
+    }
+
+    if (ciphers[0] == 0)
+        SSL_CTX_set_cipher_list(ctx, CIPHERS);
+    else
+        SSL_CTX_set_cipher_list(ctx, ciphers);
+
+#ifndef OPENSSL_NO_ECDH
+    setup_ecdh(ctx);
+#endif
+#ifndef OPENSSL_NO_DH
+    res = setup_dh(ctx, dh_file);
+    if (res <= 0) {
+        SSL_CTX_free(ctx);
+        *err_str = "Setting DH parameters failed";
+        return NULL;
+    }
+#endif
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (ca_file)
+        SSL_CTX_load_verify_locations(ctx, ca_file, NULL);
+    else
+        SSL_CTX_set_default_verify_paths(ctx);
+
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+    SSL_CTX_set_verify(ctx, verifyopts, verify_callback);
+
+#ifndef SSL_OP_NO_RENEGOTIATION
+    SSL_CTX_set_info_callback(ctx, &ssl_info_callback);
+#endif
+
+    *err_str = NULL;
+    return ctx;
+}
+
+static int is_mem_cert(const char *file) {
+    return !strncmp(file, MEM_CERT_PREFIX, strlen(MEM_CERT_PREFIX));
+}
+
+static void get_file_stamp(const char *file, file_stamp_t *stamp) {
+    struct stat st;
+
+    memset(stamp, 0, sizeof(file_stamp_t));
+    if (*file && !is_mem_cert(file) && stat(file, &st) == 0) {
+        stamp->dev = st.st_dev;
+        stamp->ino = st.st_ino;
+        stamp->mtime = st.st_mtime;
+        stamp->size = st.st_size;
+    }
+}
+
+static int same_file_stamp(const file_stamp_t *a, const file_stamp_t *b) {
+    return a->dev == b->dev && a->ino == b->ino &&
+           a->mtime == b->mtime && a->size == b->size;
+}
+
+/* Copies the files of a certs_map entry into a single allocation */
+static int copy_ctx_files(cert_info_t *info, const char *cert_file,
+                          const char *ciphers, const char *dh_file,
+                          const char *ca_file, unsigned int command) {
+    size_t cert_len = strlen(cert_file) + 1;
+    size_t ciphers_len = strlen(ciphers) + 1;
+    size_t dh_len = strlen(dh_file) + 1;
+    size_t ca_len = strlen(ca_file) + 1;
+
+    info->file = enif_alloc(cert_len + ciphers_len + dh_len + ca_len);
+    if (!info->file)
+        return 0;
+    info->ciphers = info->file + cert_len;
+    info->dh_file = info->ciphers + ciphers_len;
+    info->ca_file = info->dh_file + dh_len;
+    memcpy(info->file, cert_file, cert_len);
+    memcpy(info->ciphers, ciphers, ciphers_len);
+    memcpy(info->dh_file, dh_file, dh_len);
+    memcpy(info->ca_file, ca_file, ca_len);
+    info->command = command;
+    return 1;
+}
+
+static void stamp_ctx_files(cert_info_t *info) {
+    get_file_stamp(info->file, &info->stamps[0]);
+    get_file_stamp(info->dh_file, &info->stamps[1]);
+    get_file_stamp(info->ca_file, &info->stamps[2]);
+}
+
+/* Same as copy_ctx_files(), also recording the current state of the
+ * files */
+static int set_ctx_files(cert_info_t *info, const char *cert_file,
+                         const char *ciphers, const char *dh_file,
+                         const char *ca_file, unsigned int command) {
+    if (!copy_ctx_files(info, cert_file, ciphers, dh_file, ca_file,
+                        command))
+        return 0;
+    stamp_ctx_files(info);
+    return 1;
+}
+
+static int ctx_files_changed(cert_info_t *info) {
+    char *files[3] = {info->file, info->dh_file, info->ca_file};
+    file_stamp_t stamp;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        get_file_stamp(files[i], &stamp);
+        if (!same_file_stamp(&stamp, &info->stamps[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int reload_certs();
+
+#ifdef HAS_INOTIFY
+/*
+ * Watches the directories of the files contexts are built from, and
+ * reloads the contexts once changes settle. Directories are watched
+ * rather than files, so that files replaced by a rename are noticed.
+ */
+static void *watcher_loop(void *arg) {
+    char buf[4096];
+    struct pollfd fds[2];
+    int res;
+
+    fds[0].fd = watcher_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watcher_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        res = poll(fds, 2, -1);
+        if (res < 0 && errno != EINTR)
+            break;
+        if (res <= 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        /* A renewal replaces several files, wait until it's done */
+        do {
+            while (read(watcher_fd, buf, sizeof(buf)) > 0);
+            res = poll(fds, 2, WATCHER_SETTLE_TIME);
+        } while (res > 0 && !fds[1].revents);
+        if (res > 0)
+            break;
+        reload_certs();
+    }
+    return NULL;
+}
+
+/* Must be called with watcher_mtx held */
+static int start_watcher() {
+    watcher_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher_fd < 0)
+        return 0;
+    if (pipe(watcher_pipe) == 0) {
+        if (enif_thread_create("fast_tls_watcher", &watcher_tid,
+                               watcher_loop, NULL, NULL) == 0)
+            return 1;
+        close(watcher_pipe[0]);
+        close(watcher_pipe[1]);
+        watcher_pipe[0] = watcher_pipe[1] = -1;
+    }
+    close(watcher_fd);
+    watcher_fd = -1;
+    return 0;
+}
+
+static void stop_watcher() {
+    if (watcher_fd < 0)
+        return;
+    /* The read end polls as hung up */
+    close(watcher_pipe[1]);
+    enif_thread_join(watcher_tid, NULL);
+    close(watcher_pipe[0]);
+    close(watcher_fd);
+    watcher_pipe[0] = watcher_pipe[1] = -1;
+    watcher_fd = -1;
+}
+
+static void watch_dir(const char *file) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file, '/');
+    size_t len = slash ? (size_t) (slash - file) : 1;
+
+    if (len >= sizeof(dir))
+        return;
+    if (!slash)
+        strcpy(dir, ".");
+    else if (len == 0)
+        strcpy(dir, "/");
+    else {
+        memcpy(dir, file, len);
+        dir[len] = 0;
+    }
+    inotify_add_watch(watcher_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                       IN_CREATE | IN_DELETE | IN_ATTRIB);
+}
+
+/* Symlinked files, as with Let's Encrypt, have both directories
+ * watched, to see the links replaced and the targets written */
+static void watch_ctx_files(cert_info_t *info) {
+    char *files[3] = {info->file, info->dh_file, info->ca_file};
+    char target[PATH_MAX];
+    int i;
+
+    enif_mutex_lock(watcher_mtx);
+    if (watcher_fd < 0 && (watcher_failed || !start_watcher())) {
+        watcher_failed = 1;
+        enif_mutex_unlock(watcher_mtx);
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        if (!*files[i] || is_mem_cert(files[i]))
+            continue;
+        watch_dir(files[i]);
+        if (realpath(files[i], target))
+            watch_dir(target);
+    }
+    enif_mutex_unlock(watcher_mtx);
+}
+#endif
+
+/* Builds the context of a certs_map entry, with no lock held */
+static SSL_CTX *build_ctx(cert_info_t *info, char **err_str) {
+    SSL_CTX *ctx;
+
+    ctx = create_new_ctx(*info->file ? info->file : NULL, info->ciphers,
+                         *info->dh_file ? info->dh_file : NULL,
+                         *info->ca_file ? info->ca_file : NULL,
+                         info->command, err_str);
+    if (!ctx)
+        return NULL;
+    if (info->command == SET_CERTIFICATE_FILE_ACCEPT)
+        setup_session_cache(ctx, &info->ctx_key);
+    else
+        setup_client_session_cache(ctx);
+#ifdef HAS_INOTIFY
+    watch_ctx_files(info);
+#endif
+    return ctx;
+}
+
+static void set_ctx(state_t *state, SSL_CTX *ctx) {
+    if (state->ssl)
+        SSL_set_SSL_CTX(state->ssl, ctx);
+    else
+        state->ssl = SSL_new(ctx);
+}
+
+static ctx_build_t *new_ctx_build(const ctx_key_t *key, profile_t *profile,
+                                  const char *cert_file) {
+    ctx_build_t *build = enif_alloc(sizeof(ctx_build_t));
+    if (!build)
+        return NULL;
+    memset(build, 0, sizeof(ctx_build_t));
+    build->cond = enif_cond_create("ctx_build");
+    if (!build->cond) {
+        enif_free(build);
+        return NULL;
+    }
+    /* For invalidate_cache_nif() to match */
+    if (!copy_ctx_files(&build->files, cert_file, profile->ciphers,
+                        profile->dh_file, profile->ca_file,
+                        profile->command)) {
+        enif_cond_destroy(build->cond);
+        enif_free(build);
+        return NULL;
+    }
+    build->key = *key;
+    return build;
+}
+
+static void free_ctx_build(ctx_build_t *build) {
+    if (build->ctx)
+        SSL_CTX_free(build->ctx);
+    enif_free(build->files.file);
+    enif_cond_destroy(build->cond);
+    enif_free(build);
+}
+
+/* Must be called with ctx_builds_mtx held */
+static char *wait_ctx_build(ctx_build_t *build, SSL_CTX **ctx) {
+    char *ret;
+
+    build->waiters++;
+    while (!build->done)
+        enif_cond_wait(build->cond, ctx_builds_mtx);
+    if (build->ctx) {
+        SSL_CTX_up_ref(build->ctx);
+        *ctx = build->ctx;
+    }
+    ret = build->error;
+    if (--build->waiters == 0)
+        free_ctx_build(build);
+    return ret;
+}
+
+/*
+ * Strings are digested with their terminators, so that adjacent
+ * fields can't be shifted into each other.
+ */
+static int make_profile_key(profile_t *profile) {
+    EVP_MD_CTX *md = get_md_ctx();
+
+    return md &&
+          EVP_DigestInit_ex(md, sha256_md, NULL) &&
+          EVP_DigestUpdate(md, &profile->command, sizeof(profile->command)) &&
+          EVP_DigestUpdate(md, &profile->options, sizeof(profile->options)) &&
+          EVP_DigestUpdate(md, profile->ciphers,
+                           strlen(profile->ciphers) + 1) &&
+          EVP_DigestUpdate(md, profile->dh_file,
+                           strlen(profile->dh_file) + 1) &&
+          EVP_DigestUpdate(md, profile->ca_file,
+                           strlen(profile->ca_file) + 1) &&
+          EVP_DigestFinal_ex(md, profile->profile_key.digest, NULL);
+}
+
+static int make_ctx_key(const ctx_key_t *profile, const char *cert_file,
+                        ctx_key_t *key) {
+    EVP_MD_CTX *md = get_md_ctx();
+
+    return md &&
+          EVP_DigestInit_ex(md, sha256_md, NULL) &&
+          EVP_DigestUpdate(md, profile->digest, sizeof(profile->digest)) &&
+          EVP_DigestUpdate(md, cert_file, strlen(cert_file) + 1) &&
+          EVP_DigestFinal_ex(md, key->digest, NULL);
+}
+
+static SSL_CTX *lookup_ctx(const ctx_key_t *key) {
+    cert_info_t *info = NULL;
+    SSL_CTX *ctx = NULL;
+
+    enif_rwlock_rlock(certs_map_lock);
+    HASH_FIND(hh, certs_map, key, sizeof(ctx_key_t), info);
+    if (info) {
+        ctx = info->ssl_ctx;
+        SSL_CTX_up_ref(ctx);
+    }
+    enif_rwlock_runlock(certs_map_lock);
+    return ctx;
+}
+
+/*
+ * Returns a new reference to the SSL context for the profile and
+ * the certificate in *ctx_out, building it on a cache miss. With
+ * refresh set, a cached context is rebuilt and replaced.
+ */
+static char *get_ssl_ctx(profile_t *profile, char *cert_file, int refresh,
+                         SSL_CTX **ctx_out) {
+    char *ret = NULL;
+    SSL_CTX *ctx;
+    ctx_build_t *build = NULL;
+    cert_info_t *new_info = NULL;
+    cert_info_t *old_info = NULL;
+    const ctx_key_t *key = &profile->ctx_key;
+    ctx_key_t sni_key;
+    int stale;
+
+    if (cert_file != profile->cert_file) {
+        if (!make_ctx_key(&profile->profile_key, cert_file, &sni_key))
+            return "Failed to compute SSL context key";
+        key = &sni_key;
+    }
+
+    if (!refresh && (*ctx_out = lookup_ctx(key)))
+        return NULL;
+
+    enif_mutex_lock(ctx_builds_mtx);
+    HASH_FIND(hh, ctx_builds, key, sizeof(ctx_key_t), build);
+    if (build) {
+        ret = wait_ctx_build(build, ctx_out);
+        enif_mutex_unlock(ctx_builds_mtx);
+        return ret;
+    }
+    /* The previous builder may have finished since our lookup */
+    if (!refresh && (*ctx_out = lookup_ctx(key))) {
+        enif_mutex_unlock(ctx_builds_mtx);
+        return NULL;
+    }
+    build = new_ctx_build(key, profile, cert_file);
+    if (!build) {
+        enif_mutex_unlock(ctx_builds_mtx);
+        return "Memory allocation failed";
+    }
+    HASH_ADD(hh, ctx_builds, key, sizeof(ctx_key_t), build);
+    enif_mutex_unlock(ctx_builds_mtx);
+
+    new_info = enif_alloc(sizeof(cert_info_t));
+    if (new_info) {
+        memset(new_info, 0, sizeof(cert_info_t));
+        new_info->ctx_key = *key;
+        if (!set_ctx_files(new_info, cert_file, profile->ciphers,
+                           profile->dh_file, profile->ca_file,
+                           profile->command)) {
+            enif_free(new_info);
+            new_info = NULL;
+        }
+    }
+    if (new_info)
+        ctx = build_ctx(new_info, &ret);
+    else
+        ret = "Memory allocation failed";
+    if (ret == NULL) {
+        new_info->ssl_ctx = ctx;
+        /* References for the caller and for the waiters: the map
+         * entry may be replaced before they get to use it */
+        SSL_CTX_up_ref(ctx);
+        SSL_CTX_up_ref(ctx);
+        *ctx_out = ctx;
+        build->ctx = ctx;
+        enif_rwlock_rwlock(certs_map_lock);
+        /* Marked before the invalidation takes certs_map_lock, so
+         * either it's seen here or the entry is dropped after */
+        ATOMIC_GET(stale, &build->stale);
+        if (stale) {
+            old_info = new_info;
+        } else {
+            HASH_REPLACE(hh, certs_map, ctx_key, sizeof(ctx_key_t),
+                         new_info, old_info);
+            if (old_info)
+                ATOMIC_INC(&ctx_generation);
+        }
+        enif_rwlock_rwunlock(certs_map_lock);
+        free_cert_info(old_info);
+    } else {
+        free_cert_info(new_info);
+    }
+
+    enif_mutex_lock(ctx_builds_mtx);
+    HASH_DEL(ctx_builds, build);
+    build->done = 1;
+    build->error = ret;
+    if (build->waiters > 0)
+        enif_cond_broadcast(build->cond);
+    else
+        free_ctx_build(build);
+    enif_mutex_unlock(ctx_builds_mtx);
+
+    return ret;
+}
+
+static char *create_ssl_for_cert(char *cert_file, state_t *state) {
+    SSL_CTX *ctx = NULL;
+    char *ret = get_ssl_ctx(state->profile, cert_file, 0, &ctx);
+
+    if (ret == NULL) {
+        set_ctx(state, ctx);
+        SSL_CTX_free(ctx);
+    }
+    return ret;
+}
+
+/*
+ * Rebuilds the contexts whose certificate, DH or CA file changed since
+ * they were built, and swaps them into certs_map. SSL objects keep the
+ * context they were created with. A context that fails to build, e.g.
+ * while its files are being written, is kept and retried next time.
+ * The entries are copied under certs_map_lock and the files are only
+ * checked after it's released. Returns the number of contexts replaced.
+ */
+static int reload_certs() {
+    cert_info_t *info, *tmp, *entry;
+    cert_info_t **entries;
+    unsigned int i, num = 0;
+    int reloaded = 0;
+    char *err_str;
+    SSL_CTX *ctx;
+
+    enif_mutex_lock(reload_mtx);
+    enif_rwlock_rlock(certs_map_lock);
+    entries = enif_alloc((HASH_COUNT(certs_map) + 1) * sizeof(cert_info_t *));
+    if (entries) {
+        HASH_ITER(hh, certs_map, info, tmp) {
+            entry = enif_alloc(sizeof(cert_info_t));
+            if (!entry)
+                break;
+            memset(entry, 0, sizeof(cert_info_t));
+            entry->ctx_key = info->ctx_key;
+            if (!copy_ctx_files(entry, info->file, info->ciphers,
+                                info->dh_file, info->ca_file,
+                                info->command)) {
+                enif_free(entry);
+                break;
+            }
+            memcpy(entry->stamps, info->stamps, sizeof(entry->stamps));
+            entries[num++] = entry;
+        }
+    }
+    enif_rwlock_runlock(certs_map_lock);
+
+    for (i = 0; i < num; i++) {
+        entry = entries[i];
+        if (!ctx_files_changed(entry)) {
+            free_cert_info(entry);
+            continue;
+        }
+        stamp_ctx_files(entry);
+        ctx = build_ctx(entry, &err_str);
+        if (ctx) {
+            enif_rwlock_rwlock(certs_map_lock);
+            HASH_FIND(hh, certs_map, &entry->ctx_key, sizeof(ctx_key_t),
+                      info);
+            if (info) {
+                SSL_CTX *old_ctx = info->ssl_ctx;
+                info->ssl_ctx = ctx;
+                memcpy(info->stamps, entry->stamps, sizeof(info->stamps));
+                ATOMIC_INC(&ctx_generation);
+                reloaded++;
+                ctx = old_ctx;
+            }
+            enif_rwlock_rwunlock(certs_map_lock);
+            /* Freed once the last SSL object using it is gone */
+            SSL_CTX_free(ctx);
+        }
+        free_cert_info(entry);
+    }
+    if (entries)
+        enif_free(entries);
+    enif_mutex_unlock(reload_mtx);
+    return reloaded;
+}
+
+#ifdef HAS_ATOMICS
+/*
+ * Returns a new reference to the context of the profile if it was
+ * built for the given generation. Readers count themselves in one of
+ * two counters while they take the reference, and whoever replaces
+ * the context flips to the other counter and waits for the old one
+ * to drain before dropping its own reference, see put_profile_ctx().
+ */
+static SSL_CTX *take_profile_ctx(profile_t *profile,
+                                 unsigned long generation) {
+    unsigned int slot = __atomic_load_n(&profile->epoch,
+                                        __ATOMIC_SEQ_CST) & 1;
+    SSL_CTX *ctx = NULL;
+
+    __atomic_add_fetch(&profile->readers[slot], 1, __ATOMIC_SEQ_CST);
+    /* The generation is stored after the context, so read it first */
+    if (__atomic_load_n(&profile->generation, __ATOMIC_SEQ_CST) ==
+        generation) {
+        ctx = __atomic_load_n(&profile->ctx, __ATOMIC_SEQ_CST);
+        if (ctx)
+            SSL_CTX_up_ref(ctx);
+    }
+    __atomic_sub_fetch(&profile->readers[slot], 1, __ATOMIC_SEQ_CST);
+    return ctx;
+}
+
+/* Must be called with profile->mtx held */
+static void put_profile_ctx(profile_t *profile, SSL_CTX *ctx,
+                            unsigned long generation) {
+    SSL_CTX *old_ctx;
+    unsigned int slot;
+    int i;
+
+    SSL_CTX_up_ref(ctx);
+    old_ctx = __atomic_exchange_n(&profile->ctx, ctx, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&profile->generation, generation, __ATOMIC_SEQ_CST);
+    if (!old_ctx)
+        return;
+    /* Twice, as a reader may have picked its counter before the
+     * previous flip. Readers only hold it for SSL_CTX_up_ref(). */
+    for (i = 0; i < 2; i++) {
+        slot = __atomic_fetch_add(&profile->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&profile->readers[slot], __ATOMIC_SEQ_CST))
+            CPU_RELAX();
+    }
+    SSL_CTX_free(old_ctx);
+}
+#else
+static SSL_CTX *take_profile_ctx(profile_t *profile,
+                                 unsigned long generation) {
+    SSL_CTX *ctx = NULL;
+
+    enif_mutex_lock(profile->mtx);
+    if (profile->generation == generation) {
+        ctx = profile->ctx;
+        if (ctx)
+            SSL_CTX_up_ref(ctx);
+    }
+    enif_mutex_unlock(profile->mtx);
+    return ctx;
+}
+
+/* Must be called with profile->mtx held */
+static void put_profile_ctx(profile_t *profile, SSL_CTX *ctx,
+                            unsigned long generation) {
+    SSL_CTX *old_ctx = profile->ctx;
+
+    SSL_CTX_up_ref(ctx);
+    profile->ctx = ctx;
+    ATOMIC_SET(&profile->generation, generation);
+    if (old_ctx)
+        SSL_CTX_free(old_ctx);
+}
+#endif
+
+/*
+ * Returns a new reference to the SSL context of the certificate of
+ * the profile. The profile keeps the context until the cache is
+ * cleared, so opening a socket doesn't even need a cache lookup.
+ */
+static char *get_profile_ctx(profile_t *profile, SSL_CTX **ctx) {
+    unsigned long generation;
+    SSL_CTX *new_ctx = NULL;
+    char *ret;
+
+    ATOMIC_GET(generation, &ctx_generation);
+    *ctx = take_profile_ctx(profile, generation);
+    if (*ctx)
+        return NULL;
+    /* Concurrent misses wait for the same build in get_ssl_ctx() */
+    ret = get_ssl_ctx(profile, profile->cert_file, 0, &new_ctx);
+    if (!new_ctx)
+        return ret;
+    enif_mutex_lock(profile->mtx);
+    /* Don't replace a context built for a newer generation */
+    if (!profile->ctx || (long) (generation - profile->generation) > 0)
+        put_profile_ctx(profile, new_ctx, generation);
+    enif_mutex_unlock(profile->mtx);
+    *ctx = new_ctx;
+    return NULL;
+}
+
+/* Returns NULL and sets *err if the arguments can't be parsed */
+static profile_t *new_profile(ErlNifEnv *env, const ERL_NIF_TERM argv[],
+                              ERL_NIF_TERM *err) {
+    unsigned int flags;
+    ErlNifBinary ciphers_bin;
+    ErlNifBinary certfile_bin;
+    ErlNifBinary protocol_options_bin;
+    ErlNifBinary dhfile_bin;
+    ErlNifBinary cafile_bin;
+    ErlNifBinary sni_bin;
+    ErlNifBinary alpn_bin;
+    long options = 0L;
+    profile_t *profile = NULL;
+    size_t po_len_left = 0;
+    unsigned char *po = NULL;
+
+    *err = enif_make_badarg(env);
+    if (!enif_get_uint(env, argv[0], &flags))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &certfile_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[2], &ciphers_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[3], &protocol_options_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[4], &dhfile_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[5], &cafile_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[6], &sni_bin))
+        return NULL;
+    if (!enif_inspect_iolist_as_binary(env, argv[7], &alpn_bin))
+        return NULL;
+
+    if (protocol_options_bin.size) {
+        po_len_left = protocol_options_bin.size;
+        po = protocol_options_bin.data;
+    } else {
+        po = (unsigned char *) PROTOCOL_OPTIONS;
+        po_len_left = strlen((char *) po);
+    }
+
+    while (po_len_left) {
+        unsigned char *pos = memchr(po, '|', po_len_left);
+
+        if (!pos) {
+            set_option_flag(po, po_len_left, &options);
+            break;
+        }
+        set_option_flag(po, pos - po, &options);
+        po_len_left -= pos - po + 1;
+        po = pos + 1;
+    }
+
+    *err = ERR_T(enif_make_atom(env, "enomem"));
+    profile = enif_alloc_resource(tls_profile_t, sizeof(profile_t));
+    if (!profile) return NULL;
+    memset(profile, 0, sizeof(profile_t));
+    profile->mtx = enif_mutex_create("tls_profile");
+    profile->cert_file = enif_alloc(certfile_bin.size + 1 +
+                                    ciphers_bin.size + 1 +
+                                    dhfile_bin.size + 1 +
+                                    cafile_bin.size + 1 +
+                                    sni_bin.size + 1 +
+                                    alpn_bin.size);
+    if (!profile->mtx || !profile->cert_file) {
+        enif_release_resource(profile);
+        return NULL;
+    }
+    profile->ciphers = profile->cert_file + certfile_bin.size + 1;
+    profile->dh_file = profile->ciphers + ciphers_bin.size + 1;
+    profile->ca_file = profile->dh_file + dhfile_bin.size + 1;
+    profile->sni = profile->ca_file + cafile_bin.size + 1;
+    profile->alpn = (unsigned char *) profile->sni + sni_bin.size + 1;
+    profile->alpn_len = alpn_bin.size;
+    profile->flags = flags;
+    profile->options = options;
+    profile->command = flags & 0xffff;
+
+    memcpy(profile->cert_file, certfile_bin.data, certfile_bin.size);
+    profile->cert_file[certfile_bin.size] = 0;
+    memcpy(profile->ciphers, ciphers_bin.data, ciphers_bin.size);
+    profile->ciphers[ciphers_bin.size] = 0;
+    memcpy(profile->dh_file, dhfile_bin.data, dhfile_bin.size);
+    profile->dh_file[dhfile_bin.size] = 0;
+    memcpy(profile->ca_file, cafile_bin.data, cafile_bin.size);
+    profile->ca_file[cafile_bin.size] = 0;
+    memcpy(profile->sni, sni_bin.data, sni_bin.size);
+    profile->sni[sni_bin.size] = 0;
+    memcpy(profile->alpn, alpn_bin.data, alpn_bin.size);
+
+    if (!make_profile_key(profile) ||
+        !make_ctx_key(&profile->profile_key, profile->cert_file,
+                      &profile->ctx_key)) {
+        enif_release_resource(profile);
+        *err = ssl_error(env, "Failed to compute SSL context key");
+        return NULL;
+    }
+
+    if (profile->command != SET_CERTIFICATE_FILE_ACCEPT && sni_bin.size) {
+        size_t key_size = strlen(profile->sni) + 9 +
+                          strlen(profile->cert_file) +
+                          strlen(profile->ciphers) + 8 +
+                          strlen(profile->dh_file) +
+                          strlen(profile->ca_file) + 1;
+        profile->session_key = enif_alloc(key_size);
+        if (profile->session_key)
+            sprintf(profile->session_key, "%s/%08x%s%s%08lx%s%s",
+                    profile->sni, flags, profile->cert_file,
+                    profile->ciphers, profile->options,
+                    profile->dh_file, profile->ca_file);
+    }
+
+    return profile;
+}
+
+static ERL_NIF_TERM open_with_profile(ErlNifEnv *env, profile_t *profile) {
+    unsigned int flags = profile->flags;
+    long options = profile->options;
+    SSL_CTX *ctx = NULL;
+    state_t *state = NULL;
+    char *err_str;
+
+    state = init_tls_state();
+    if (!state) return ERR_T(enif_make_atom(env, "enomem"));
+
+    enif_keep_resource(profile);
+    state->profile = profile;
+
+    err_str = get_profile_ctx(profile, &ctx);
+    if (err_str) {
+        enif_release_resource(state);
+        return ssl_error(env, err_str);
+    }
+
+    state->ssl = SSL_new(ctx);
+    SSL_CTX_free(ctx);
+    if (!state->ssl) {
+        enif_release_resource(state);
+        return ssl_error(env, "SSL_new failed");
+    }
+
+    if (flags & VERIFY_NONE)
+        SSL_set_verify(state->ssl, SSL_VERIFY_NONE, verify_callback);
+
+#ifdef SSL_OP_NO_COMPRESSION
+    if (flags & COMPRESSION_NONE)
+        SSL_set_options(state->ssl, SSL_OP_NO_COMPRESSION);
+#endif
+
+#ifdef HAS_ASYNC_MODE
+    if (flags & ASYNC_MODE)
+        SSL_set_mode(state->ssl, SSL_MODE_ASYNC);
+#endif
+    /* flush_write_queue() retries a write with the same bytes, but from
+     * a staging buffer that lives on the stack of each call */
+    SSL_set_mode(state->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    SSL_set_ex_data(state->ssl, ssl_index, state);
+
+#ifdef HAS_IOQ_BIO
+    state->bio_read = BIO_new(ioq_bio_method);
+#else
+    state->bio_read = BIO_new(BIO_s_mem());
+#endif
+#ifdef HAS_BIO_METHOD
+    state->bio_write = BIO_new(chunk_bio_method);
+#else
+    state->bio_write = BIO_new(BIO_s_mem());
+#endif
+
+    SSL_set_bio(state->ssl, state->bio_read, state->bio_write);
+
+    if (!(flags & TICKETS))
+        options |= SSL_OP_NO_TICKET;
+
+    if (profile->command == SET_CERTIFICATE_FILE_ACCEPT) {
+        options |= (SSL_OP_ALL | SSL_OP_NO_SSLv2);
+
+        SSL_set_options(state->ssl, options);
+
+#ifdef HAS_EARLY_DATA
+        if (flags & EARLY_DATA) {
+            SSL_set_max_early_data(state->ssl, MAX_EARLY_DATA);
+            /* Replaced by the ClientHello window of allow_early_data_cb */
+            SSL_set_options(state->ssl, SSL_OP_NO_ANTI_REPLAY);
+            SSL_set_allow_early_data_cb(state->ssl, allow_early_data_cb, NULL);
+            state->early_data = 1;
+        }
+#endif
+
+        SSL_set_accept_state(state->ssl);
+    } else {
+        options |= SSL_OP_NO_SSLv2;
+
+        SSL_set_options(state->ssl, options);
+
+        if (strlen(profile->sni) > 0)
+            SSL_set_tlsext_host_name(state->ssl, profile->sni);
+
+        if (profile->session_key && client_session_cache_size)
+            reuse_client_session(state);
+
+#ifdef HAS_EARLY_DATA
+        if (flags & EARLY_DATA)
+            state->early_data = 1;
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+        if (profile->alpn_len)
+            SSL_set_alpn_protos(state->ssl, profile->alpn, profile->alpn_len);
+#endif
+
+        SSL_set_connect_state(state->ssl);
+    }
+
+#ifdef SSL_OP_NO_RENEGOTIATION
+    SSL_set_options(state->ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
+
+    ERL_NIF_TERM result = enif_make_resource(env, state);
+    enif_release_resource(state);
+    return OK_T(result);
+}
+
+/*
+ * Serializes the arguments of open_nif() into key. Returns the length,
+ * or 0 if they don't fit and the profile isn't to be cached.
+ */
+static size_t make_open_key(ErlNifEnv *env, const ERL_NIF_TERM argv[],
+                            unsigned char *key, uint64_t *hash) {
+    ErlNifBinary bin;
+    unsigned int flags;
+    size_t len = sizeof(flags);
+    size_t i;
+
+    if (!enif_get_uint(env, argv[0], &flags))
+        return 0;
+    memcpy(key, &flags, sizeof(flags));
+    for (i = 1; i < 8; i++) {
+        if (!enif_inspect_iolist_as_binary(env, argv[i], &bin) ||
+            len + sizeof(bin.size) + bin.size > PROFILE_CACHE_KEY_MAX)
+            return 0;
+        memcpy(key + len, &bin.size, sizeof(bin.size));
+        memcpy(key + len + sizeof(bin.size), bin.data, bin.size);
+        len += sizeof(bin.size) + bin.size;
+    }
+    *hash = 14695981039346656037ULL;
+    for (i = 0; i < len; i++)
+        *hash = (*hash ^ key[i]) * 1099511628211ULL;
+    return len;
+}
+
+static void cache_profile(profile_slot_t *slot, const unsigned char *key,
+                          size_t key_len, profile_t *profile) {
+    unsigned char *new_key = enif_alloc(key_len);
+    unsigned char *old_key;
+    profile_t *old_profile;
+
+    if (!new_key)
+        return;
+    memcpy(new_key, key, key_len);
+    enif_keep_resource(profile);
+    enif_rwlock_rwlock(profile_cache_lock);
+    old_key = slot->key;
+    old_profile = slot->profile;
+    slot->key = new_key;
+    slot->key_len = key_len;
+    slot->profile = profile;
+    enif_rwlock_rwunlock(profile_cache_lock);
+    if (old_profile) {
+        enif_release_resource(old_profile);
+        enif_free(old_key);
+    }
+}
+
+static ERL_NIF_TERM open_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]) {
+    unsigned char key[PROFILE_CACHE_KEY_MAX];
+    profile_slot_t *slot = NULL;
+    profile_t *profile = NULL;
+    ERL_NIF_TERM result;
+    size_t key_len;
+    uint64_t hash;
+
+    ERR_clear_error();
+
+    if (argc != 8)
+        return enif_make_badarg(env);
+
+    key_len = make_open_key(env, argv, key, &hash);
+    if (key_len) {
+        slot = &profile_cache[hash % PROFILE_CACHE_SIZE];
+        enif_rwlock_rlock(profile_cache_lock);
+        if (slot->profile && slot->key_len == key_len &&
+            !memcmp(slot->key, key, key_len)) {
+            profile = slot->profile;
+            enif_keep_resource(profile);
+        }
+        enif_rwlock_runlock(profile_cache_lock);
+    }
+
+    if (!profile) {
+        profile = new_profile(env, argv, &result);
+        if (!profile)
+            return result;
+        if (slot)
+            cache_profile(slot, key, key_len, profile);
+    }
+
+    result = open_with_profile(env, profile);
+    enif_release_resource(profile);
+    return result;
+}
+
+static ERL_NIF_TERM new_profile_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    profile_t *profile;
+    ERL_NIF_TERM result;
+    SSL_CTX *ctx = NULL;
+    char *err_str;
+
+    ERR_clear_error();
+
+    if (argc != 8)
+        return enif_make_badarg(env);
+
+    profile = new_profile(env, argv, &result);
+    if (!profile)
+        return result;
+
+    /* Bind the context now, so that bad files are reported here */
+    err_str = get_profile_ctx(profile, &ctx);
+    if (err_str) {
+        enif_release_resource(profile);
+        return ssl_error(env, err_str);
+    }
+    SSL_CTX_free(ctx);
+
+    result = enif_make_resource(env, profile);
+    enif_release_resource(profile);
+    return OK_T(result);
+}
+
+static ERL_NIF_TERM open_profile_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+    profile_t *profile = NULL;
+
+    ERR_clear_error();
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_profile_t, (void *) &profile))
+        return enif_make_badarg(env);
+
+    return open_with_profile(env, profile);
+}
+
+/* Returns the cache generation the context of the profile was built for */
+static ERL_NIF_TERM profile_generation_nif(ErlNifEnv *env, int argc,
+                                          const ERL_NIF_TERM argv[]) {
+    profile_t *profile = NULL;
+    unsigned long generation;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_profile_t, (void *) &profile))
+        return enif_make_badarg(env);
+
+    ATOMIC_GET(generation, &profile->generation);
+    return enif_make_uint64(env, generation);
+}
+
+static ERL_NIF_TERM set_encrypted_input_nif(ErlNifEnv *env, int argc,
+                                            const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    if (!write_encrypted_input(env, state, argv[1])) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_badarg(env);
+    }
+    enif_mutex_unlock(state->mtx);
+
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * Plaintext written by the application is kept in a write queue until
+ * OpenSSL accepts it, e.g. while a handshake is in progress.
+ * All functions below must be called with state->mtx held.
+ */
+#ifdef HAS_IOQ
+static size_t write_queue_size(state_t *state) {
+    return enif_ioq_size(state->write_queue);
+}
+
+static int write_queue_peek(state_t *state, SysIOVec **iov) {
+    int iovlen;
+
+    *iov = enif_ioq_peek(state->write_queue, &iovlen);
+    return iovlen;
+}
+
+static void write_queue_deq(state_t *state, size_t size) {
+    enif_ioq_deq(state->write_queue, size, NULL);
+}
+
+typedef struct {
+    ERL_NIF_TERM list;
+    size_t run_len;
+    unsigned char run[256];
+} iolist_walk_t;
+
+static void walk_flush_run(ErlNifEnv *env, iolist_walk_t *walk) {
+    ERL_NIF_TERM bin;
+
+    if (walk->run_len > 0) {
+        memcpy(enif_make_new_binary(env, walk->run_len, &bin),
+               walk->run, walk->run_len);
+        walk->list = enif_make_list_cell(env, bin, walk->list);
+        walk->run_len = 0;
+    }
+}
+
+/*
+ * Collects the binaries of a deep iolist, in reverse order, without
+ * copying them. Runs of bytes are packed into new small binaries.
+ * The tails of the enclosing lists are kept on a heap stack, as
+ * iolists built by appending can be nested as deep as they are long.
+ */
+static int walk_iolist(ErlNifEnv *env, ERL_NIF_TERM term, iolist_walk_t *walk) {
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM *stack = NULL;
+    ERL_NIF_TERM *new_stack;
+    size_t depth = 0, size = 0;
+    int byte, ret = 0;
+
+    for (;;) {
+        if (enif_get_list_cell(env, term, &head, &term)) {
+            if (enif_get_int(env, head, &byte)) {
+                if (byte < 0 || byte > 255)
+                    break;
+                if (walk->run_len == sizeof(walk->run))
+                    walk_flush_run(env, walk);
+                walk->run[walk->run_len++] = byte;
+            } else if (enif_is_binary(env, head)) {
+                walk_flush_run(env, walk);
+                walk->list = enif_make_list_cell(env, head, walk->list);
+            } else {
+                /* Resume the rest of this list after the nested one */
+                if (depth == size) {
+                    size = size ? size * 2 : 16;
+                    if (stack)
+                        new_stack = enif_realloc(stack,
+                                                 size * sizeof(ERL_NIF_TERM));
+                    else
+                        new_stack = enif_alloc(size * sizeof(ERL_NIF_TERM));
+                    if (!new_stack)
+                        break;
+                    stack = new_stack;
+                }
+                stack[depth++] = term;
+                term = head;
+            }
+            continue;
+        }
+        if (enif_is_binary(env, term)) {
+            walk_flush_run(env, walk);
+            walk->list = enif_make_list_cell(env, term, walk->list);
+        } else if (!enif_is_empty_list(env, term)) {
+            break;
+        }
+        if (depth == 0) {
+            ret = 1;
+            break;
+        }
+        term = stack[--depth];
+    }
+    if (stack)
+        enif_free(stack);
+    return ret;
+}
+
+/*
+ * Queues the iodata by reference to its binaries, the data is not
+ * flattened. Returns 0 if the data is not an iolist.
+ */
+static int write_queue_enqueue(ErlNifEnv *env, state_t *state,
+                               ERL_NIF_TERM data) {
+    ErlNifIOVec vec, *iovec = &vec;
+    ERL_NIF_TERM tail;
+    iolist_walk_t walk;
+
+    if (enif_is_binary(env, data))
+        data = enif_make_list1(env, data);
+
+    if (!enif_inspect_iovec(env, ~((size_t) 0), data, &tail, &iovec)) {
+        walk.list = enif_make_list(env, 0);
+        walk.run_len = 0;
+        if (!walk_iolist(env, data, &walk))
+            return 0;
+        walk_flush_run(env, &walk);
+        if (!enif_make_reverse_list(env, walk.list, &data) ||
+            !enif_inspect_iovec(env, ~((size_t) 0), data, &tail, &iovec))
+            return 0;
+    }
+    return enif_ioq_enqv(state->write_queue, iovec, 0);
+}
+#else
+static size_t write_queue_size(state_t *state) {
+    return state->write_queue_size;
+}
+
+static int write_queue_peek(state_t *state, SysIOVec **iov) {
+    write_chunk_t *chunk = state->write_queue;
+
+    if (!chunk)
+        return 0;
+    *iov = &chunk->iov;
+    return 1;
+}
+
+static void write_queue_deq(state_t *state, size_t size) {
+    write_chunk_t *chunk = state->write_queue;
+
+    state->write_queue_size -= size;
+    chunk->iov.iov_base = (char *) chunk->iov.iov_base + size;
+    chunk->iov.iov_len -= size;
+    if (chunk->iov.iov_len == 0) {
+        state->write_queue = chunk->next;
+        if (!state->write_queue)
+            state->write_queue_tail = NULL;
+        enif_free(chunk);
+    }
+}
+
+static int write_queue_enqueue(ErlNifEnv *env, state_t *state,
+                               ERL_NIF_TERM data) {
+    ErlNifBinary input;
+    write_chunk_t *chunk;
+
+    if (!enif_inspect_iolist_as_binary(env, data, &input))
+        return 0;
+    if (input.size == 0)
+        return 1;
+    chunk = enif_alloc(sizeof(write_chunk_t) + input.size);
+    if (!chunk)
+        return 0;
+    chunk->next = NULL;
+    chunk->iov.iov_base = (void *) chunk->data;
+    chunk->iov.iov_len = input.size;
+    memcpy(chunk->data, input.data, input.size);
+    if (state->write_queue_tail)
+        state->write_queue_tail->next = chunk;
+    else
+        state->write_queue = chunk;
+    state->write_queue_tail = chunk;
+    state->write_queue_size += input.size;
+    return 1;
+}
+#endif
+
+/* Maximum plaintext length of a TLS record */
+#define RECORD_SIZE 16384
+
+#ifdef HAS_EARLY_DATA
+/*
+ * Sends the queued data as early data while a resumed client handshake
+ * is in progress. It stays in the write queue, early_data_sent bytes of
+ * it, until the server has accepted it, or is sent again normally if
+ * the server rejected it. Returns 1 if the queue must not be written
+ * normally yet, 0 if it can, -1 on errors.
+ */
+static int flush_early_data(state_t *state) {
+    SSL_SESSION *sess = SSL_get_session(state->ssl);
+    SysIOVec *iov;
+    size_t skip, limit, written;
+    int iovlen, i;
+
+    if (SSL_is_init_finished(state->ssl)) {
+        if (SSL_get_early_data_status(state->ssl) == SSL_EARLY_DATA_ACCEPTED)
+            write_queue_deq(state, state->early_data_sent);
+        state->early_data = 0;
+        state->early_data_sent = 0;
+        return 0;
+    }
+
+    if (state->early_data_sent == 0 &&
+        (!SSL_in_before(state->ssl) || !sess ||
+         SSL_SESSION_get_max_early_data(sess) == 0)) {
+        /* Too late or not allowed, wait for the handshake */
+        state->early_data = 0;
+        return 0;
+    }
+
+    limit = SSL_SESSION_get_max_early_data(sess);
+    skip = state->early_data_sent;
+    iovlen = write_queue_peek(state, &iov);
+    for (i = 0; i < iovlen && state->early_data_sent < limit; i++) {
+        unsigned char *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        data += skip;
+        len -= skip;
+        skip = 0;
+        if (len > limit - state->early_data_sent)
+            len = limit - state->early_data_sent;
+        if (!SSL_write_early_data(state->ssl, data, len, &written)) {
+            int err = SSL_get_error(state->ssl, 0);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                break;
+            return -1;
+        }
+        state->early_data_sent += written;
+    }
+    return 1;
+}
+#endif
+
+/*
+ * Encrypts as much of the queued plaintext as OpenSSL accepts.
+ * Segments shorter than a record are packed into a record-sized staging
+ * buffer, longer ones are passed to SSL_write in place.
+ * Returns the number of bytes encrypted, or -1 if SSL_write failed.
+ * Notifies the blocked producer once the queue drains below
+ * the low watermark.
+ */
+static long flush_write_queue(ErlNifEnv *env, state_t *state) {
+    unsigned char staging[RECORD_SIZE];
+    SysIOVec *iov;
+    unsigned char *data;
+    size_t size;
+    long written = 0;
+    int iovlen, i, res;
+
+#ifdef HAS_EARLY_DATA
+    if (state->early_data && !SSL_is_server(state->ssl)) {
+        res = flush_early_data(state);
+        if (res != 0)
+            return res < 0 ? -1 : 0;
+    }
+#endif
+
+    while ((iovlen = write_queue_peek(state, &iov)) > 0) {
+        if (iovlen == 1 || iov[0].iov_len >= RECORD_SIZE) {
+            data = iov[0].iov_base;
+            size = iov[0].iov_len;
+        } else {
+            data = staging;
+            size = 0;
+            for (i = 0; i < iovlen && size < RECORD_SIZE; i++) {
+                size_t len = iov[i].iov_len;
+                if (len > RECORD_SIZE - size)
+                    len = RECORD_SIZE - size;
+                memcpy(staging + size, iov[i].iov_base, len);
+                size += len;
+            }
+        }
+        res = SSL_write(state->ssl, data, size);
+        if (res <= 0) {
+            res = SSL_get_error(state->ssl, res);
+            if (res == SSL_ERROR_WANT_READ || res == SSL_ERROR_WANT_WRITE)
+                break;
+            return -1;
+        }
+        write_queue_deq(state, res);
+        written += res;
+    }
+
+    if (state->send_queue_busy &&
+        write_queue_size(state) <= state->send_queue_low) {
+        state->send_queue_busy = 0;
+        if (state->notify_writable) {
+            ErlNifEnv *msg_env = enif_alloc_env();
+            state->notify_writable = 0;
+            if (msg_env) {
+                enif_send(env, &state->writable_pid, msg_env,
+                          enif_make_tuple2(msg_env,
+                                           enif_make_atom(msg_env, "tls_writable"),
+                                           enif_make_resource(msg_env, state)));
+                enif_free_env(msg_env);
+            }
+        }
+    }
+    return written;
+}
+
+#define WRITE_OK 0
+#define WRITE_QUEUED 1
+#define WRITE_ERROR 2
+#define WRITE_BUSY 3
+#define WRITE_BADARG 4
+
+/*
+ * Encrypts the data, or queues it while the handshake is in progress.
+ * Once the queue reaches the high watermark further writes are
+ * rejected with WRITE_BUSY until it drains to the low watermark.
+ */
+static int write_decrypted_output(ErlNifEnv *env, state_t *state,
+                                  ERL_NIF_TERM data) {
+    if (state->send_queue_busy) {
+        if (env && enif_self(env, &state->writable_pid))
+            state->notify_writable = 1;
+        return WRITE_BUSY;
+    }
+
+    if (!write_queue_enqueue(env, state, data))
+        return WRITE_BADARG;
+
+    if (state->send_queue_high > 0 &&
+        write_queue_size(state) >= state->send_queue_high)
+        state->send_queue_busy = 1;
+
+    if (flush_write_queue(env, state) < 0)
+        return WRITE_ERROR;
+
+    return write_queue_size(state) > 0 ? WRITE_QUEUED : WRITE_OK;
+}
+
+static ERL_NIF_TERM busy_error(ErlNifEnv *env, state_t *state) {
+    return enif_make_tuple2(env, enif_make_atom(env, "busy"),
+                            enif_make_uint64(env, write_queue_size(state)));
+}
+
+static ERL_NIF_TERM set_decrypted_output_nif(ErlNifEnv *env, int argc,
+                                             const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    ERL_NIF_TERM result;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    ERR_clear_error();
+
+    switch (write_decrypted_output(env, state, argv[1])) {
+        case WRITE_ERROR:
+            result = ssl_error(env, "SSL_write failed");
+            break;
+        case WRITE_BUSY:
+            result = busy_error(env, state);
+            break;
+        case WRITE_BADARG:
+            result = enif_make_badarg(env);
+            break;
+        default:
+            result = enif_make_atom(env, "ok");
+    }
+
+    enif_mutex_unlock(state->mtx);
+    return result;
+}
+
+static ERL_NIF_TERM get_encrypted_output_nif(ErlNifEnv *env, int argc,
+                                             const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    ERL_NIF_TERM output;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    ERR_clear_error();
+
+    output = encrypted_output(env, state);
+    enif_mutex_unlock(state->mtx);
+    return OK_T(output);
+}
+
+static ERL_NIF_TERM get_verify_result_nif(ErlNifEnv *env, int argc,
+                                          const ERL_NIF_TERM argv[]) {
+    long res;
+    state_t *state = NULL;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    ERR_clear_error();
+    res = SSL_get_verify_result(state->ssl);
+    enif_mutex_unlock(state->mtx);
+    return OK_T(enif_make_long(env, res));
+}
+
+static ERL_NIF_TERM get_peer_certificate_nif(ErlNifEnv *env, int argc,
+                                             const ERL_NIF_TERM argv[]) {
+    X509 *cert = NULL;
+    state_t *state = NULL;
+    int rlen;
+    ErlNifBinary output;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    ERR_clear_error();
+
+    cert = SSL_get_peer_certificate(state->ssl);
+    if (!cert) {
+        enif_mutex_unlock(state->mtx);
+        return ssl_error(env, "SSL_get_peer_certificate failed");
+    }
+    rlen = i2d_X509(cert, NULL);
+    if (rlen >= 0) {
+        if (!enif_alloc_binary(rlen, &output)) {
+            enif_mutex_unlock(state->mtx);
+            return ERR_T(enif_make_atom(env, "enomem"));
+        }
+        i2d_X509(cert, &output.data);
+        X509_free(cert);
+        enif_mutex_unlock(state->mtx);
+        return OK_T(enif_make_binary(env, &output));
+    } else {
+        X509_free(cert);
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "notfound"));
+    }
+}
+
+static ERL_NIF_TERM handshake_error(ErlNifEnv *env, state_t *state) {
+    int reason = ERR_GET_REASON(ERR_peek_error());
+    if (reason == SSL_R_DATA_LENGTH_TOO_LONG ||
+        reason == SSL_R_PACKET_LENGTH_TOO_LONG ||
+        reason == SSL_R_UNKNOWN_PROTOCOL ||
+        reason == SSL_R_UNEXPECTED_MESSAGE ||
+        reason == SSL_R_WRONG_VERSION_NUMBER)
+        /* Do not report badly formed Client Hello */
+        return ERR_T(enif_make_atom(env, "closed"));
+    else if (state->sni_error)
+        return ssl_error(env, state->sni_error);
+    else
+        return ssl_error(env, "SSL_do_handshake failed");
+}
+
+/*
+ * Handshake worker pool.
+ *
+ * handshake_async_nif() queues the state to a pool of native threads
+ * which run SSL_do_handshake() and report the outcome to the caller with
+ * a {tls_handshake, Ref, Result, OutBytes} message.  The pool is started
+ * on first use with one thread per scheduler.
+ *
+ * Paused asynchronous jobs (SSL_MODE_ASYNC) don't hold a thread: they
+ * are parked, and a single poller thread waits on the engine fds of all
+ * of them at once.  A ready handshake goes back to the handshake queue,
+ * and for a paused read the caller is notified with {tls_async, Ref}.
+ *
+ * Jobs that run long (reloads and pre-warming) go to a separate queue
+ * served by a quarter as many threads, so they never hold the handshake
+ * threads.
+ */
+
+/*
+ * Runs a handshake step. A paused private key operation is parked until
+ * its engine is ready, up to ASYNC_MAX_RETRIES times. Returns 1 if the
+ * job was queued or parked again.
+ */
+static int run_handshake_job(tls_job_t *job) {
+    ErlNifEnv *env = job->env;
+    state_t *state = job->state;
+    ERL_NIF_TERM result, output;
+    int res, err;
+
+    enif_mutex_lock(state->mtx);
+    if (!state->valid) {
+        result = ERR_T(enif_make_atom(env, "closed"));
+    } else {
+        ERR_clear_error();
+        res = SSL_do_handshake(state->ssl);
+        err = res > 0 ? SSL_ERROR_NONE : SSL_get_error(state->ssl, res);
+#ifdef HAS_ASYNC_MODE
+        if (err == SSL_ERROR_WANT_ASYNC && state->valid &&
+            job->retries++ < ASYNC_MAX_RETRIES) {
+            job->type = JOB_ASYNC_HANDSHAKE;
+            /* Nobody runs the job before the state is unlocked */
+            if (park_async_job(job)) {
+                enif_mutex_unlock(state->mtx);
+                return 1;
+            }
+        }
+#endif
+        if (err == SSL_ERROR_NONE)
+            result = enif_make_atom(env, "ok");
+        else if (err == SSL_ERROR_WANT_READ)
+            result = enif_make_atom(env, "want_read");
+        else
+            result = handshake_error(env, state);
+    }
+    output = encrypted_output(env, state);
+    enif_mutex_unlock(state->mtx);
+
+    enif_send(NULL, &job->pid, env,
+              enif_make_tuple4(env, enif_make_atom(env, "tls_handshake"),
+                               job->ref, result, output));
+    return 0;
+}
+
+static void run_reload_job(tls_job_t *job) {
+    ErlNifEnv *env = job->env;
+    int num = reload_certs();
+
+    enif_send(NULL, &job->pid, env,
+              enif_make_tuple3(env, enif_make_atom(env, "tls_reload"),
+                               job->ref, enif_make_int(env, num)));
+}
+
+static void release_prewarm(prewarm_t *prewarm) {
+    int refs;
+
+    enif_mutex_lock(prewarm->mtx);
+    refs = --prewarm->refs;
+    enif_mutex_unlock(prewarm->mtx);
+    if (refs)
+        return;
+    enif_mutex_destroy(prewarm->mtx);
+    enif_free_env(prewarm->env);
+    enif_release_resource(prewarm->profile);
+    enif_free(prewarm->files);
+    enif_free(prewarm);
+}
+
+/* Must be called with prewarm->mtx held */
+static void send_prewarm_progress(ErlNifEnv *env, prewarm_t *prewarm) {
+    enif_send(NULL, &prewarm->pid, env,
+              enif_make_tuple5(env, enif_make_atom(env, "tls_prewarm"),
+                               enif_make_copy(env, prewarm->ref),
+                               enif_make_uint64(env, prewarm->done),
+                               enif_make_uint64(env, prewarm->failed),
+                               enif_make_uint64(env, prewarm->total)));
+}
+
+/*
+ * Builds the context of the next domain of the batch. Each job builds
+ * one domain at a time and goes back to the end of the queue, so that
+ * handshakes queued meanwhile don't wait for the whole batch. Returns
+ * 1 if the job was queued again.
+ */
+static int run_prewarm_job(tls_job_t *job) {
+    ErlNifEnv *env = job->env;
+    prewarm_t *prewarm = job->prewarm;
+    SSL_CTX *ctx = NULL;
+    char *file = NULL;
+    size_t left;
+    int failed = 0;
+
+    enif_mutex_lock(prewarm->mtx);
+    if (prewarm->next < prewarm->total)
+        file = prewarm->files[prewarm->next++];
+    enif_mutex_unlock(prewarm->mtx);
+    if (!file)
+        return 0;
+
+    ERR_clear_error();
+    if (get_ssl_ctx(prewarm->profile, file, 0, &ctx))
+        failed = 1;
+    else
+        SSL_CTX_free(ctx);
+
+    /* Sent under the lock, so that the counters arrive in order */
+    enif_mutex_lock(prewarm->mtx);
+    prewarm->done++;
+    prewarm->failed += failed;
+    if (prewarm->done % prewarm->step == 0 || prewarm->done == prewarm->total)
+        send_prewarm_progress(env, prewarm);
+    enif_mutex_unlock(prewarm->mtx);
+
+    if (queue_job(job))
+        return 1;
+
+    /* The pool is stopping: the domains no job took count as failed,
+     * and the last job still building sends the final report */
+    enif_mutex_lock(prewarm->mtx);
+    left = prewarm->total - prewarm->next;
+    prewarm->next = prewarm->total;
+    prewarm->done += left;
+    prewarm->failed += left;
+    if (left && prewarm->done == prewarm->total)
+        send_prewarm_progress(env, prewarm);
+    enif_mutex_unlock(prewarm->mtx);
+    return 0;
+}
+
+static void free_job(tls_job_t *job) {
+    enif_free_env(job->env);
+    if (job->state)
+        enif_release_resource(job->state);
+    if (job->prewarm)
+        release_prewarm(job->prewarm);
+#ifdef HAS_ASYNC_MODE
+    enif_free(job->fds);
+#endif
+    enif_free(job);
+}
+
+#ifdef HAS_ASYNC_MODE
+static ErlNifTid async_tid;
+static int async_pipe[2] = {-1, -1};
+static int async_started = 0;
+static int async_stop = 0;
+static tls_job_t *async_jobs = NULL;
+
+/* Resumes a parked job: a handshake is queued, a read is notified */
+static void dispatch_async_job(tls_job_t *job) {
+    ErlNifEnv *env = job->env;
+
+    enif_free(job->fds);
+    job->fds = NULL;
+    job->numfds = 0;
+    if (job->type == JOB_ASYNC_HANDSHAKE) {
+        if (queue_job(job))
+            return;
+    } else {
+        enif_send(NULL, &job->pid, env,
+                  enif_make_tuple2(env, enif_make_atom(env, "tls_async"),
+                                   job->ref));
+    }
+    free_job(job);
+}
+
+/*
+ * Takes the parked jobs, polls the fds of all of them together with the
+ * wakeup pipe, and dispatches those whose fds are ready or whose wait
+ * timed out. The others are parked again.
+ */
+static void *async_loop(void *arg) {
+    tls_job_t *jobs, *job, *next, *waiting, *last;
+    struct pollfd *pfds;
+    ErlNifTime now, timeout;
+    size_t i, n, numfds;
+    char buf[64];
+    int ready;
+
+    for (;;) {
+        enif_mutex_lock(async_mtx);
+        if (async_stop) {
+            enif_mutex_unlock(async_mtx);
+            break;
+        }
+        jobs = async_jobs;
+        async_jobs = NULL;
+        enif_mutex_unlock(async_mtx);
+
+        numfds = 1;
+        for (job = jobs; job; job = job->next)
+            numfds += job->numfds;
+        pfds = enif_alloc(numfds * sizeof(struct pollfd));
+        if (pfds) {
+            pfds[0].fd = async_pipe[0];
+            pfds[0].events = POLLIN;
+            pfds[0].revents = 0;
+            now = enif_monotonic_time(ERL_NIF_MSEC);
+            timeout = -1;
+            for (job = jobs, n = 1; job; job = job->next) {
+                for (i = 0; i < job->numfds; i++, n++) {
+                    pfds[n].fd = job->fds[i];
+                    pfds[n].events = POLLIN;
+                    pfds[n].revents = 0;
+                }
+                if (timeout < 0 || job->deadline - now < timeout)
+                    timeout = job->deadline > now ? job->deadline - now : 0;
+            }
+            poll(pfds, numfds, (int) timeout);
+            if (pfds[0].revents)
+                while (read(async_pipe[0], buf, sizeof(buf)) > 0);
+        } else {
+            poll(NULL, 0, ASYNC_BACKOFF);
+        }
+
+        now = enif_monotonic_time(ERL_NIF_MSEC);
+        waiting = last = NULL;
+        for (job = jobs, n = 1; job; job = next) {
+            next = job->next;
+            /* Without pfds every job is retried */
+            ready = !pfds || job->deadline <= now;
+            for (i = 0; pfds && i < job->numfds; i++, n++)
+                if (pfds[n].revents)
+                    ready = 1;
+            if (ready) {
+                dispatch_async_job(job);
+            } else {
+                job->next = waiting;
+                waiting = job;
+                if (!last)
+                    last = job;
+            }
+        }
+        enif_free(pfds);
+
+        if (waiting) {
+            enif_mutex_lock(async_mtx);
+            last->next = async_jobs;
+            async_jobs = waiting;
+            enif_mutex_unlock(async_mtx);
+        }
+    }
+    return NULL;
+}
+
+/* Must be called with async_mtx held */
+static int start_async_poller() {
+    if (pipe(async_pipe) != 0)
+        return 0;
+    fcntl(async_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(async_pipe[1], F_SETFL, O_NONBLOCK);
+    if (enif_thread_create("fast_tls_async", &async_tid, async_loop,
+                           NULL, NULL) != 0) {
+        close(async_pipe[0]);
+        close(async_pipe[1]);
+        async_pipe[0] = async_pipe[1] = -1;
+        return 0;
+    }
+    async_started = 1;
+    return 1;
+}
+
+static void stop_async_poller() {
+    tls_job_t *job;
+
+    enif_mutex_lock(async_mtx);
+    async_stop = 1;
+    if (async_started && write(async_pipe[1], "", 1) < 0) {
+        /* Already woken up */
+    }
+    enif_mutex_unlock(async_mtx);
+    if (async_started) {
+        enif_thread_join(async_tid, NULL);
+        close(async_pipe[0]);
+        close(async_pipe[1]);
+        async_pipe[0] = async_pipe[1] = -1;
+        async_started = 0;
+    }
+    while ((job = async_jobs)) {
+        async_jobs = job->next;
+        free_job(job);
+    }
+}
+
+/*
+ * Parks a job paused in an asynchronous operation until the fds of its
+ * engine are ready, or for ASYNC_BACKOFF if the engine exposes none.
+ * Must be called with state->mtx held. Returns 0 if it can't be parked.
+ */
+static int park_async_job(tls_job_t *job) {
+    state_t *state = job->state;
+    size_t numfds = 0;
+
+    job->fds = NULL;
+    if (SSL_get_all_async_fds(state->ssl, NULL, &numfds) && numfds > 0) {
+        job->fds = enif_alloc(numfds * sizeof(OSSL_ASYNC_FD));
+        if (!job->fds ||
+            !SSL_get_all_async_fds(state->ssl, job->fds, &numfds)) {
+            enif_free(job->fds);
+            job->fds = NULL;
+        }
+    }
+    job->numfds = job->fds ? numfds : 0;
+    job->deadline = enif_monotonic_time(ERL_NIF_MSEC) +
+                    (job->numfds ? ASYNC_WAIT_TIMEOUT : ASYNC_BACKOFF);
+
+    enif_mutex_lock(async_mtx);
+    if (async_stop || (!async_started && !start_async_poller())) {
+        enif_mutex_unlock(async_mtx);
+        enif_free(job->fds);
+        job->fds = NULL;
+        job->numfds = 0;
+        return 0;
+    }
+    job->next = async_jobs;
+    async_jobs = job;
+    if (write(async_pipe[1], "", 1) < 0) {
+        /* The pipe is full, so the poller wakes up anyway */
+    }
+    enif_mutex_unlock(async_mtx);
+    return 1;
+}
+#endif
+
+static void *worker_loop(void *arg) {
+    job_queue_t *queue = (job_queue_t *) arg;
+    tls_job_t *job;
+
+    for (;;) {
+        enif_mutex_lock(workers_mtx);
+        while (!queue->head && !workers_stop)
+            enif_cond_wait(queue->cond, workers_mtx);
+        if (workers_stop) {
+            enif_mutex_unlock(workers_mtx);
+            break;
+        }
+        job = queue->head;
+        queue->head = job->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        enif_mutex_unlock(workers_mtx);
+
+        switch (job->type) {
+            case JOB_HANDSHAKE:
+            case JOB_ASYNC_HANDSHAKE:
+                if (run_handshake_job(job))
+                    continue;
+                break;
+            case JOB_RELOAD:
+                run_reload_job(job);
+                break;
+            case JOB_PREWARM:
+                if (run_prewarm_job(job))
+                    continue;
+                break;
+        }
+        free_job(job);
+    }
+    return NULL;
+}
+
+/* Must be called with workers_mtx held */
+static int start_workers() {
+    ErlNifSysInfo sys_info;
+    int i, num, num_bulk;
+
+    enif_system_info(&sys_info, sizeof(ErlNifSysInfo));
+    num = sys_info.scheduler_threads > 0 ? sys_info.scheduler_threads : 1;
+    num_bulk = (num + 3) / 4;
+    workers = enif_alloc((num + num_bulk) * sizeof(ErlNifTid));
+    if (!workers)
+        return 0;
+    /* The bulk threads first, so that both queues get at least one */
+    for (i = 0; i < num + num_bulk; i++) {
+        if (enif_thread_create(i < num_bulk ? "fast_tls_bulk_worker" :
+                                              "fast_tls_worker",
+                               &workers[i], worker_loop,
+                               i < num_bulk ? &bulk_jobs : &handshake_jobs,
+                               NULL) != 0)
+            break;
+    }
+    workers_num = i;
+    if (workers_num <= num_bulk) {
+        workers_stop = 1;
+        enif_cond_broadcast(bulk_jobs.cond);
+        enif_mutex_unlock(workers_mtx);
+        for (i = 0; i < workers_num; i++)
+            enif_thread_join(workers[i], NULL);
+        enif_mutex_lock(workers_mtx);
+        workers_stop = 0;
+        enif_free(workers);
+        workers = NULL;
+        workers_num = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void free_queued_jobs(job_queue_t *queue) {
+    tls_job_t *job;
+
+    while ((job = queue->head)) {
+        queue->head = job->next;
+        free_job(job);
+    }
+    queue->tail = NULL;
+}
+
+static void stop_workers() {
+    int i;
+
+    enif_mutex_lock(workers_mtx);
+    workers_stop = 1;
+    enif_cond_broadcast(handshake_jobs.cond);
+    enif_cond_broadcast(bulk_jobs.cond);
+    enif_mutex_unlock(workers_mtx);
+
+    for (i = 0; i < workers_num; i++)
+        enif_thread_join(workers[i], NULL);
+    enif_free(workers);
+    workers = NULL;
+    workers_num = 0;
+
+    free_queued_jobs(&handshake_jobs);
+    free_queued_jobs(&bulk_jobs);
+}
+
+/* Handshake steps go to the handshake queue, everything else to the
+ * bulk queue. Fails once the workers are stopped. */
+static int queue_job(tls_job_t *job) {
+    job_queue_t *queue = job->type == JOB_HANDSHAKE ||
+                         job->type == JOB_ASYNC_HANDSHAKE ?
+                         &handshake_jobs : &bulk_jobs;
+
+    enif_mutex_lock(workers_mtx);
+    if (workers_stop || (workers_num == 0 && !start_workers())) {
+        enif_mutex_unlock(workers_mtx);
+        return 0;
+    }
+    job->next = NULL;
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    enif_cond_signal(queue->cond);
+    enif_mutex_unlock(workers_mtx);
+    return 1;
+}
+
+/*
+ * Queues a job for the state, or parks it for JOB_ASYNC_WAIT, which
+ * must be submitted with state->mtx held. On success stores in ref
+ * the reference the calling process will be notified with.
+ */
+static int submit_job(ErlNifEnv *env, state_t *state, int type,
+                      ERL_NIF_TERM *ref) {
+    tls_job_t *job;
+    int queued;
+
+    job = enif_alloc(sizeof(tls_job_t));
+    if (!job)
+        return 0;
+    memset(job, 0, sizeof(tls_job_t));
+    job->env = enif_alloc_env();
+    if (!job->env) {
+        enif_free(job);
+        return 0;
+    }
+    job->type = type;
+    job->retries = 0;
+    job->ref = enif_make_ref(job->env);
+    job->state = state;
+    job->prewarm = NULL;
+    enif_self(env, &job->pid);
+    if (state)
+        enif_keep_resource(state);
+    *ref = enif_make_copy(env, job->ref);
+
+#ifdef HAS_ASYNC_MODE
+    if (type == JOB_ASYNC_WAIT)
+        queued = park_async_job(job);
+    else
+#endif
+        queued = queue_job(job);
+    if (!queued) {
+        free_job(job);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Grows the per-connection decrypt buffer to hold at least size bytes.
+ * Must be called with state->mtx held.
+ */
+static int reserve_read_buffer(state_t *state, size_t size) {
+    unsigned char *buf;
+
+    if (size <= state->read_buffer_size)
+        return 1;
+    if (size < BUF_SIZE)
+        size = BUF_SIZE;
+    buf = enif_realloc(state->read_buffer, size);
+    if (!buf)
+        return 0;
+    state->read_buffer = buf;
+    state->read_buffer_size = size;
+    return 1;
+}
+
+#ifdef HAS_EARLY_DATA
+#define reading_early_data(state) \
+    ((state)->early_data && SSL_is_server((state)->ssl))
+
+/*
+ * Reads the early data sent by the client into the read buffer after
+ * *rlen bytes. Returns 1 once all of it has been read, 0 if more input
+ * is needed, -1 on errors.
+ */
+static int read_early_data(state_t *state, size_t *rlen) {
+    size_t n;
+    int res;
+
+    for (;;) {
+        if (!reserve_read_buffer(state, *rlen + RECORD_SIZE))
+            return -1;
+        res = SSL_read_early_data(state->ssl, state->read_buffer + *rlen,
+                                  RECORD_SIZE, &n);
+        if (res == SSL_READ_EARLY_DATA_SUCCESS) {
+            *rlen += n;
+        } else if (res == SSL_READ_EARLY_DATA_FINISH) {
+            state->early_data = 0;
+            return 1;
+        } else {
+            res = SSL_get_error(state->ssl, 0);
+            return res == SSL_ERROR_WANT_READ ? 0 : -1;
+        }
+    }
+}
+#else
+#define reading_early_data(state) 0
+#endif
+
+#define DECRYPT_OK 0
+#define DECRYPT_SEND 1
+#define DECRYPT_ERROR 2
+
+/*
+ * Runs the pending handshake step, flushes buffered output and reads
+ * up to req_size bytes of decrypted data (all available data if req_size
+ * is 0). Must be called with state->mtx held.
+ * On success stores the data in *result and returns DECRYPT_OK, or
+ * DECRYPT_SEND if there is encrypted output to be sent to the peer.
+ * Otherwise stores the error term in *result and returns DECRYPT_ERROR.
+ */
+static int decrypt_input(ErlNifEnv *env, state_t *state,
+                         unsigned int req_size, ERL_NIF_TERM *result) {
+    size_t rlen = 0, size;
+    int res;
+    unsigned char *data;
+    int retcode = DECRYPT_OK;
+
+#ifdef HAS_EARLY_DATA
+    /* Early data comes before the rest of the handshake */
+    if (reading_early_data(state) && read_early_data(state, &rlen) < 0) {
+        *result = handshake_error(env, state);
+        return DECRYPT_ERROR;
+    }
+#endif
+    if (!SSL_is_init_finished(state->ssl) && !reading_early_data(state)) {
+        retcode = DECRYPT_SEND;
+        res = SSL_do_handshake(state->ssl);
+        if (res <= 0) {
+            int err = SSL_get_error(state->ssl, res);
+#ifdef HAS_ASYNC_MODE
+            if (err == SSL_ERROR_WANT_ASYNC) {
+                ERL_NIF_TERM ref;
+                if (!submit_job(env, state, JOB_ASYNC_WAIT, &ref))
+                    *result = ERR_T(enif_make_atom(env, "enomem"));
+                else
+                    *result = enif_make_tuple2(env,
+                                               enif_make_atom(env, "pending"),
+                                               ref);
+                return DECRYPT_ERROR;
+            }
+#endif
+            if (err != SSL_ERROR_WANT_READ) {
+                *result = handshake_error(env, state);
+                return DECRYPT_ERROR;
+            }
+        }
+    }
+    if (SSL_is_init_finished(state->ssl)) {
+        long written = flush_write_queue(env, state);
+        if (written < 0) {
+            char *error = "SSL_write failed";
+            *result = ERR_T(enif_make_string(env, error, ERL_NIF_LATIN1));
+            return DECRYPT_ERROR;
+        }
+        if (written > 0)
+            retcode = DECRYPT_SEND;
+        /*
+         * Plaintext never exceeds the decrypted bytes left in the current
+         * record plus the ciphertext still queued, so size each read from
+         * those and only touch the buffer when there is something to read.
+         */
+        res = 0;
+        while (req_size == 0 || rlen < req_size) {
+            size = SSL_pending(state->ssl) + BIO_ctrl_pending(state->bio_read);
+            if (size == 0)
+                break;
+            if (req_size != 0 && size > req_size - rlen)
+                size = req_size - rlen;
+            if (!reserve_read_buffer(state, rlen + size)) {
+                *result = ERR_T(enif_make_atom(env, "enomem"));
+                return DECRYPT_ERROR;
+            }
+            res = SSL_read(state->ssl, state->read_buffer + rlen, size);
+            if (res <= 0)
+                break;
+            rlen += res;
+        }
+
+        if (state->handshakes > 1 && SSL_is_server(state->ssl) &&
+            !SSL_get_secure_renegotiation_support(state->ssl)) {
+            char *error = "client renegotiations forbidden";
+            *result = ERR_T(enif_make_string(env, error, ERL_NIF_LATIN1));
+            return DECRYPT_ERROR;
+        }
+
+        if (res < 0) {
+            int error = SSL_get_error(state->ssl, res);
+
+            if (error == SSL_ERROR_WANT_READ) {
+                //printf("SSL_read wants more data\r\n");
+                //return 0;
+            }
+            // TODO
+        }
+    } else {
+        retcode = DECRYPT_SEND;
+    }
+
+    /* Results up to 64 bytes become heap binaries */
+    data = enif_make_new_binary(env, rlen, result);
+    if (rlen > 0)
+        memcpy(data, state->read_buffer, rlen);
+    if (state->read_buffer_size > READ_BUFFER_KEEP) {
+        enif_free(state->read_buffer);
+        state->read_buffer = NULL;
+        state->read_buffer_size = 0;
+    }
+    return retcode;
+}
+
+#ifdef HAS_DIRTY_SCHEDULERS
+/*
+ * Handshake messages involve asymmetric crypto which may take
+ * milliseconds, so they are processed on a dirty CPU scheduler.
+ * Established sessions stay on the normal scheduler.
+ * Must be called with state->mtx held.
+ */
+static int needs_dirty_scheduler(state_t *state) {
+    return dirty_schedulers &&
+           !SSL_is_init_finished(state->ssl) &&
+           BIO_ctrl_pending(state->bio_read) > 0;
+}
+
+static ERL_NIF_TERM get_decrypted_input_dirty_nif(ErlNifEnv *env, int argc,
+                                                  const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM process_input_dirty_nif(ErlNifEnv *env, int argc,
+                                            const ERL_NIF_TERM argv[]);
+#endif
+
+static ERL_NIF_TERM get_decrypted_input(ErlNifEnv *env, int argc,
+                                        const ERL_NIF_TERM argv[],
+                                        int dirty) {
+    state_t *state = NULL;
+    unsigned int req_size = 0;
+    ERL_NIF_TERM result;
+    int res;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!enif_get_uint(env, argv[1], &req_size))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+#ifdef HAS_DIRTY_SCHEDULERS
+    if (!dirty && needs_dirty_scheduler(state)) {
+        enif_mutex_unlock(state->mtx);
+        return enif_schedule_nif(env, "get_decrypted_input_nif",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 get_decrypted_input_dirty_nif,
+                                 argc, argv);
+    }
+#endif
+
+    ERR_clear_error();
+
+    res = decrypt_input(env, state, req_size, &result);
+    enif_mutex_unlock(state->mtx);
+
+    switch (res) {
+        case DECRYPT_OK:
+            return OK_T(result);
+        case DECRYPT_SEND:
+            return SEND_T(result);
+        default:
+            return result;
+    }
+}
+
+static ERL_NIF_TERM get_decrypted_input_nif(ErlNifEnv *env, int argc,
+                                            const ERL_NIF_TERM argv[]) {
+    return get_decrypted_input(env, argc, argv, 0);
+}
+
+#ifdef HAS_DIRTY_SCHEDULERS
+static ERL_NIF_TERM get_decrypted_input_dirty_nif(ErlNifEnv *env, int argc,
+                                                  const ERL_NIF_TERM argv[]) {
+    return get_decrypted_input(env, argc, argv, 1);
+}
+#endif
+
+/*
+ * In active mode all socket I/O goes through the receiver process, so
+ * the records reach the socket in the order OpenSSL produced them.
+ * Returns 1 and sets *via to {via, Receiver} if the caller is another
+ * process. Must be called with state->mtx held.
+ */
+static int redirect_to_receiver(ErlNifEnv *env, state_t *state,
+                                ERL_NIF_TERM *via) {
+    ErlNifPid self;
+    ERL_NIF_TERM receiver;
+
+    if (!state->has_receiver || !enif_self(env, &self))
+        return 0;
+    receiver = enif_make_pid(env, &state->receiver);
+    if (enif_is_identical(enif_make_pid(env, &self), receiver))
+        return 0;
+    *via = enif_make_tuple2(env, enif_make_atom(env, "via"), receiver);
+    return 1;
+}
+
+/*
+ * Feeds the encrypted input, and returns both the decrypted data and
+ * the encrypted output to be sent to the peer in a single call.
+ */
+static ERL_NIF_TERM process_input(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[],
+                                  int dirty) {
+    state_t *state = NULL;
+    unsigned int req_size = 0;
+    ERL_NIF_TERM plain, output, tag, via;
+
+    if (argc != 3)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!enif_get_uint(env, argv[2], &req_size))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    if (!dirty && redirect_to_receiver(env, state, &via)) {
+        enif_mutex_unlock(state->mtx);
+        return via;
+    }
+
+    if (!write_encrypted_input(env, state, argv[1])) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_badarg(env);
+    }
+
+#ifdef HAS_DIRTY_SCHEDULERS
+    if (!dirty && needs_dirty_scheduler(state)) {
+        ERL_NIF_TERM args[3];
+        enif_mutex_unlock(state->mtx);
+        /* The input has been consumed already */
+        args[0] = argv[0];
+        enif_make_new_binary(env, 0, &args[1]);
+        args[2] = argv[2];
+        return enif_schedule_nif(env, "process_input_nif",
+                                 ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 process_input_dirty_nif,
+                                 3, args);
+    }
+#endif
+
+    ERR_clear_error();
+
+    if (decrypt_input(env, state, req_size, &plain) == DECRYPT_ERROR) {
+        enif_mutex_unlock(state->mtx);
+        return plain;
+    }
+    output = encrypted_output(env, state);
+    /* {ktls, ...} asks the caller to send the output and then call
+     * ktls_start_nif() */
+    tag = enif_make_atom(env, ktls_status(state) == KTLS_READY ? "ktls" : "ok");
+    enif_mutex_unlock(state->mtx);
+
+    return enif_make_tuple3(env, tag, plain, output);
+}
+
+static ERL_NIF_TERM process_input_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+    return process_input(env, argc, argv, 0);
+}
+
+#ifdef HAS_DIRTY_SCHEDULERS
+static ERL_NIF_TERM process_input_dirty_nif(ErlNifEnv *env, int argc,
+                                            const ERL_NIF_TERM argv[]) {
+    return process_input(env, argc, argv, 1);
+}
+#endif
+
+/*
+ * Encrypts the data and returns the encrypted output to be sent
+ * to the peer. Returns {queued, Output} if the data has been buffered
+ * until the handshake is complete, or {busy, QueuedBytes} if the write
+ * queue is over its high watermark. With kernel TLS the plaintext is
+ * returned as is, and {ktls, Output} means the output must be sent
+ * before calling ktls_start_nif(). Returns {via, Receiver} if the
+ * socket is in active mode and the caller is not the receiver.
+ */
+static ERL_NIF_TERM encrypt_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    ERL_NIF_TERM output, via;
+    int res;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    if (redirect_to_receiver(env, state, &via)) {
+        enif_mutex_unlock(state->mtx);
+        return via;
+    }
+
+    if (ktls_status(state) == KTLS_ON && write_queue_size(state) == 0 &&
+        !state->send_queue_busy) {
+        /* The kernel encrypts it */
+        enif_mutex_unlock(state->mtx);
+        return OK_T(argv[1]);
+    }
+
+    ERR_clear_error();
+
+    res = write_decrypted_output(env, state, argv[1]);
+    if (res == WRITE_ERROR) {
+        enif_mutex_unlock(state->mtx);
+        return ssl_error(env, "SSL_write failed");
+    } else if (res == WRITE_BUSY) {
+        output = busy_error(env, state);
+        enif_mutex_unlock(state->mtx);
+        return output;
+    } else if (res == WRITE_BADARG) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_badarg(env);
+    }
+
+    output = encrypted_output(env, state);
+    if (ktls_status(state) == KTLS_READY) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_tuple2(env, enif_make_atom(env, "ktls"), output);
+    }
+    enif_mutex_unlock(state->mtx);
+
+    if (res == WRITE_QUEUED)
+        return enif_make_tuple2(env, enif_make_atom(env, "queued"), output);
+    return OK_T(output);
+}
+
+/*
+ * Prepares the socket for kernel TLS: attaches the "tls" ULP, which
+ * passes data through until keys are installed, and lets OpenSSL hand
+ * over the TLS 1.3 transmit keys. Fails if the kernel has no tls module.
+ */
+static ERL_NIF_TERM ktls_enable_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+#ifdef HAS_KTLS
+    state_t *state = NULL;
+    chunk_bio_t *out;
+    int fd;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!enif_get_int(env, argv[1], &fd) || fd < 0)
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+
+    /* The library loaded may not be the one built against */
+    if (OpenSSL_version_num() < KTLS_MIN_OPENSSL ||
+        OpenSSL_version_num() >= KTLS_MAX_OPENSSL)
+        return ERR_T(enif_make_atom(env, "enotsup"));
+
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 &&
+        errno != EEXIST) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_string(env, strerror(errno), ERL_NIF_LATIN1));
+    }
+
+    out = BIO_get_data(state->bio_write);
+    out->ktls_fd = fd;
+    SSL_set_options(state->ssl, SSL_OP_ENABLE_KTLS);
+    /* Session tickets would have to be sent as control messages */
+    if (SSL_is_server(state->ssl))
+        SSL_set_num_tickets(state->ssl, 0);
+
+    enif_mutex_unlock(state->mtx);
+    return enif_make_atom(env, "ok");
+#else
+    return ERR_T(enif_make_atom(env, "enotsup"));
+#endif
+}
+
+/*
+ * Installs the transmit keys on the socket. All output returned before
+ * must have been written to the socket. Returns the plaintext written
+ * by OpenSSL in the meantime, which the kernel will encrypt.
+ */
+static ERL_NIF_TERM ktls_start_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+#ifdef HAS_KTLS
+    state_t *state = NULL;
+    chunk_bio_t *out;
+    ERL_NIF_TERM output;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    out = BIO_get_data(state->bio_write);
+    if (out->ktls != KTLS_READY) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_badarg(env);
+    }
+
+    if (setsockopt(out->ktls_fd, SOL_TLS, TLS_TX, &out->ktls_info,
+                   out->ktls_info_len) < 0) {
+        output = ERR_T(enif_make_string(env, strerror(errno), ERL_NIF_LATIN1));
+        enif_mutex_unlock(state->mtx);
+        return output;
+    }
+    OPENSSL_cleanse(&out->ktls_info, sizeof(out->ktls_info));
+    out->ktls = KTLS_ON;
+
+    output = encrypted_output(env, state);
+    enif_mutex_unlock(state->mtx);
+    return OK_T(output);
+#else
+    return ERR_T(enif_make_atom(env, "enotsup"));
+#endif
+}
+
+static ERL_NIF_TERM handshake_async_nif(ErlNifEnv *env, int argc,
+                                        const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    ERL_NIF_TERM ref;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
+
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    if (!write_encrypted_input(env, state, argv[1])) {
+        enif_mutex_unlock(state->mtx);
+        return enif_make_badarg(env);
+    }
+    enif_mutex_unlock(state->mtx);
+
+    if (!submit_job(env, state, JOB_HANDSHAKE, &ref))
+        return ERR_T(enif_make_atom(env, "enomem"));
+    return OK_T(ref);
+}
+
+/*
+ * Reloads the contexts whose files changed on a worker thread. The
+ * caller gets {tls_reload, Ref, NumReloaded} when it's done.
+ */
+static ERL_NIF_TERM reload_certfiles_nif(ErlNifEnv *env, int argc,
+                                         const ERL_NIF_TERM argv[]) {
+    ERL_NIF_TERM ref;
+
+    if (!submit_job(env, NULL, JOB_RELOAD, &ref))
+        return ERR_T(enif_make_atom(env, "enomem"));
+    return OK_T(ref);
+}
+
+/* Returns the certificate files of all domains, or NULL */
+static char **get_domain_certfiles(size_t *num) {
+    cert_info_t *info = NULL;
+    cert_info_t *tmp = NULL;
+    size_t size = 0;
+    size_t len;
+    char **files;
+    char *p;
+
+    enif_rwlock_rlock(certfiles_map_lock);
+    *num = HASH_COUNT(certfiles_map);
+    HASH_ITER(hh, certfiles_map, info, tmp) {
+        size += strlen(info->file) + 1;
+    }
+    files = enif_alloc(*num * sizeof(char *) + size + 1);
+    if (files) {
+        p = (char *) (files + *num);
+        *num = 0;
+        HASH_ITER(hh, certfiles_map, info, tmp) {
+            len = strlen(info->file) + 1;
+            memcpy(p, info->file, len);
+            files[(*num)++] = p;
+            p += len;
+        }
+    }
+    enif_rwlock_runlock(certfiles_map_lock);
+    return files;
+}
+
+/*
+ * Builds the contexts of all domains added with add_certfile_nif() with
+ * the settings of the profile, on the worker threads. Contexts already
+ * cached are skipped, and connections only wait for the domains they
+ * need. The caller gets {tls_prewarm, Ref, Done, Failed, Total} about
+ * every percent of the domains, and when all of them are done.
+ */
+static ERL_NIF_TERM prewarm_all_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    profile_t *profile = NULL;
+    prewarm_t *prewarm;
+    tls_job_t *job;
+    ErlNifSysInfo sys_info;
+    ERL_NIF_TERM ref;
+    size_t i, num_jobs;
+    int queued = 0;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_profile_t, (void *) &profile))
+        return enif_make_badarg(env);
+
+    prewarm = enif_alloc(sizeof(prewarm_t));
+    if (!prewarm)
+        return ERR_T(enif_make_atom(env, "enomem"));
+    memset(prewarm, 0, sizeof(prewarm_t));
+    prewarm->files = get_domain_certfiles(&prewarm->total);
+    prewarm->env = enif_alloc_env();
+    prewarm->mtx = enif_mutex_create("prewarm_mtx");
+    if (!prewarm->files || !prewarm->env || !prewarm->mtx) {
+        if (prewarm->mtx)
+            enif_mutex_destroy(prewarm->mtx);
+        if (prewarm->env)
+            enif_free_env(prewarm->env);
+        enif_free(prewarm->files);
+        enif_free(prewarm);
+        return ERR_T(enif_make_atom(env, "enomem"));
+    }
+    prewarm->profile = profile;
+    enif_keep_resource(profile);
+    /* Held until all jobs are queued */
+    prewarm->refs = 1;
+    prewarm->step = prewarm->total >= 100 ? prewarm->total / 100 : 1;
+    prewarm->ref = enif_make_ref(prewarm->env);
+    enif_self(env, &prewarm->pid);
+    ref = enif_make_copy(env, prewarm->ref);
+
+    if (!prewarm->total) {
+        enif_send(env, &prewarm->pid, NULL,
+                  enif_make_tuple5(env, enif_make_atom(env, "tls_prewarm"),
+                                   ref, enif_make_uint64(env, 0),
+                                   enif_make_uint64(env, 0),
+                                   enif_make_uint64(env, 0)));
+        release_prewarm(prewarm);
+        return OK_T(ref);
+    }
+
+    enif_system_info(&sys_info, sizeof(ErlNifSysInfo));
+    num_jobs = sys_info.scheduler_threads > 0 ? sys_info.scheduler_threads : 1;
+    if (num_jobs > prewarm->total)
+        num_jobs = prewarm->total;
+    for (i = 0; i < num_jobs; i++) {
+        job = enif_alloc(sizeof(tls_job_t));
+        if (!job)
+            break;
+        memset(job, 0, sizeof(tls_job_t));
+        job->env = enif_alloc_env();
+        if (!job->env) {
+            enif_free(job);
+            break;
+        }
+        job->type = JOB_PREWARM;
+        job->retries = 0;
+        job->state = NULL;
+        job->prewarm = prewarm;
+        job->pid = prewarm->pid;
+        enif_mutex_lock(prewarm->mtx);
+        prewarm->refs++;
+        enif_mutex_unlock(prewarm->mtx);
+        if (!queue_job(job)) {
+            free_job(job);
+            break;
+        }
+        queued++;
+    }
+    release_prewarm(prewarm);
+
+    if (!queued)
+        return ERR_T(enif_make_atom(env, "enomem"));
+    return OK_T(ref);
+}
+
+static ERL_NIF_TERM add_certfile_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+    ErlNifBinary domain, file;
+    cert_info_t *info = NULL;
+    cert_info_t *old_info = NULL;
+
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &file))
+        return enif_make_badarg(env);
+
+    info = enif_alloc(sizeof(cert_info_t));
+    if (!info)
+        return ERR_T(enif_make_atom(env, "enomem"));
+    memset(info, 0, sizeof(cert_info_t));
+    info->key = enif_alloc(domain.size + 1);
+    info->file = enif_alloc(file.size + 1);
+    if (!info->key || !info->file) {
+        free_cert_info(info);
+        return ERR_T(enif_make_atom(env, "enomem"));
+    }
+    memcpy(info->key, domain.data, domain.size);
+    memcpy(info->file, file.data, file.size);
+    info->key[domain.size] = 0;
+    info->file[file.size] = 0;
+    lower_name(info->key);
+
+    enif_rwlock_rwlock(certfiles_map_lock);
+    /* A name the SNI index can't hold, e.g. with an empty label, would
+     * never be found. Otherwise its slot is taken from the old entry. */
+    if (domain.size < SNI_MAX_NAME && add_sni_entry(info)) {
+        HASH_REPLACE_STR(certfiles_map, key, info, old_info);
+        free_cert_info(old_info);
+        info = NULL;
+    }
+    enif_rwlock_rwunlock(certfiles_map_lock);
+    if (info) {
+        free_cert_info(info);
+        return ERR_T(enif_make_atom(env, "einval"));
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM delete_certfile_nif(ErlNifEnv *env, int argc,
+                                        const ERL_NIF_TERM argv[]) {
+    ErlNifBinary domain;
+    char *ret = "false";
+    cert_info_t *info = NULL;
+
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
+        return enif_make_badarg(env);
+
+    char key[domain.size + 1];
+    memcpy(key, domain.data, domain.size);
+    key[domain.size] = 0;
+    lower_name(key);
+    enif_rwlock_rwlock(certfiles_map_lock);
+    HASH_FIND_STR(certfiles_map, key, info);
+    if (info) {
+        del_sni_entry(info);
+        HASH_DEL(certfiles_map, info);
+        free_cert_info(info);
+        ret = "true";
+    }
+    enif_rwlock_rwunlock(certfiles_map_lock);
+
+    return enif_make_atom(env, ret);
+}
+
+/* The key is looked for anywhere in the PEM data, the certificates
+ * are taken in order, the first one being the server's */
+static char *parse_pem_cert(ErlNifBinary *pem, mem_cert_t *mc) {
+    X509 *x;
+    BIO *bio = BIO_new_mem_buf((void *) pem->data, pem->size);
+
+    if (!bio)
+        return "BIO_new_mem_buf failed";
+    mc->cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    while (mc->cert && (x = PEM_read_bio_X509(bio, NULL, NULL, NULL))) {
+        if (!sk_X509_push(mc->chain, x)) {
+            X509_free(x);
+            BIO_free(bio);
+            return "Memory allocation failed";
+        }
+    }
+    BIO_free(bio);
+    /* Reaching the end of the data leaves an error behind */
+    ERR_clear_error();
+    if (!mc->cert)
+        return "No certificate found";
+
+    bio = BIO_new_mem_buf((void *) pem->data, pem->size);
+    if (!bio)
+        return "BIO_new_mem_buf failed";
+    /* An empty passphrase, so that encrypted keys fail instead of
+     * prompting on the terminal */
+    mc->key = PEM_read_bio_PrivateKey(bio, NULL, NULL, "");
+    BIO_free(bio);
+    if (!mc->key)
+        return "No private key found";
+    return NULL;
+}
+
+static char *parse_der_cert(ErlNifEnv *env, ERL_NIF_TERM certs,
+                            ErlNifBinary *key, mem_cert_t *mc) {
+    ERL_NIF_TERM head, tail = certs;
+    ErlNifBinary bin;
+    const unsigned char *p;
+    X509 *x;
+
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+        enif_inspect_binary(env, head, &bin);
+        p = bin.data;
+        x = d2i_X509(NULL, &p, bin.size);
+        if (!x)
+            return "Failed to parse certificate";
+        if (!mc->cert) {
+            mc->cert = x;
+        } else if (!sk_X509_push(mc->chain, x)) {
+            X509_free(x);
+            return "Memory allocation failed";
+        }
+    }
+    if (!mc->cert)
+        return "No certificate found";
+
+    p = key->data;
+    mc->key = d2i_AutoPrivateKey(NULL, &p, key->size);
+    if (!mc->key)
+        return "Failed to parse private key";
+    return NULL;
+}
+
+/*
+ * Takes either a PEM binary and an empty binary, or a list of DER
+ * certificates and a DER private key. Returns the name of the loaded
+ * certificate, without parsing anything if it's already loaded.
+ */
+static ERL_NIF_TERM load_certificate_nif(ErlNifEnv *env, int argc,
+                                         const ERL_NIF_TERM argv[]) {
+    ErlNifBinary pem, key, bin;
+    ERL_NIF_TERM head, tail, result;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0, i;
+    size_t prefix_len = strlen(MEM_CERT_PREFIX);
+    int is_pem;
+    mem_cert_t *mc = NULL;
+    mem_cert_t *old = NULL;
+    EVP_MD_CTX *md;
+    char *err_str;
+    int ok;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    is_pem = enif_inspect_binary(env, argv[0], &pem);
+    if (!enif_inspect_binary(env, argv[1], &key) ||
+        (is_pem && key.size) || (!is_pem && !enif_is_list(env, argv[0])))
+        return enif_make_badarg(env);
+    for (tail = argv[0]; !is_pem &&
+                         enif_get_list_cell(env, tail, &head, &tail);)
+        if (!enif_is_binary(env, head))
+            return enif_make_badarg(env);
+
+    ERR_clear_error();
+
+    md = get_md_ctx();
+    if (!md)
+        return ERR_T(enif_make_atom(env, "enomem"));
+    ok = EVP_DigestInit_ex(md, sha256_md, NULL);
+    if (is_pem) {
+        ok = ok && EVP_DigestUpdate(md, pem.data, pem.size);
+    } else {
+        /* DER is self-delimiting, so the concatenation is unambiguous */
+        for (tail = argv[0]; ok &&
+                             enif_get_list_cell(env, tail, &head, &tail);) {
+            enif_inspect_binary(env, head, &bin);
+            ok = EVP_DigestUpdate(md, bin.data, bin.size);
+        }
+        ok = ok && EVP_DigestUpdate(md, key.data, key.size);
+    }
+    if (!ok || !EVP_DigestFinal_ex(md, digest, &digest_len))
+        return ssl_error(env, "Failed to compute certificate digest");
+
+    unsigned char *id = enif_make_new_binary(env, prefix_len + 2 * digest_len,
+                                             &result);
+    char id_str[prefix_len + 2 * digest_len + 1];
+    memcpy(id_str, MEM_CERT_PREFIX, prefix_len);
+    for (i = 0; i < digest_len; i++)
+        sprintf(id_str + prefix_len + 2 * i, "%02x", digest[i]);
+    memcpy(id, id_str, prefix_len + 2 * digest_len);
+
+    enif_rwlock_rlock(mem_certs_lock);
+    HASH_FIND_STR(mem_certs, id_str, old);
+    enif_rwlock_runlock(mem_certs_lock);
+    if (old)
+        return OK_T(result);
+
+    mc = enif_alloc(sizeof(mem_cert_t));
+    if (!mc)
+        return ERR_T(enif_make_atom(env, "enomem"));
+    memset(mc, 0, sizeof(mem_cert_t));
+    mc->id = enif_alloc(sizeof(id_str));
+    mc->chain = sk_X509_new_null();
+    if (!mc->id || !mc->chain) {
+        free_mem_cert(mc);
+        return ERR_T(enif_make_atom(env, "enomem"));
+    }
+    memcpy(mc->id, id_str, sizeof(id_str));
+
+    if (is_pem)
+        err_str = parse_pem_cert(&pem, mc);
+    else
+        err_str = parse_der_cert(env, argv[0], &key, mc);
+    if (!err_str && !X509_check_private_key(mc->cert, mc->key))
+        err_str = "Private key does not match the certificate";
+    if (err_str) {
+        free_mem_cert(mc);
+        return ssl_error(env, err_str);
+    }
+
+    enif_rwlock_rwlock(mem_certs_lock);
+    HASH_FIND_STR(mem_certs, id_str, old);
+    if (old)
+        free_mem_cert(mc);
+    else
+        HASH_ADD_KEYPTR(hh, mem_certs, mc->id, strlen(mc->id), mc);
+    enif_rwlock_rwunlock(mem_certs_lock);
+
+    return OK_T(result);
+}
+
+static ERL_NIF_TERM delete_certificate_nif(ErlNifEnv *env, int argc,
+                                           const ERL_NIF_TERM argv[]) {
+    ErlNifBinary id;
+    char *ret = "false";
+    mem_cert_t *mc = NULL;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &id))
+        return enif_make_badarg(env);
+
+    char key[id.size + 1];
+    memcpy(key, id.data, id.size);
+    key[id.size] = 0;
+    enif_rwlock_rwlock(mem_certs_lock);
+    HASH_FIND_STR(mem_certs, key, mc);
+    if (mc) {
+        HASH_DEL(mem_certs, mc);
+        free_mem_cert(mc);
+        ret = "true";
+    }
+    enif_rwlock_rwunlock(mem_certs_lock);
+
+    return enif_make_atom(env, ret);
+}
+
+static ERL_NIF_TERM get_certfile_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+    ErlNifBinary domain;
+    cert_info_t *info = NULL;
+    ERL_NIF_TERM file, result;
+
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
+        return enif_make_badarg(env);
+
+    char key[domain.size + 1];
+    memcpy(key, domain.data, domain.size);
+    key[domain.size] = 0;
+    enif_rwlock_rlock(certfiles_map_lock);
+    info = lookup_certfile(key);
+    if (info) {
+        unsigned char *tmp = enif_make_new_binary(env, strlen(info->file), &file);
+        if (tmp) {
+            memcpy(tmp, info->file, strlen(info->file));
+            result = enif_make_tuple2(env, enif_make_atom(env, "ok"), file);
+        } else
+            result = enif_make_atom(env, "error");
+    } else {
+        result = enif_make_atom(env, "error");
+    }
+    enif_rwlock_runlock(certfiles_map_lock);
+
+    return result;
+}
+
+static ERL_NIF_TERM clear_cache_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    clear_certs_map();
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * Returns a copy of the certificate file of the domain, or NULL. With
+ * exact set, only the entry added for that very name is returned,
+ * without falling back to wildcards or suffixes.
+ */
+static char *get_domain_certfile(ErlNifBinary *domain, int exact) {
+    cert_info_t *info = NULL;
+    char *file = NULL;
+    size_t len;
+
+    char name[domain->size + 1];
+    memcpy(name, domain->data, domain->size);
+    name[domain->size] = 0;
+    enif_rwlock_rlock(certfiles_map_lock);
+    if (exact) {
+        lower_name(name);
+        HASH_FIND_STR(certfiles_map, name, info);
+    } else {
+        info = lookup_certfile(name);
+    }
+    if (info) {
+        len = strlen(info->file) + 1;
+        file = enif_alloc(len);
+        if (file)
+            memcpy(file, info->file, len);
+    }
+    enif_rwlock_runlock(certfiles_map_lock);
+    return file;
+}
+
+static int ctx_uses_file(cert_info_t *info, const char *file,
+                         const char *domain_file) {
+    return !strcmp(info->file, file) || !strcmp(info->dh_file, file) ||
+           !strcmp(info->ca_file, file) ||
+           (domain_file && !strcmp(info->file, domain_file));
+}
+
+/*
+ * Drops the cached contexts built from a certificate, CA or DH file,
+ * or from the certificate added with add_certfile_nif() for exactly
+ * that domain name, so that "*.example.com" has to be given as such.
+ * Builds in flight for them are not cached when they finish. Returns
+ * the number of contexts dropped.
+ */
+static ERL_NIF_TERM invalidate_cache_nif(ErlNifEnv *env, int argc,
+                                         const ERL_NIF_TERM argv[]) {
+    ErlNifBinary name;
+    cert_info_t *info = NULL;
+    cert_info_t *tmp = NULL;
+    ctx_build_t *build = NULL;
+    ctx_build_t *build_tmp = NULL;
+    char *domain_file;
+    int num = 0, stale = 0;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (!enif_inspect_iolist_as_binary(env, argv[0], &name) || !name.size)
+        return enif_make_badarg(env);
+
+    char file[name.size + 1];
+    memcpy(file, name.data, name.size);
+    file[name.size] = 0;
+    domain_file = get_domain_certfile(&name, 1);
+
+    enif_mutex_lock(ctx_builds_mtx);
+    HASH_ITER(hh, ctx_builds, build, build_tmp) {
+        if (ctx_uses_file(&build->files, file, domain_file)) {
+            ATOMIC_SET(&build->stale, 1);
+            stale++;
+        }
+    }
+    enif_mutex_unlock(ctx_builds_mtx);
+
+    enif_rwlock_rwlock(certs_map_lock);
+    HASH_ITER(hh, certs_map, info, tmp) {
+        if (ctx_uses_file(info, file, domain_file)) {
+            HASH_DEL(certs_map, info);
+            free_cert_info(info);
+            num++;
+        }
+    }
+    /* Profiles may hold a stale build too */
+    if (num || stale)
+        ATOMIC_INC(&ctx_generation);
+    enif_rwlock_rwunlock(certs_map_lock);
+
+    if (domain_file)
+        enif_free(domain_file);
+    return enif_make_int(env, num);
+}
+
+/*
+ * Builds the context of the profile, or of the domain if not empty,
+ * with the settings of the profile. A cached context is replaced.
+ */
+static ERL_NIF_TERM prewarm(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+    profile_t *profile = NULL;
+    ErlNifBinary domain;
+    SSL_CTX *ctx = NULL;
+    char *file = NULL;
+    char *err_str;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_resource(env, argv[0], tls_profile_t, (void *) &profile))
+        return enif_make_badarg(env);
+    if (!enif_inspect_iolist_as_binary(env, argv[1], &domain))
+        return enif_make_badarg(env);
+
+    if (domain.size) {
+        file = get_domain_certfile(&domain, 0);
+        if (!file)
+            return ERR_T(enif_make_atom(env, "not_found"));
+    }
+
+    ERR_clear_error();
+    err_str = get_ssl_ctx(profile, file ? file : profile->cert_file, 1, &ctx);
+    if (file)
+        enif_free(file);
+    if (err_str)
+        return ssl_error(env, err_str);
+    SSL_CTX_free(ctx);
+
+    return enif_make_atom(env, "ok");
+}
+
+#ifdef HAS_DIRTY_SCHEDULERS
+static ERL_NIF_TERM prewarm_dirty_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+    return prewarm(env, argc, argv);
+}
+#endif
+
+/* Files are read, so the build runs on a dirty I/O scheduler */
+static ERL_NIF_TERM prewarm_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+#ifdef HAS_DIRTY_SCHEDULERS
+    if (dirty_schedulers)
+        return enif_schedule_nif(env, "prewarm_nif",
+                                 ERL_NIF_DIRTY_JOB_IO_BOUND,
+                                 prewarm_dirty_nif, argc, argv);
+#endif
+    return prewarm(env, argc, argv);
+}
+
+/*
+ * Sets the number of client sessions kept and their lifetime in
+ * seconds. A size of 0 disables the store.
+ */
+static ERL_NIF_TERM set_client_session_cache_nif(ErlNifEnv *env, int argc,
+                                                 const ERL_NIF_TERM argv[]) {
+    ErlNifUInt64 size;
+    unsigned int timeout;
+
+    if (argc != 2)
+        return enif_make_badarg(env);
+
+    if (!enif_get_uint64(env, argv[0], &size) ||
+        !enif_get_uint(env, argv[1], &timeout) || timeout == 0)
+        return enif_make_badarg(env);
+
+    client_session_cache_size = size;
+    client_session_cache_timeout = timeout;
+    if (size == 0)
+        flush_client_sessions();
+    clear_certs_map();
+
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * Replaces the session ticket key ring with a non-empty list of
+ * 48 or 80 byte keys, the first one being used for new tickets,
+ * or with a random key for this node only if given 'local'.
+ */
+static ERL_NIF_TERM set_ticket_keys_nif(ErlNifEnv *env, int argc,
+                                        const ERL_NIF_TERM argv[]) {
+    ERL_NIF_TERM head, tail;
+    ErlNifBinary bin;
+    ticket_key_t *keys;
+    unsigned int i, num;
+
+    if (argc != 1)
+        return enif_make_badarg(env);
+
+    if (enif_is_identical(argv[0], enif_make_atom(env, "local"))) {
+        if (!init_ticket_keys())
+            return ERR_T(enif_make_atom(env, "enomem"));
+        return enif_make_atom(env, "ok");
+    }
+
+    if (!enif_get_list_length(env, argv[0], &num) || num == 0)
+        return enif_make_badarg(env);
+
+    keys = enif_alloc(num * sizeof(ticket_key_t));
+    if (!keys)
+        return ERR_T(enif_make_atom(env, "enomem"));
+
+    tail = argv[0];
+    for (i = 0; enif_get_list_cell(env, tail, &head, &tail); i++) {
+        if (!enif_inspect_binary(env, head, &bin) ||
+            !parse_ticket_key(bin.data, bin.size, &keys[i])) {
+            OPENSSL_cleanse(keys, num * sizeof(ticket_key_t));
+            enif_free(keys);
+            return enif_make_badarg(env);
+        }
+    }
+
+    set_ticket_keys(keys, num, 1);
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * Sets the total number of cached server sessions and their lifetime
+ * in seconds. A size of 0 disables the cache. SSL contexts are rebuilt
+ * so they pick up the new settings.
+ */
+static ERL_NIF_TERM set_session_cache_nif(ErlNifEnv *env, int argc,
+                                          const ERL_NIF_TERM argv[]) {
+    ErlNifUInt64 size;
+    unsigned int timeout;
 
-#ifdef SSL_MODE_RELEASE_BUFFERS
-    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
-#endif
-    SSL_CTX_set_verify(ctx, verifyopts, verify_callback);
+    if (argc != 2)
+        return enif_make_badarg(env);
 
-#ifndef SSL_OP_NO_RENEGOTIATION
-    SSL_CTX_set_info_callback(ctx, &ssl_info_callback);
-#endif
+    if (!enif_get_uint64(env, argv[0], &size) ||
+        !enif_get_uint(env, argv[1], &timeout) || timeout == 0)
+        return enif_make_badarg(env);
 
-    *err_str = NULL;
-    return ctx;
-}
+    session_cache_size = size;
+    session_cache_timeout = timeout;
+    if (size == 0)
+        flush_session_cache();
+    clear_certs_map();
 
-static void set_ctx(state_t *state, SSL_CTX *ctx) {
-    if (state->ssl)
-        SSL_set_SSL_CTX(state->ssl, ctx);
-    else
-        state->ssl = SSL_new(ctx);
+    return enif_make_atom(env, "ok");
 }
 
-static char *create_ssl_for_cert(char *cert_file, state_t *state) {
-    char *ciphers = state->ciphers;
-    char *dh_file = state->dh_file;
-    char *ca_file = state->ca_file;
-    long options = state->options;
-    unsigned int command = state->command;
-
-    char *ret = NULL;
-    cert_info_t *info = NULL;
-    cert_info_t *new_info = NULL;
-    cert_info_t *old_info = NULL;
-    size_t key_size =
-            strlen(cert_file) + strlen(ciphers) + 8 +
-            strlen(dh_file) + strlen(ca_file) + 1;
-    char key[key_size];
-    sprintf(key, "%s%s%08lx%s%s", cert_file, ciphers,
-            options, dh_file, ca_file);
+static ERL_NIF_TERM invalidate_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
 
-    enif_rwlock_rlock(certs_map_lock);
+    if (argc != 1)
+        return enif_make_badarg(env);
 
-    HASH_FIND_STR(certs_map, key, info);
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
 
-    if (strlen(cert_file) == 0) cert_file = NULL;
-    if (strlen(dh_file) == 0) dh_file = NULL;
-    if (strlen(ca_file) == 0) ca_file = NULL;
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
 
-    if (info == NULL) {
-        enif_rwlock_runlock(certs_map_lock);
+    enif_mutex_lock(state->mtx);
+    state->valid = 0;
+#ifdef HAS_KTLS
+    ktls_discard(state);
+#endif
+#ifdef HAS_SOCKET_MODE
+    stop_socket(env, state);
+#endif
+    enif_mutex_unlock(state->mtx);
 
-        enif_rwlock_rwlock(certs_map_lock);
-        SSL_CTX *ctx = create_new_ctx(cert_file, ciphers, dh_file, ca_file, command, &ret);
-        if (ret == NULL) {
-            new_info = enif_alloc(sizeof(cert_info_t));
-            if (new_info) {
-                memset(new_info, 0, sizeof(cert_info_t));
-                new_info->key = enif_alloc(key_size);
-                if (new_info->key) {
-                    memcpy(new_info->key, key, key_size);
-                    new_info->ssl_ctx = ctx;
-                    HASH_REPLACE_STR(certs_map, key, new_info, old_info);
-                    free_cert_info(old_info);
-                    set_ctx(state, ctx);
-                } else {
-                    enif_free(new_info);
-                    SSL_CTX_free(ctx);
-                    ret = "Memory allocation failed";
-                }
-            } else {
-                SSL_CTX_free(ctx);
-                ret = "Memory allocation failed";
-            }
-        }
-        enif_rwlock_rwunlock(certs_map_lock);
-    } else {
-        set_ctx(state, info->ssl_ctx);
-        enif_rwlock_runlock(certs_map_lock);
-    }
-    return ret;
+    return enif_make_atom(env, "ok");
 }
 
-static ERL_NIF_TERM open_nif(ErlNifEnv *env, int argc,
-                             const ERL_NIF_TERM argv[]) {
-    unsigned int command;
-    unsigned int flags;
-    char *sni = NULL;
-    ErlNifBinary ciphers_bin;
-    ErlNifBinary certfile_bin;
-    ErlNifBinary protocol_options_bin;
-    ErlNifBinary dhfile_bin;
-    ErlNifBinary cafile_bin;
-    ErlNifBinary sni_bin;
-    ErlNifBinary alpn_bin;
-    long options = 0L;
+static ERL_NIF_TERM get_negotiated_cipher_nif(ErlNifEnv *env, int argc,
+                                              const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
-    size_t po_len_left = 0;
-    unsigned char *po = NULL;
-
-    ERR_clear_error();
 
-    if (argc != 8)
+    if (argc != 1)
         return enif_make_badarg(env);
 
-    if (!enif_get_uint(env, argv[0], &flags))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[1], &certfile_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[2], &ciphers_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[3], &protocol_options_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[4], &dhfile_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[5], &cafile_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[6], &sni_bin))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[7], &alpn_bin))
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
-    command = flags & 0xffff;
-    if (protocol_options_bin.size) {
-        po_len_left = protocol_options_bin.size;
-        po = protocol_options_bin.data;
-    } else {
-        po = (unsigned char *) PROTOCOL_OPTIONS;
-        po_len_left = strlen((char *) po);
-    }
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
 
-    while (po_len_left) {
-        unsigned char *pos = memchr(po, '|', po_len_left);
+    enif_mutex_lock(state->mtx);
 
-        if (!pos) {
-            set_option_flag(po, po_len_left, &options);
-            break;
-        }
-        set_option_flag(po, pos - po, &options);
-        po_len_left -= pos - po + 1;
-        po = pos + 1;
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
     }
 
-    state = init_tls_state();
-    if (!state) return ERR_T(enif_make_atom(env, "enomem"));
+    const char *version = SSL_get_version(state->ssl);
+    const char *cipher = SSL_get_cipher_name(state->ssl);
+    enif_mutex_unlock(state->mtx);
 
-    state->cert_file = enif_alloc(certfile_bin.size + 1 +
-                                  ciphers_bin.size + 1 +
-                                  dhfile_bin.size + 1 +
-                                  cafile_bin.size + 1 +
-                                  sni_bin.size + 1);
-    if (!state->cert_file) {
-        enif_release_resource(state);
+    ErlNifBinary bin;
+    size_t vl = strlen(version);
+    size_t cl = strlen(cipher);
+    if (!enif_alloc_binary(vl + cl + 1, &bin)) {
         return ERR_T(enif_make_atom(env, "enomem"));
     }
-    state->ciphers = state->cert_file + certfile_bin.size + 1;
-    state->dh_file = state->ciphers + ciphers_bin.size + 1;
-    state->ca_file = state->dh_file + dhfile_bin.size + 1;
-    sni = state->ca_file + cafile_bin.size + 1;
-    state->options = options;
-    state->command = command;
-
-    memcpy(state->cert_file, certfile_bin.data, certfile_bin.size);
-    state->cert_file[certfile_bin.size] = 0;
-    memcpy(state->ciphers, ciphers_bin.data, ciphers_bin.size);
-    state->ciphers[ciphers_bin.size] = 0;
-    memcpy(state->dh_file, dhfile_bin.data, dhfile_bin.size);
-    state->dh_file[dhfile_bin.size] = 0;
-    memcpy(state->ca_file, cafile_bin.data, cafile_bin.size);
-    state->ca_file[cafile_bin.size] = 0;
-    memcpy(sni, sni_bin.data, sni_bin.size);
-    sni[sni_bin.size] = 0;
-
-    char *err_str = create_ssl_for_cert(state->cert_file, state);
-    if (err_str) {
-        enif_release_resource(state);
-        return ssl_error(env, err_str);
-    }
+    memcpy(bin.data, version, vl);
+    bin.data[vl] = ' ';
+    memcpy(bin.data + vl + 1, cipher, cl);
+    return enif_make_binary(env, &bin);
+}
 
-    if (!state->ssl) {
-        enif_release_resource(state);
-        return ssl_error(env, "SSL_new failed");
-    }
+/*
+ * Returns accepted if the peer's early data was taken, on a server,
+ * or the data sent early was, on a client. Such data may be a replay.
+ */
+static ERL_NIF_TERM get_early_data_status_nif(ErlNifEnv *env, int argc,
+                                              const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    const char *status = "not_sent";
 
-    if (flags & VERIFY_NONE)
-        SSL_set_verify(state->ssl, SSL_VERIFY_NONE, verify_callback);
+    if (argc != 1)
+        return enif_make_badarg(env);
 
-#ifdef SSL_OP_NO_COMPRESSION
-    if (flags & COMPRESSION_NONE)
-        SSL_set_options(state->ssl, SSL_OP_NO_COMPRESSION);
-#endif
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
 
-    SSL_set_ex_data(state->ssl, ssl_index, state);
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
 
-    state->bio_read = BIO_new(BIO_s_mem());
-    state->bio_write = BIO_new(BIO_s_mem());
+    enif_mutex_lock(state->mtx);
 
-    SSL_set_bio(state->ssl, state->bio_read, state->bio_write);
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
 
-    if (command == SET_CERTIFICATE_FILE_ACCEPT) {
-        options |= (SSL_OP_NO_TICKET | SSL_OP_ALL | SSL_OP_NO_SSLv2);
+#ifdef HAS_EARLY_DATA
+    switch (SSL_get_early_data_status(state->ssl)) {
+        case SSL_EARLY_DATA_ACCEPTED:
+            status = "accepted";
+            break;
+        case SSL_EARLY_DATA_REJECTED:
+            status = "rejected";
+            break;
+    }
+#endif
+    enif_mutex_unlock(state->mtx);
 
-        SSL_set_options(state->ssl, options);
+    return enif_make_atom(env, status);
+}
 
-        SSL_set_accept_state(state->ssl);
-    } else {
-        options |= (SSL_OP_NO_TICKET | SSL_OP_NO_SSLv2);
+/* Returns true if the handshake resumed a session */
+static ERL_NIF_TERM session_reused_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    int reused;
 
-        SSL_set_options(state->ssl, options);
+    if (argc != 1)
+        return enif_make_badarg(env);
 
-        if (strlen(sni) > 0) SSL_set_tlsext_host_name(state->ssl, sni);
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
 
-#if OPENSSL_VERSION_NUMBER >= 0x10002000L
-        if (alpn_bin.size)
-            SSL_set_alpn_protos(state->ssl, alpn_bin.data, alpn_bin.size);
-#endif
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
 
-        SSL_set_connect_state(state->ssl);
+    enif_mutex_lock(state->mtx);
+
+    if (!state->valid) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
     }
 
-#ifdef SSL_OP_NO_RENEGOTIATION
-    SSL_set_options(state->ssl, SSL_OP_NO_RENEGOTIATION);
-#endif
+    reused = SSL_session_reused(state->ssl);
+    enif_mutex_unlock(state->mtx);
 
-    ERL_NIF_TERM result = enif_make_resource(env, state);
-    enif_release_resource(state);
-    return OK_T(result);
+    return enif_make_atom(env, reused ? "true" : "false");
 }
 
-static ERL_NIF_TERM set_encrypted_input_nif(ErlNifEnv *env, int argc,
-                                            const ERL_NIF_TERM argv[]) {
+/*
+ * Sets the write queue watermarks in bytes. A high watermark of 0
+ * disables the limit.
+ */
+static ERL_NIF_TERM set_send_queue_limits_nif(ErlNifEnv *env, int argc,
+                                              const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
-    ErlNifBinary input;
+    ErlNifUInt64 high, low;
 
-    if (argc != 2)
+    if (argc != 3)
         return enif_make_badarg(env);
 
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
-    if (!enif_inspect_iolist_as_binary(env, argv[1], &input))
+    if (!enif_get_uint64(env, argv[1], &high) ||
+        !enif_get_uint64(env, argv[2], &low) ||
+        (high > 0 && low > high))
         return enif_make_badarg(env);
 
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+
     enif_mutex_lock(state->mtx);
 
     if (!state->valid) {
@@ -798,17 +5869,24 @@ static ERL_NIF_TERM set_encrypted_input_nif(ErlNifEnv *env, int argc,
         return ERR_T(enif_make_atom(env, "closed"));
     }
 
-    BIO_write(state->bio_read, input.data, input.size);
-    enif_mutex_unlock(state->mtx);
+    state->send_queue_high = high;
+    state->send_queue_low = low;
+    if (high == 0 || write_queue_size(state) <= low)
+        state->send_queue_busy = 0;
+    else if (write_queue_size(state) >= high)
+        state->send_queue_busy = 1;
 
+    enif_mutex_unlock(state->mtx);
     return enif_make_atom(env, "ok");
 }
 
-static ERL_NIF_TERM set_decrypted_output_nif(ErlNifEnv *env, int argc,
-                                             const ERL_NIF_TERM argv[]) {
+/*
+ * Sets the process that owns the socket I/O in active mode,
+ * or clears it if the argument is not a pid.
+ */
+static ERL_NIF_TERM set_receiver_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
-    int res;
-    ErlNifBinary input;
 
     if (argc != 2)
         return enif_make_badarg(env);
@@ -816,10 +5894,8 @@ static ERL_NIF_TERM set_decrypted_output_nif(ErlNifEnv *env, int argc,
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
-    if (!enif_inspect_iolist_as_binary(env, argv[1], &input))
-        return enif_make_badarg(env);
-
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+
     enif_mutex_lock(state->mtx);
 
     if (!state->valid) {
@@ -827,53 +5903,21 @@ static ERL_NIF_TERM set_decrypted_output_nif(ErlNifEnv *env, int argc,
         return ERR_T(enif_make_atom(env, "closed"));
     }
 
-    if (input.size > 0) {
-        ERR_clear_error();
-
-        if (state->send_buffer != NULL) {
-            if (state->send_buffer2 == NULL) {
-                state->send_buffer2_len = input.size;
-                state->send_buffer2_size = input.size;
-                state->send_buffer2 = enif_alloc(state->send_buffer2_size);
-                memcpy(state->send_buffer2, input.data, input.size);
-            } else {
-                if (state->send_buffer2_size <
-                    state->send_buffer2_len + input.size) {
-                    while (state->send_buffer2_size <
-                           state->send_buffer2_len + input.size) {
-                        state->send_buffer2_size *= 2;
-                    }
-                    state->send_buffer2 = enif_realloc(state->send_buffer2, state->send_buffer2_size);
-                }
-                memcpy(state->send_buffer2 + state->send_buffer2_len, input.data, input.size);
-                state->send_buffer2_len += input.size;
-            }
-        } else {
-            res = SSL_write(state->ssl, input.data, input.size);
-            if (res <= 0) {
-                res = SSL_get_error(state->ssl, res);
-                if (res == SSL_ERROR_WANT_READ || res == SSL_ERROR_WANT_WRITE) {
-                    state->send_buffer_len = input.size;
-                    state->send_buffer_size = input.size;
-                    state->send_buffer = enif_alloc(state->send_buffer_size);
-                    memcpy(state->send_buffer, input.data, input.size);
-                } else {
-                    enif_mutex_unlock(state->mtx);
-                    return ssl_error(env, "SSL_write failed");
-                }
-            }
-        }
-    }
+    state->has_receiver = enif_get_local_pid(env, argv[1], &state->receiver);
+#ifdef HAS_SOCKET_MODE
+    /* The receiver is the controlling process of the TCP socket */
+    if (state->has_receiver)
+        monitor_socket_owner(env, state, &state->receiver);
+#endif
 
     enif_mutex_unlock(state->mtx);
     return enif_make_atom(env, "ok");
 }
 
-static ERL_NIF_TERM get_encrypted_output_nif(ErlNifEnv *env, int argc,
-                                             const ERL_NIF_TERM argv[]) {
+static ERL_NIF_TERM get_receiver_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
-    size_t size;
-    ErlNifBinary output;
+    ERL_NIF_TERM result;
 
     if (argc != 1)
         return enif_make_badarg(env);
@@ -882,105 +5926,226 @@ static ERL_NIF_TERM get_encrypted_output_nif(ErlNifEnv *env, int argc,
         return enif_make_badarg(env);
 
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+
     enif_mutex_lock(state->mtx);
+    if (state->has_receiver)
+        result = OK_T(enif_make_pid(env, &state->receiver));
+    else
+        result = enif_make_atom(env, "none");
+    enif_mutex_unlock(state->mtx);
 
-    if (!state->valid) {
-        enif_mutex_unlock(state->mtx);
-        return ERR_T(enif_make_atom(env, "closed"));
+    return result;
+}
+
+#ifdef HAS_SOCKET_MODE
+/*
+ * NIF socket mode: the NIF owns a duplicate of the TCP socket, reads
+ * the ciphertext and writes the encrypted output itself, so only
+ * decrypted data crosses into Erlang. Readiness is signalled with
+ * enif_select() to the calling process as
+ * {select, State, Ref, ready_input | ready_output}.
+ */
+#define SOCKET_READ_SIZE (RECORD_SIZE + 2048)
+#define SOCKET_READ_MAX (4 * SOCKET_READ_SIZE)
+
+static ERL_NIF_TERM socket_error(ErlNifEnv *env, int err) {
+    switch (err) {
+        case ECONNRESET:
+        case EPIPE:
+            return ERR_T(enif_make_atom(env, "closed"));
+        case ETIMEDOUT:
+            return ERR_T(enif_make_atom(env, "etimedout"));
+        case ENOMEM:
+            return ERR_T(enif_make_atom(env, "enomem"));
+        default:
+            return ERR_T(enif_make_string(env, strerror(err), ERL_NIF_LATIN1));
     }
+}
 
-    ERR_clear_error();
+/*
+ * Writes the pending encrypted output to the socket. Returns 1 if all
+ * of it has been written, 0 if the socket is full, or -1 with errno set.
+ * Must be called with state->mtx held.
+ */
+static int socket_flush(state_t *state) {
+    chunk_bio_t *out = BIO_get_data(state->bio_write);
+    struct iovec iov[64];
+    ssize_t res;
+    int i, n;
+
+    while (out->len > 0) {
+        n = out->len < 64 ? out->len : 64;
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = out->chunks[i].data;
+            iov[i].iov_len = out->chunks[i].size;
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + out->skip;
+        iov[0].iov_len -= out->skip;
+        res = writev(state->fd, iov, n);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        out->pending -= res;
+        res += out->skip;
+        for (i = 0; i < n && res >= out->chunks[i].size; i++) {
+            res -= out->chunks[i].size;
+            enif_release_binary(&out->chunks[i]);
+        }
+        if (i > 0)
+            memmove(out->chunks, out->chunks + i,
+                    (out->len - i) * sizeof(ErlNifBinary));
+        out->len -= i;
+        out->skip = res;
+    }
+    return 1;
+}
 
-    size = BIO_ctrl_pending(state->bio_write);
-    if (!enif_alloc_binary(size, &output)) {
-        enif_mutex_unlock(state->mtx);
-        return ERR_T(enif_make_atom(env, "enomem"));
+/*
+ * Reads the available ciphertext from the socket into the TLS state.
+ * Returns the number of bytes read, 0 at end of file, or -1 with errno
+ * set. Must be called with state->mtx held.
+ */
+static ssize_t socket_read(state_t *state) {
+    ErlNifBinary bin;
+    ssize_t res, total = 0;
+
+    while (total < SOCKET_READ_MAX) {
+        if (!enif_alloc_binary(SOCKET_READ_SIZE, &bin)) {
+            errno = ENOMEM;
+            return total > 0 ? total : -1;
+        }
+        res = read(state->fd, bin.data, bin.size);
+        if (res <= 0) {
+            int err = errno;
+            enif_release_binary(&bin);
+            if (res < 0 && err == EINTR)
+                continue;
+            if (total > 0)
+                return total;
+            errno = err;
+            return res;
+        }
+        if (res < bin.size)
+            enif_realloc_binary(&bin, res);
+        feed_encrypted_input(state, &bin);
+        total += res;
+        if (res < SOCKET_READ_SIZE)
+            break;
     }
-    BIO_read(state->bio_write, output.data, size);
-    enif_mutex_unlock(state->mtx);
-    return OK_T(enif_make_binary(env, &output));
+    return total;
 }
 
-static ERL_NIF_TERM get_verify_result_nif(ErlNifEnv *env, int argc,
-                                          const ERL_NIF_TERM argv[]) {
-    long res;
+/*
+ * Hands the socket over to the NIF. The NIF works on a non-blocking
+ * duplicate of the descriptor, which is closed by invalidate_nif()
+ * or when the calling process, taken as the owner, exits.
+ */
+static ERL_NIF_TERM socket_attach_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
+    ErlNifPid self;
+    int fd, flags;
 
-    if (argc != 1)
+    if (argc != 2)
         return enif_make_badarg(env);
 
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
+    if (!enif_get_int(env, argv[1], &fd) || fd < 0)
+        return enif_make_badarg(env);
+
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
     enif_mutex_lock(state->mtx);
 
-    if (!state->valid) {
+    if (!state->valid || state->fd >= 0) {
         enif_mutex_unlock(state->mtx);
         return ERR_T(enif_make_atom(env, "closed"));
     }
 
-    ERR_clear_error();
-    res = SSL_get_verify_result(state->ssl);
+    fd = dup(fd);
+    if (fd < 0 || (flags = fcntl(fd, F_GETFL)) < 0 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        enif_mutex_unlock(state->mtx);
+        return socket_error(env, err);
+    }
+    state->fd = fd;
+    monitor_socket_owner(env, state, enif_self(env, &self));
+
     enif_mutex_unlock(state->mtx);
-    return OK_T(enif_make_long(env, res));
+    return enif_make_atom(env, "ok");
 }
 
-static ERL_NIF_TERM get_peer_certificate_nif(ErlNifEnv *env, int argc,
-                                             const ERL_NIF_TERM argv[]) {
-    X509 *cert = NULL;
+/* Follows the TCP socket to its new controlling process */
+static ERL_NIF_TERM socket_owner_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
-    int rlen;
-    ErlNifBinary output;
+    ErlNifPid pid;
 
-    if (argc != 1)
+    if (argc != 2)
         return enif_make_badarg(env);
 
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
+    if (!enif_get_local_pid(env, argv[1], &pid))
+        return enif_make_badarg(env);
+
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
     enif_mutex_lock(state->mtx);
+    if (state->valid)
+        monitor_socket_owner(env, state, &pid);
+    enif_mutex_unlock(state->mtx);
+    return enif_make_atom(env, "ok");
+}
 
-    if (!state->valid) {
-        enif_mutex_unlock(state->mtx);
-        return ERR_T(enif_make_atom(env, "closed"));
-    }
-
-    ERR_clear_error();
-
-    cert = SSL_get_peer_certificate(state->ssl);
-    if (!cert) {
-        enif_mutex_unlock(state->mtx);
-        return ssl_error(env, "SSL_get_peer_certificate failed");
-    }
-    rlen = i2d_X509(cert, NULL);
-    if (rlen >= 0) {
-        if (!enif_alloc_binary(rlen, &output)) {
-            enif_mutex_unlock(state->mtx);
-            return ERR_T(enif_make_atom(env, "enomem"));
-        }
-        i2d_X509(cert, &output.data);
-        X509_free(cert);
-        enif_mutex_unlock(state->mtx);
-        return OK_T(enif_make_binary(env, &output));
-    } else {
-        X509_free(cert);
-        enif_mutex_unlock(state->mtx);
-        return ERR_T(enif_make_atom(env, "notfound"));
+/*
+ * Flushes the pending output and, if some is left, asks for
+ * a ready_output message. Must be called with state->mtx held.
+ */
+static ERL_NIF_TERM socket_flush_or_wait(ErlNifEnv *env, state_t *state,
+                                         ERL_NIF_TERM ref) {
+    switch (socket_flush(state)) {
+        case 1:
+            return enif_make_atom(env, "ok");
+        case 0:
+            enif_select(env, state->fd, ERL_NIF_SELECT_WRITE, state, NULL, ref);
+            return enif_make_atom(env, "wait");
+        default:
+            return socket_error(env, errno);
     }
 }
 
-static ERL_NIF_TERM get_decrypted_input_nif(ErlNifEnv *env, int argc,
-                                            const ERL_NIF_TERM argv[]) {
+#ifdef HAS_DIRTY_SCHEDULERS
+static ERL_NIF_TERM socket_recv_dirty_nif(ErlNifEnv *env, int argc,
+                                          const ERL_NIF_TERM argv[]);
+#endif
+
+/*
+ * socket_recv_nif(State, Length, Ref) returns {ok, Data}, {error, Reason}
+ * or wait, in which case the caller gets a select message with Ref once
+ * the socket is readable, or writable if handshake output is pending.
+ * In active mode other processes than the receiver get {via, Receiver}.
+ * Returns flush once after a select could not be cancelled, the caller
+ * drops the select messages with Ref and calls it again.
+ */
+static ERL_NIF_TERM socket_recv(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[], int dirty) {
     state_t *state = NULL;
-    size_t rlen, size;
-    int res;
     unsigned int req_size = 0;
-    ErlNifBinary output;
-    int retcode = 0;
+    ERL_NIF_TERM plain, via;
+    ErlNifBinary data;
+    ssize_t nread = -1;
+    int flushed, err = EAGAIN;
 
-    if (argc != 2)
+    if (argc != 3)
         return enif_make_badarg(env);
 
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
@@ -992,210 +6157,168 @@ static ERL_NIF_TERM get_decrypted_input_nif(ErlNifEnv *env, int argc,
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
     enif_mutex_lock(state->mtx);
 
-    if (!state->valid) {
+    if (!state->valid || state->fd < 0) {
         enif_mutex_unlock(state->mtx);
         return ERR_T(enif_make_atom(env, "closed"));
     }
 
-    ERR_clear_error();
+    if (!dirty && redirect_to_receiver(env, state, &via)) {
+        enif_mutex_unlock(state->mtx);
+        return via;
+    }
 
-    if (!SSL_is_init_finished(state->ssl)) {
-        retcode = 2;
-        res = SSL_do_handshake(state->ssl);
-        if (res <= 0) {
-            if (SSL_get_error(state->ssl, res) != SSL_ERROR_WANT_READ) {
-                enif_mutex_unlock(state->mtx);
-                int reason = ERR_GET_REASON(ERR_peek_error());
-                if (reason == SSL_R_DATA_LENGTH_TOO_LONG ||
-                    reason == SSL_R_PACKET_LENGTH_TOO_LONG ||
-                    reason == SSL_R_UNKNOWN_PROTOCOL ||
-                    reason == SSL_R_UNEXPECTED_MESSAGE ||
-                    reason == SSL_R_WRONG_VERSION_NUMBER)
-                    /* Do not report badly formed Client Hello */
-                    return ERR_T(enif_make_atom(env, "closed"));
-                else if (state->sni_error)
-                    return ssl_error(env, state->sni_error);
-                else
-                    return ssl_error(env, "SSL_do_handshake failed");
-            }
-        }
+    if (!dirty && state->stale_select) {
+        state->stale_select = 0;
+        enif_mutex_unlock(state->mtx);
+        return enif_make_atom(env, "flush");
     }
-    if (SSL_is_init_finished(state->ssl)) {
-        int i;
-        for (i = 0; i < 2; i++)
-            if (state->send_buffer != NULL) {
-                res = SSL_write(state->ssl, state->send_buffer, state->send_buffer_len);
-                if (res <= 0) {
-                    char *error = "SSL_write failed";
-                    enif_mutex_unlock(state->mtx);
-                    return ERR_T(enif_make_string(env, error, ERL_NIF_LATIN1));
-                }
-                retcode = 2;
-                enif_free(state->send_buffer);
-                state->send_buffer = state->send_buffer2;
-                state->send_buffer_len = state->send_buffer2_len;
-                state->send_buffer_size = state->send_buffer2_size;
-                state->send_buffer2 = NULL;
-                state->send_buffer2_len = 0;
-                state->send_buffer2_size = 0;
-            }
-        size = BUF_SIZE;
-        rlen = 0;
-        enif_alloc_binary(size, &output);
-        res = 0;
-        while ((req_size == 0 || rlen < req_size) &&
-               (res = SSL_read(state->ssl,
-                               output.data + rlen,
-                               (req_size == 0 || req_size >= size) ?
-                               size - rlen : req_size - rlen)) > 0) {
-            //printf("%d bytes of decrypted data read from state machine\r\n",res);
-            rlen += res;
-            if (size - rlen < BUF_SIZE) {
-                size *= 2;
-                enif_realloc_binary(&output, size);
-            }
-        }
 
-        if (state->handshakes > 1 && SSL_is_server(state->ssl) &&
-            !SSL_get_secure_renegotiation_support(state->ssl)) {
-            enif_release_binary(&output);
-            char *error = "client renegotiations forbidden";
+    if (!dirty) {
+        if (socket_flush(state) < 0) {
+            err = errno;
             enif_mutex_unlock(state->mtx);
-            return ERR_T(enif_make_string(env, error, ERL_NIF_LATIN1));
+            return socket_error(env, err);
         }
-
-        if (res < 0) {
-            int error = SSL_get_error(state->ssl, res);
-
-            if (error == SSL_ERROR_WANT_READ) {
-                //printf("SSL_read wants more data\r\n");
-                //return 0;
-            }
-            // TODO
+        nread = socket_read(state);
+        if (nread < 0)
+            err = errno;
+#ifdef HAS_DIRTY_SCHEDULERS
+        if (needs_dirty_scheduler(state)) {
+            enif_mutex_unlock(state->mtx);
+            return enif_schedule_nif(env, "socket_recv_nif",
+                                     ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                     socket_recv_dirty_nif, argc, argv);
         }
-        enif_realloc_binary(&output, rlen);
-    } else {
-        retcode = 2;
-        enif_alloc_binary(0, &output);
+#endif
     }
-    enif_mutex_unlock(state->mtx);
-    return retcode == 0 ? OK_T(enif_make_binary(env, &output))
-                        : SEND_T(enif_make_binary(env, &output));
-}
 
-static ERL_NIF_TERM add_certfile_nif(ErlNifEnv *env, int argc,
-                                     const ERL_NIF_TERM argv[]) {
-    ErlNifBinary domain, file;
-    cert_info_t *info = NULL;
-    cert_info_t *old_info = NULL;
+    ERR_clear_error();
 
-    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
-        return enif_make_badarg(env);
-    if (!enif_inspect_iolist_as_binary(env, argv[1], &file))
-        return enif_make_badarg(env);
+    if (decrypt_input(env, state, req_size, &plain) == DECRYPT_ERROR) {
+        /* Send the alert, if any */
+        socket_flush(state);
+        enif_mutex_unlock(state->mtx);
+        return plain;
+    }
 
-    info = enif_alloc(sizeof(cert_info_t));
-    if (info) {
-        memset(info, 0, sizeof(cert_info_t));
-        info->key = enif_alloc(domain.size + 1);
-        info->file = enif_alloc(file.size + 1);
-        if (info->key && info->file) {
-            memcpy(info->key, domain.data, domain.size);
-            memcpy(info->file, file.data, file.size);
-            info->key[domain.size] = 0;
-            info->file[file.size] = 0;
-            enif_rwlock_rwlock(certfiles_map_lock);
-            HASH_REPLACE_STR(certfiles_map, key, info, old_info);
-            free_cert_info(old_info);
-            enif_rwlock_rwunlock(certfiles_map_lock);
-        } else {
-            free_cert_info(info);
-        }
+    flushed = socket_flush(state);
+    if (flushed < 0) {
+        err = errno;
+        enif_mutex_unlock(state->mtx);
+        return socket_error(env, err);
     }
 
-    return enif_make_atom(env, "ok");
+    enif_inspect_binary(env, plain, &data);
+    if (data.size > 0 || nread == 0) {
+        if (flushed == 0)
+            enif_select(env, state->fd, ERL_NIF_SELECT_WRITE, state, NULL,
+                        argv[2]);
+        enif_mutex_unlock(state->mtx);
+        if (data.size > 0)
+            return OK_T(plain);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+    if (nread < 0 && err != EAGAIN && err != EWOULDBLOCK) {
+        enif_mutex_unlock(state->mtx);
+        return socket_error(env, err);
+    }
+
+    enif_select(env, state->fd,
+                ERL_NIF_SELECT_READ | (flushed ? 0 : ERL_NIF_SELECT_WRITE),
+                state, NULL, argv[2]);
+    enif_mutex_unlock(state->mtx);
+    return enif_make_atom(env, "wait");
 }
 
-static ERL_NIF_TERM delete_certfile_nif(ErlNifEnv *env, int argc,
-                                        const ERL_NIF_TERM argv[]) {
-    ErlNifBinary domain;
-    char *ret = "false";
-    cert_info_t *info = NULL;
+static ERL_NIF_TERM socket_recv_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    return socket_recv(env, argc, argv, 0);
+}
 
-    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
+#ifdef HAS_DIRTY_SCHEDULERS
+static ERL_NIF_TERM socket_recv_dirty_nif(ErlNifEnv *env, int argc,
+                                          const ERL_NIF_TERM argv[]) {
+    return socket_recv(env, argc, argv, 1);
+}
+#endif
+
+/*
+ * socket_send_nif(State, Data, Ref) encrypts the data and writes it to
+ * the socket. Returns wait if the socket is full, the caller must then
+ * call socket_flush_nif() on each ready_output message until it
+ * returns ok.
+ */
+static ERL_NIF_TERM socket_send_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    state_t *state = NULL;
+    ERL_NIF_TERM result;
+
+    if (argc != 3)
         return enif_make_badarg(env);
 
-    char key[domain.size + 1];
-    memcpy(key, domain.data, domain.size);
-    key[domain.size] = 0;
-    enif_rwlock_rwlock(certfiles_map_lock);
-    HASH_FIND_STR(certfiles_map, key, info);
-    if (info) {
-        HASH_DEL(certfiles_map, info);
-        free_cert_info(info);
-        ret = "true";
-    }
-    enif_rwlock_rwunlock(certfiles_map_lock);
+    if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
+        return enif_make_badarg(env);
 
-    return enif_make_atom(env, ret);
-}
+    if (!state->mtx || !state->ssl) return enif_make_badarg(env);
+    enif_mutex_lock(state->mtx);
 
-static ERL_NIF_TERM get_certfile_nif(ErlNifEnv *env, int argc,
-                                     const ERL_NIF_TERM argv[]) {
-    ErlNifBinary domain;
-    cert_info_t *info = NULL;
-    ERL_NIF_TERM file, result;
+    if (!state->valid || state->fd < 0) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
 
-    if (!enif_inspect_iolist_as_binary(env, argv[0], &domain))
-        return enif_make_badarg(env);
+    ERR_clear_error();
 
-    char key[domain.size + 1];
-    memcpy(key, domain.data, domain.size);
-    key[domain.size] = 0;
-    enif_rwlock_rlock(certfiles_map_lock);
-    info = lookup_certfile(key);
-    if (info) {
-        unsigned char *tmp = enif_make_new_binary(env, strlen(info->file), &file);
-        if (tmp) {
-            memcpy(tmp, info->file, strlen(info->file));
-            result = enif_make_tuple2(env, enif_make_atom(env, "ok"), file);
-        } else
-            result = enif_make_atom(env, "error");
-    } else {
-        result = enif_make_atom(env, "error");
+    switch (write_decrypted_output(env, state, argv[1])) {
+        case WRITE_ERROR:
+            result = ssl_error(env, "SSL_write failed");
+            break;
+        case WRITE_BUSY:
+            result = busy_error(env, state);
+            break;
+        case WRITE_BADARG:
+            result = enif_make_badarg(env);
+            break;
+        default:
+            result = socket_flush_or_wait(env, state, argv[2]);
     }
-    enif_rwlock_runlock(certfiles_map_lock);
 
+    enif_mutex_unlock(state->mtx);
     return result;
 }
 
-static ERL_NIF_TERM clear_cache_nif(ErlNifEnv *env, int argc,
-                                    const ERL_NIF_TERM argv[]) {
-    clear_certs_map();
-    return enif_make_atom(env, "ok");
-}
-
-static ERL_NIF_TERM invalidate_nif(ErlNifEnv *env, int argc,
-                                   const ERL_NIF_TERM argv[]) {
+static ERL_NIF_TERM socket_flush_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
+    ERL_NIF_TERM result;
 
-    if (argc != 1)
+    if (argc != 2)
         return enif_make_badarg(env);
 
     if (!enif_get_resource(env, argv[0], tls_state_t, (void *) &state))
         return enif_make_badarg(env);
 
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
-
     enif_mutex_lock(state->mtx);
-    state->valid = 0;
-    enif_mutex_unlock(state->mtx);
 
-    return enif_make_atom(env, "ok");
+    if (!state->valid || state->fd < 0) {
+        enif_mutex_unlock(state->mtx);
+        return ERR_T(enif_make_atom(env, "closed"));
+    }
+
+    result = socket_flush_or_wait(env, state, argv[1]);
+    enif_mutex_unlock(state->mtx);
+    return result;
 }
 
-static ERL_NIF_TERM get_negotiated_cipher_nif(ErlNifEnv *env, int argc,
-                                              const ERL_NIF_TERM argv[]) {
+/*
+ * Cancels the selects of a recv that timed out, so that no select
+ * message arrives afterwards. Output left unflushed is sent by the
+ * next call. Cancelling needs NIF 2.15, before that the message that
+ * may still come is dropped by the next socket_recv_nif() call.
+ */
+static ERL_NIF_TERM socket_cancel_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
     state_t *state = NULL;
 
     if (argc != 1)
@@ -1205,33 +6328,58 @@ static ERL_NIF_TERM get_negotiated_cipher_nif(ErlNifEnv *env, int argc,
         return enif_make_badarg(env);
 
     if (!state->mtx || !state->ssl) return enif_make_badarg(env);
-
     enif_mutex_lock(state->mtx);
-
-    if (!state->valid) {
-        enif_mutex_unlock(state->mtx);
-        return ERR_T(enif_make_atom(env, "closed"));
+    if (state->valid && state->fd >= 0) {
+#ifdef ERL_NIF_SELECT_READ_CANCELLED
+        /* The pid and ref are ignored when cancelling */
+        enif_select(env, state->fd,
+                    ERL_NIF_SELECT_CANCEL | ERL_NIF_SELECT_READ |
+                    ERL_NIF_SELECT_WRITE, state, NULL, argv[0]);
+#else
+        state->stale_select = 1;
+#endif
     }
-
-    const char *version = SSL_get_version(state->ssl);
-    const char *cipher = SSL_get_cipher_name(state->ssl);
     enif_mutex_unlock(state->mtx);
+    return enif_make_atom(env, "ok");
+}
+#else
+static ERL_NIF_TERM socket_attach_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+    return ERR_T(enif_make_atom(env, "enotsup"));
+}
 
-    ErlNifBinary bin;
-    size_t vl = strlen(version);
-    size_t cl = strlen(cipher);
-    if (!enif_alloc_binary(vl + cl + 1, &bin)) {
-        return ERR_T(enif_make_atom(env, "enomem"));
-    }
-    memcpy(bin.data, version, vl);
-    bin.data[vl] = ' ';
-    memcpy(bin.data + vl + 1, cipher, cl);
-    return enif_make_binary(env, &bin);
+static ERL_NIF_TERM socket_owner_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM socket_recv_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM socket_send_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+    return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM socket_flush_nif(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+    return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM socket_cancel_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+    return enif_make_badarg(env);
 }
+#endif
 
 static ErlNifFunc nif_funcs[] =
         {
                 {"open_nif",                  8, open_nif},
+                {"new_profile_nif",           8, new_profile_nif},
+                {"open_profile_nif",          1, open_profile_nif},
+                {"profile_generation_nif",    1, profile_generation_nif},
                 {"set_encrypted_input_nif",   2, set_encrypted_input_nif},
                 {"set_decrypted_output_nif",  2, set_decrypted_output_nif},
                 {"get_decrypted_input_nif",   2, get_decrypted_input_nif},
@@ -1241,9 +6389,35 @@ static ErlNifFunc nif_funcs[] =
                 {"add_certfile_nif",          2, add_certfile_nif},
                 {"delete_certfile_nif",       1, delete_certfile_nif},
                 {"get_certfile_nif",          1, get_certfile_nif},
+                {"load_certificate_nif",      2, load_certificate_nif},
+                {"delete_certificate_nif",    1, delete_certificate_nif},
+                {"reload_certfiles_nif",      0, reload_certfiles_nif},
                 {"clear_cache_nif",           0, clear_cache_nif},
+                {"invalidate_cache_nif",      1, invalidate_cache_nif},
+                {"prewarm_nif",               2, prewarm_nif},
+                {"prewarm_all_nif",           1, prewarm_all_nif},
+                {"set_session_cache_nif",     2, set_session_cache_nif},
+                {"set_ticket_keys_nif",       1, set_ticket_keys_nif},
+                {"set_client_session_cache_nif", 2,
+                 set_client_session_cache_nif},
                 {"invalidate_nif",            1, invalidate_nif},
-                {"get_negotiated_cipher_nif", 1, get_negotiated_cipher_nif}
+                {"get_negotiated_cipher_nif", 1, get_negotiated_cipher_nif},
+                {"session_reused_nif",        1, session_reused_nif},
+                {"get_early_data_status_nif", 1, get_early_data_status_nif},
+                {"handshake_async_nif",       2, handshake_async_nif},
+                {"process_input_nif",         3, process_input_nif},
+                {"encrypt_nif",               2, encrypt_nif},
+                {"set_send_queue_limits_nif", 3, set_send_queue_limits_nif},
+                {"ktls_enable_nif",           2, ktls_enable_nif},
+                {"ktls_start_nif",            1, ktls_start_nif},
+                {"socket_attach_nif",         2, socket_attach_nif},
+                {"socket_owner_nif",          2, socket_owner_nif},
+                {"socket_recv_nif",           3, socket_recv_nif},
+                {"socket_send_nif",           3, socket_send_nif},
+                {"socket_flush_nif",          2, socket_flush_nif},
+                {"socket_cancel_nif",         1, socket_cancel_nif},
+                {"set_receiver_nif",          2, set_receiver_nif},
+                {"get_receiver_nif",          1, get_receiver_nif}
         };
 
 ERL_NIF_INIT(fast_tls, nif_funcs, load, NULL, NULL, unload)
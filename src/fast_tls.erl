@@ -29,19 +29,36 @@
 
 -behaviour(gen_server).
 
--export([open_nif/8, get_decrypted_input_nif/2,
+-export([open_nif/8, new_profile_nif/8, open_profile_nif/1,
+	 profile_generation_nif/1,
+	 load_certificate_nif/2, delete_certificate_nif/1,
+	 reload_certfiles_nif/0, invalidate_cache_nif/1, prewarm_nif/2,
+	 prewarm_all_nif/1,
+	 get_decrypted_input_nif/2,
 	 set_encrypted_input_nif/2, get_encrypted_output_nif/1,
 	 set_decrypted_output_nif/2, get_peer_certificate_nif/1,
-	 get_verify_result_nif/1, invalidate_nif/1, get_negotiated_cipher_nif/1]).
-
--export([start_link/0, tcp_to_tls/2,
+	 get_verify_result_nif/1, invalidate_nif/1, get_negotiated_cipher_nif/1,
+	 session_reused_nif/1, get_early_data_status_nif/1,
+	 handshake_async_nif/2, process_input_nif/3, encrypt_nif/2,
+	 set_send_queue_limits_nif/3, ktls_enable_nif/2, ktls_start_nif/1,
+	 socket_attach_nif/2, socket_owner_nif/2, socket_recv_nif/3, socket_send_nif/3,
+	 socket_flush_nif/2, socket_cancel_nif/1,
+	 set_receiver_nif/2, get_receiver_nif/1]).
+
+-export([start_link/0, tcp_connect/4, tcp_to_tls/2, new_profile/1,
 	 tls_to_tcp/1, send/2, recv/2, recv/3, recv_data/2,
+	 handshake_async/2, set_send_queue_limits/3,
 	 setopts/2, sockname/1, peername/1,
 	 controlling_process/2, close/1,
 	 get_peer_certificate/1, get_peer_certificate/2,
 	 get_verify_result/1, get_cert_verify_string/2,
 	 add_certfile/2, get_certfile/1, delete_certfile/1,
-	 clear_cache/0, get_negotiated_cipher/1]).
+	 load_certificate/1, delete_certificate/1, reload_certfiles/0,
+	 clear_cache/0, invalidate/1, prewarm/1, prewarm/2,
+	 prewarm_all/1, prewarm_all/2,
+	 set_session_cache/2, set_ticket_keys/1,
+	 set_client_session_cache/2,
+	 get_negotiated_cipher/1, session_reused/1, get_early_data_status/1]).
 
 %% Internal exports, call-back functions.
 -export([init/1, handle_call/3, handle_cast/2,
@@ -72,16 +89,52 @@
 
 -define(COMPRESSION_NONE, 16#100000).
 
+-define(ASYNC, 16#200000).
+
+-define(TICKETS, 16#400000).
+
+-define(EARLY_DATA, 16#800000).
+
 -define(PRINT(Format, Args), io:format(Format, Args)).
 
+%% Files are only checked periodically when certfile_check_interval is set
+-define(CERTFILE_CHECK_INTERVAL, infinity).
+
+%% How long kernel TLS waits for gen_tcp to flush before taking over
+-define(KTLS_SEND_QUEUE_TIMEOUT, 5000).
+
+%% How long the active mode receiver waits for a paused private key
+%% operation. The engine wait itself is bounded by the NIF.
+-define(ASYNC_TIMEOUT, 10000).
+
+%% How long prewarm_all/2 waits for progress before giving up
+-define(PREWARM_TIMEOUT, 60000).
+
 -record(tlssock, {tcpsock :: inet:socket(),
-                  tlsport :: port()}).
+                  tlsport :: port(),
+                  %% Select reference when the NIF owns the socket
+                  nifsock = false :: false | reference()}).
+
+%% Active mode state, see setopts/2
+-record(receiver, {tlssock :: #tlssock{},
+                   owner :: pid(),
+                   mref :: reference(),
+                   active = false :: boolean() | once | integer()}).
+
+-define(RECEIVER_BATCH, 16).
+
+%% Options of tcp_to_tls/2 parsed once, see new_profile/1
+-record(tls_profile, {ref :: reference(),
+                      nif_socket = false :: boolean(),
+                      ktls = false :: boolean()}).
 
 -type tls_socket() :: #tlssock{}.
 
+-opaque tls_profile() :: #tls_profile{}.
+
 -type cert() :: any(). %% TODO
 
--export_type([tls_socket/0]).
+-export_type([tls_socket/0, tls_profile/0]).
 
 start_link() ->
     gen_server:start_link({local, ?MODULE}, ?MODULE, [],
@@ -90,6 +143,7 @@ start_link() ->
 init([]) ->
     case load_nif() of
         ok ->
+            schedule_reload(),
             {ok, []};
         {error, Why} ->
             {stop, Why}
@@ -98,6 +152,15 @@ init([]) ->
 open_nif(_Flags, _CertFile, _Ciphers, _ProtocolOpts, _DHFile, _CAFile, _SNI, _ALPN) ->
     erlang:nif_error({nif_not_loaded, ?MODULE}).
 
+new_profile_nif(_Flags, _CertFile, _Ciphers, _ProtocolOpts, _DHFile, _CAFile, _SNI, _ALPN) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+open_profile_nif(_Profile) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+profile_generation_nif(_Profile) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
 get_decrypted_input_nif(_Port, _Length) ->
     erlang:nif_error({nif_not_loaded, ?MODULE}).
 
@@ -125,15 +188,90 @@ get_certfile_nif(_Domain) ->
 delete_certfile_nif(_Domain) ->
     erlang:nif_error({nif_not_loaded, ?MODULE}).
 
+load_certificate_nif(_Certs, _Key) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+delete_certificate_nif(_Name) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+reload_certfiles_nif() ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
 invalidate_nif(_Port) ->
     erlang:nif_error({nif_not_loaded, ?MODULE}).
 
 clear_cache_nif() ->
     erlang:nif_error({nif_not_loaded, ?MODULE}).
 
+invalidate_cache_nif(_Name) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+prewarm_nif(_Profile, _Domain) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+prewarm_all_nif(_Profile) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+set_session_cache_nif(_Size, _Timeout) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+set_ticket_keys_nif(_Keys) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+set_client_session_cache_nif(_Size, _Timeout) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
 get_negotiated_cipher_nif(_Port) ->
 	erlang:nif_error({nif_not_loaded, ?MODULE}).
 
+session_reused_nif(_Port) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+get_early_data_status_nif(_Port) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+handshake_async_nif(_Port, _Packet) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+process_input_nif(_Port, _Packet, _Length) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+encrypt_nif(_Port, _Packet) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+set_send_queue_limits_nif(_Port, _High, _Low) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+ktls_enable_nif(_Port, _Fd) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+ktls_start_nif(_Port) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_attach_nif(_Port, _Fd) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_owner_nif(_Port, _Pid) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_recv_nif(_Port, _Length, _Ref) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_send_nif(_Port, _Packet, _Ref) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_flush_nif(_Port, _Ref) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+socket_cancel_nif(_Port) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+set_receiver_nif(_Port, _Pid) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
+get_receiver_nif(_Port) ->
+    erlang:nif_error({nif_not_loaded, ?MODULE}).
+
 %%% --------------------------------------------------------
 %%% The call-back functions.
 %%% --------------------------------------------------------
@@ -146,6 +284,10 @@ handle_info({'EXIT', Port, Reason}, Port) ->
     {stop, {port_died, Reason}, Port};
 handle_info({'EXIT', _Pid, _Reason}, Port) ->
     {noreply, Port};
+handle_info(reload_certfiles, State) ->
+    reload_certfiles_nif(),
+    schedule_reload(),
+    {noreply, State};
 handle_info(_, State) -> {noreply, State}.
 
 code_change(_OldVsn, State, _Extra) -> {ok, State}.
@@ -153,11 +295,107 @@ code_change(_OldVsn, State, _Extra) -> {ok, State}.
 terminate(_Reason, _State) ->
     ok.
 
--spec tcp_to_tls(inet:socket(),
-                 [{atom(), any()}]) -> {'error','no_certfile' | binary()} |
-                                       {ok, tls_socket()}.
+%% Besides the inotify watcher on Linux, files are checked periodically
+%% for the changes it can't see, e.g. on other systems or network mounts
+schedule_reload() ->
+    case application:get_env(fast_tls, certfile_check_interval,
+			     ?CERTFILE_CHECK_INTERVAL) of
+	infinity -> ok;
+	Interval -> erlang:send_after(Interval, self(), reload_certfiles)
+    end.
+
+%% @doc Like gen_tcp:connect/4, with TCP Fast Open where the OS supports
+%% it. The first send then goes out with the SYN, so with a resumed
+%% session and the `early_data' option, the ClientHello and the data
+%% passed to send/2 before the handshake reach the server in the first
+%% round trip. Falls back to a plain connect.
+-spec tcp_connect(inet:socket_address() | inet:hostname(), inet:port_number(),
+                  [gen_tcp:connect_option()], timeout()) ->
+                         {ok, inet:socket()} | {error, inet:posix()}.
+
+tcp_connect(Address, Port, Opts, Timeout) ->
+    case os:type() of
+	{unix, linux} ->
+	    %% setsockopt(IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1)
+	    FastOpen = {raw, 6, 30, <<1:32/native>>},
+	    case gen_tcp:connect(Address, Port, [FastOpen | Opts], Timeout) of
+		{error, Reason} when Reason == einval;
+				     Reason == enoprotoopt ->
+		    gen_tcp:connect(Address, Port, Opts, Timeout);
+		Res ->
+		    Res
+	    end;
+	_ ->
+	    gen_tcp:connect(Address, Port, Opts, Timeout)
+    end.
 
+-spec tcp_to_tls(inet:socket(),
+                 [{atom(), any()}] | tls_profile()) ->
+                        {'error','no_certfile' | binary()} |
+                        {ok, tls_socket()}.
+
+tcp_to_tls(TCPSocket, #tls_profile{ref = Profile, nif_socket = NIFSocket,
+				   ktls = KTLS}) ->
+    case open_profile_nif(Profile) of
+	{ok, Port} ->
+	    setup_socket(TCPSocket, Port, NIFSocket, KTLS);
+	Err = {error, _} ->
+	    Err
+    end;
 tcp_to_tls(TCPSocket, Options) ->
+    case open_args(Options) of
+	{ok, Args} ->
+	    case erlang:apply(fun open_nif/8, Args) of
+		{ok, Port} ->
+		    setup_socket(TCPSocket, Port,
+				 lists:member(nif_socket, Options),
+				 lists:member(ktls, Options));
+		Err = {error, _} ->
+		    Err
+	    end;
+	Err ->
+	    Err
+    end.
+
+%% Parses the options of tcp_to_tls/2 once, so that sockets opened with
+%% the returned profile skip the option parsing, the file name copies
+%% and the SSL context lookup. Certificate errors are reported here.
+%% The profile follows clear_cache/0 and certificate changes like
+%% tcp_to_tls/2 with the options would.
+-spec new_profile([{atom(), any()} | atom()]) ->
+                         {ok, tls_profile()} |
+                         {'error','no_certfile' | binary()}.
+
+new_profile(Options) ->
+    case open_args(Options) of
+	{ok, Args} ->
+	    case erlang:apply(fun new_profile_nif/8, Args) of
+		{ok, Ref} ->
+		    {ok, #tls_profile{
+			    ref = Ref,
+			    nif_socket = lists:member(nif_socket, Options),
+			    ktls = lists:member(ktls, Options)}};
+		Err = {error, _} ->
+		    Err
+	    end;
+	Err ->
+	    Err
+    end.
+
+setup_socket(TCPSocket, Port, NIFSocket, KTLS) ->
+    NIFSock = case NIFSocket of
+		  true -> attach_socket(TCPSocket, Port);
+		  false -> false
+	      end,
+    case KTLS of
+	true when NIFSock == false ->
+	    enable_ktls(TCPSocket, Port);
+	_ -> ok
+    end,
+    {ok, #tlssock{tcpsock = TCPSocket, tlsport = Port,
+		  nifsock = NIFSock}}.
+
+open_args(Options) ->
     Command = case lists:member(connect, Options) of
 		  true -> ?SET_CERTIFICATE_FILE_CONNECT;
 		  false -> ?SET_CERTIFICATE_FILE_ACCEPT
@@ -172,7 +410,19 @@ tcp_to_tls(TCPSocket, Options) ->
 			 true -> ?COMPRESSION_NONE;
 			 false -> 0
 		     end,
-	    Flags = Flags1 bor Flags2,
+	    Flags3 = case lists:member(async, Options) of
+			 true -> ?ASYNC;
+			 false -> 0
+		     end,
+	    Flags4 = case lists:member(tickets, Options) of
+			 true -> ?TICKETS;
+			 false -> 0
+		     end,
+	    Flags5 = case lists:member(early_data, Options) of
+			 true -> ?EARLY_DATA;
+			 false -> 0
+		     end,
+	    Flags = Flags1 bor Flags2 bor Flags3 bor Flags4 bor Flags5,
 	    Ciphers =
 	    case lists:keysearch(ciphers, 1, Options) of
 		{value, {ciphers, C}} ->
@@ -210,20 +460,88 @@ tcp_to_tls(TCPSocket, Options) ->
 		       false ->
 			   <<>>
 		   end,
-	    case open_nif(Command bor Flags, CertFile, Ciphers, ProtocolOpts,
-			  DHFile, CAFile, ServerName, ALPN) of
-		{ok, Port} ->
-		    {ok, #tlssock{tcpsock = TCPSocket, tlsport = Port}};
-		Err = {error, _} ->
+	    {ok, [Command bor Flags, CertFile, Ciphers, ProtocolOpts,
+		  DHFile, CAFile, ServerName, ALPN]};
+	true -> {error, no_certfile}
+    end.
+
+%% With nif_socket the NIF reads and writes the socket itself and only
+%% decrypted data is passed to Erlang. The gen_tcp socket must be passive
+%% and must not be used for I/O afterwards. Falls back to gen_tcp I/O if
+%% the NIF cannot take the socket over. The NIF closes its descriptor
+%% when the controlling process of the TCP socket exits.
+attach_socket(TCPSocket, Port) ->
+    case catch inet:getfd(TCPSocket) of
+	{ok, Fd} ->
+	    case socket_attach_nif(Port, Fd) of
+		ok ->
+		    case erlang:port_info(TCPSocket, connected) of
+			{connected, Owner} when Owner /= self() ->
+			    socket_owner_nif(Port, Owner);
+			_ ->
+			    ok
+		    end,
+		    make_ref();
+		{error, _} -> false
+	    end;
+	_ ->
+	    false
+    end.
+
+%% Kernel TLS is best effort: if the kernel or OpenSSL cannot do it,
+%% or TLS 1.3 is not negotiated, records are encrypted by OpenSSL as usual.
+%% Once the kernel encrypts, alerts and KeyUpdate replies are written to
+%% the socket as control messages. A key update fails the connection
+%% if OpenSSL or the kernel (before Linux 6.14) can't switch the keys.
+enable_ktls(TCPSocket, Port) ->
+    case catch inet:getfd(TCPSocket) of
+	{ok, Fd} ->
+	    ktls_enable_nif(Port, Fd);
+	_ ->
+	    {error, enotsup}
+    end.
+
+%% Called once OpenSSL has handed over the transmit keys and the output
+%% encrypted with the previous keys has been passed to gen_tcp.
+%% If the keys can't be installed the connection is unusable: the
+%% plaintext written meanwhile can't be sent anymore.
+start_ktls(#tlssock{tcpsock = TCPSocket, tlsport = Port}) ->
+    case wait_send_queue(TCPSocket, 1, ?KTLS_SEND_QUEUE_TIMEOUT) of
+	ok ->
+	    case ktls_start_nif(Port) of
+		{ok, <<>>} -> ok;
+		{ok, Out} -> gen_tcp:send(TCPSocket, Out);
+		{error, _} = Err ->
+		    invalidate_nif(Port),
 		    Err
 	    end;
-	true -> {error, no_certfile}
+	Err ->
+	    invalidate_nif(Port),
+	    Err
+    end.
+
+%% The kernel encrypts everything sent after the keys are installed,
+%% so data still queued in the inet driver must reach the socket first.
+%% There is no notification for it, the queue is polled with a backoff.
+wait_send_queue(TCPSocket, Delay, Left) ->
+    case erlang:port_info(TCPSocket, queue_size) of
+	{queue_size, N} when N > 0, Left =< 0 ->
+	    {error, timeout};
+	{queue_size, N} when N > 0 ->
+	    receive after Delay -> ok end,
+	    wait_send_queue(TCPSocket, min(Delay * 2, 64), Left - Delay);
+	_ ->
+	    ok
     end.
 
 -spec tls_to_tcp(tls_socket()) -> inet:socket().
 
 tls_to_tcp(#tlssock{tcpsock = TCPSocket,
 		    tlsport = Port}) ->
+    case catch get_receiver_nif(Port) of
+	{ok, Pid} -> call_receiver(Pid, {detach, self()});
+	_ -> ok
+    end,
     invalidate_nif(Port),
     TCPSocket.
 
@@ -234,89 +552,234 @@ recv(Socket, Length) -> recv(Socket, Length, infinity).
                          {error, binary()} |
                          {ok, binary()}.
 
+recv(#tlssock{nifsock = Ref} = TLSSock, Length, Timeout)
+  when is_reference(Ref) ->
+    try socket_recv(TLSSock, Length, Timeout) of
+	{via, Pid} -> call_receiver(Pid, {recv, Length, Timeout});
+	Res -> Res
+    catch error:badarg -> {error, einval}
+    end;
 recv(#tlssock{tcpsock = TCPSocket} =
 	 TLSSock,
      Length, Timeout) ->
-    case recv_data(TLSSock, <<>>, Length) of
+    Deadline = deadline(Timeout),
+    case recv_data(TLSSock, <<>>, Length, Deadline) of
         {ok, <<>>} ->
-            case gen_tcp:recv(TCPSocket, 0, Timeout) of
-                {ok, Packet} -> recv_data(TLSSock, Packet, Length);
+            case gen_tcp:recv(TCPSocket, 0, time_left(Deadline)) of
+                {ok, Packet} -> recv_data(TLSSock, Packet, Length, Deadline);
                 {error, _Reason} = Error -> Error
             end;
+        {via, Pid} -> call_receiver(Pid, {recv, Length, Timeout});
         Res -> Res
     end.
 
+socket_recv(TLSSock, Length, Timeout) ->
+    socket_recv1(TLSSock, Length, deadline(Timeout)).
+
+%% The timeout covers the whole call, however many wakeups it takes
+socket_recv1(#tlssock{tlsport = Port, nifsock = Ref} = TLSSock,
+	     Length, Deadline) ->
+    case socket_recv_nif(Port, Length, Ref) of
+	wait ->
+	    receive
+		{select, _, Ref, _} ->
+		    socket_recv1(TLSSock, Length, Deadline)
+	    after time_left(Deadline) ->
+		    socket_cancel_nif(Port),
+		    flush_selects(Ref),
+		    {error, timeout}
+	    end;
+	flush ->
+	    %% A select from an earlier timeout could not be cancelled
+	    flush_selects(Ref),
+	    socket_recv1(TLSSock, Length, Deadline);
+	{pending, AsyncRef} ->
+	    receive
+		{tls_async, AsyncRef} ->
+		    socket_recv1(TLSSock, Length, Deadline)
+	    after time_left(Deadline) ->
+		    {error, timeout}
+	    end;
+	Res ->
+	    Res
+    end.
+
+flush_selects(Ref) ->
+    receive
+	{select, _, Ref, _} -> flush_selects(Ref)
+    after 0 ->
+	ok
+    end.
+
+deadline(infinity) ->
+    infinity;
+deadline(Timeout) ->
+    erlang:monotonic_time(millisecond) + Timeout.
+
+time_left(infinity) ->
+    infinity;
+time_left(Deadline) ->
+    max(0, Deadline - erlang:monotonic_time(millisecond)).
+
 -spec recv_data(tls_socket(), binary()) -> {error, inet:posix() | binary()} |
                                            {ok, binary()}.
 
 recv_data(TLSSock, Packet) ->
-    recv_data(TLSSock, Packet, 0).
+    case recv_data(TLSSock, Packet, 0) of
+	{via, _} -> {error, einval};
+	Res -> Res
+    end.
 
--spec recv_data(tls_socket(), binary(),
+-spec recv_data(tls_socket(), iodata(),
                 non_neg_integer()) -> {error, inet:posix() | binary()} |
-                                      {ok, binary()}.
+                                      {ok, binary()} | {via, pid()}.
 
 recv_data(TLSSock, Packet, Length) ->
-    case catch recv_data1(TLSSock, Packet, Length) of
-      {'EXIT', Reason} -> {error, Reason};
-      Res -> Res
+    recv_data(TLSSock, Packet, Length, infinity).
+
+recv_data(TLSSock, Packet, Length, Deadline) ->
+    try recv_data1(TLSSock, Packet, Length, Deadline)
+    catch error:badarg -> {error, einval};
+	  _:Reason -> {error, Reason}
     end.
 
 recv_data1(#tlssock{tcpsock = TCPSocket,
-		    tlsport = Port},
-	   Packet, Length) ->
-    case catch set_encrypted_input_nif(Port, Packet) of
-	{'EXIT', {badarg, _}} ->
-	    {error, einval};
-	ok ->
-	    case catch get_decrypted_input_nif(Port, Length) of
-		{'EXIT', {badarg, _}} ->
-		    {error, einval};
-		{ok, In} -> {ok, In};
-		{send, In} ->
-		    case catch get_encrypted_output_nif(Port) of
-			{'EXIT', {badarg, _}} ->
-			    {error, einval};
-			{ok, Out} ->
-			    case gen_tcp:send(TCPSocket, Out) of
-				ok -> {ok, In};
-				Error -> Error
-			    end;
-			{error, _} = Err ->
-			    Err
+		    tlsport = Port} = TLSSock,
+	   Packet, Length, Deadline) ->
+    case process_input_nif(Port, Packet, Length) of
+	{ok, In, <<>>} -> {ok, In};
+	{ok, In, Out} ->
+	    case gen_tcp:send(TCPSocket, Out) of
+		ok -> {ok, In};
+		Error -> Error
+	    end;
+	{ktls, In, Out} ->
+	    case gen_tcp:send(TCPSocket, Out) of
+		ok ->
+		    case start_ktls(TLSSock) of
+			ok -> {ok, In};
+			Error -> Error
 		    end;
-		{error, _} = Err ->
-		    Err
+		Error -> Error
 	    end;
+	{pending, Ref} ->
+	    %% OpenSSL has paused a private key operation,
+	    %% wait until it can be resumed
+	    receive
+		{tls_async, Ref} ->
+		    recv_data1(TLSSock, <<>>, Length, Deadline)
+	    after time_left(Deadline) ->
+		    {error, timeout}
+	    end;
+	{via, _} = Via ->
+	    Via;
 	{error, _} = Err ->
 	    Err
     end.
 
--spec send(tls_socket(), binary()) -> ok | {error, inet:posix() |
-                                            binary() | timeout}.
+%% @doc Feeds `Packet' to the TLS state and runs the handshake on a pool
+%% of native threads owned by fast_tls. The calling process receives
+%% `{tls_handshake, Ref, Result, OutBytes}' when the handshake step is
+%% done, where `Result' is `ok' once the handshake is complete,
+%% `want_read' if more data from the peer is needed, or `{error, Reason}'.
+%% `OutBytes' must be sent to the peer in all cases.
+-spec handshake_async(tls_socket(), binary()) -> {ok, reference()} |
+                                                 {error, closed | enomem |
+                                                  einval}.
+
+handshake_async(#tlssock{tlsport = Port}, Packet) ->
+    case catch handshake_async_nif(Port, Packet) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	Res ->
+	    Res
+    end.
 
-send(#tlssock{tcpsock = TCPSocket, tlsport = Port},
+-spec send(tls_socket(), binary()) -> ok | {busy, non_neg_integer()} |
+                                      {error, inet:posix() |
+                                       binary() | timeout}.
+
+send(#tlssock{tlsport = Port, nifsock = Ref}, Packet)
+  when is_reference(Ref) ->
+    case catch socket_send_nif(Port, Packet, Ref) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	wait ->
+	    socket_flush(Port, Ref);
+	Res ->
+	    Res
+    end;
+send(#tlssock{tcpsock = TCPSocket, tlsport = Port} = TLSSock,
      Packet) ->
-    case catch set_decrypted_output_nif(Port, Packet) of
+    case catch encrypt_nif(Port, Packet) of
 	{'EXIT', {badarg, _}} ->
 	    {error, einval};
-	ok ->
-	    case catch get_encrypted_output_nif(Port) of
-		{'EXIT', {badarg, _}} ->
-		    {error, einval};
-		{ok, Out} ->
-		    gen_tcp:send(TCPSocket, Out);
-		{error, _} = Err ->
-		    Err
+	{ok, Out} ->
+	    gen_tcp:send(TCPSocket, Out);
+	{queued, <<>>} ->
+	    ok;
+	{queued, Out} ->
+	    gen_tcp:send(TCPSocket, Out);
+	{busy, _} = Busy ->
+	    Busy;
+	{ktls, Out} ->
+	    case gen_tcp:send(TCPSocket, Out) of
+		ok -> start_ktls(TLSSock);
+		Error -> Error
 	    end;
+	{via, Pid} ->
+	    call_receiver(Pid, {send, Packet});
 	{error, _} = Err ->
 	    Err
     end.
 
--spec setopts(tls_socket(), list()) -> ok | {error, inet:posix()}.
+%% Like gen_tcp:send/2, blocks while the socket send buffer is full
+socket_flush(Port, Ref) ->
+    receive
+	{select, _, Ref, ready_output} ->
+	    case socket_flush_nif(Port, Ref) of
+		wait -> socket_flush(Port, Ref);
+		Res -> Res
+	    end
+    end.
+
+%% @doc Limits the plaintext buffered while OpenSSL cannot encrypt it,
+%% e.g. during a handshake. Once `High' bytes are queued `send/2' returns
+%% `{busy, QueuedBytes}' without accepting the data, until the queue
+%% drains to `Low' bytes. The process that got `busy' then receives
+%% `{tls_writable, TLSPort}', where `TLSPort' is the `tlsport' of the
+%% socket. A `High' of 0 (the default) disables the limit.
+-spec set_send_queue_limits(tls_socket(), non_neg_integer(),
+			    non_neg_integer()) -> ok | {error, closed |
+							einval}.
+
+set_send_queue_limits(#tlssock{tlsport = Port}, High, Low) ->
+    case catch set_send_queue_limits_nif(Port, High, Low) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	Res ->
+	    Res
+    end.
 
-setopts(#tlssock{tcpsock = TCPSocket}, Opts) ->
-    inet:setopts(TCPSocket, Opts).
+%% @doc Besides the inet options, accepts `{active, once | N | true | false}'.
+%% In active mode decrypted data is sent to the controlling process as
+%% `{tls, TLSSock, Data}', followed by `{tls_closed, TLSSock}' or
+%% `{tls_error, TLSSock, Reason}', and handshake output is sent to the
+%% peer without waiting for the next recv/3. With `{active, N}' the
+%% process gets `{tls_passive, TLSSock}' after N messages.
+-spec setopts(tls_socket(), list()) -> ok | {error, inet:posix() | einval |
+                                                  closed}.
+
+setopts(#tlssock{tcpsock = TCPSocket} = TLSSock, Opts) ->
+    case lists:keytake(active, 1, Opts) of
+	{value, {active, Active}, Rest} ->
+	    case inet:setopts(TCPSocket, Rest) of
+		ok -> set_active(TLSSock, Active);
+		Err -> Err
+	    end;
+	false ->
+	    inet:setopts(TCPSocket, Opts)
+    end.
 
 -spec sockname(tls_socket()) -> {ok, {inet:ip_address(), inet:port_number()}} |
                                 {error, inet:posix()}.
@@ -327,14 +790,250 @@ sockname(#tlssock{tcpsock = TCPSocket}) ->
 peername(#tlssock{tcpsock = TCPSocket}) ->
     inet:peername(TCPSocket).
 
-controlling_process(#tlssock{tcpsock = TCPSocket},
+controlling_process(#tlssock{tcpsock = TCPSocket, tlsport = Port},
 		    Pid) ->
-    gen_tcp:controlling_process(TCPSocket, Pid).
+    case catch get_receiver_nif(Port) of
+	{ok, Receiver} ->
+	    call_receiver(Receiver, {controlling_process, Pid});
+	_ ->
+	    case gen_tcp:controlling_process(TCPSocket, Pid) of
+		ok -> socket_owner_nif(Port, Pid);
+		Err -> Err
+	    end
+    end.
 
-close(#tlssock{tcpsock = TCPSocket, tlsport = Port}) ->
+close(#tlssock{tlsport = Port} = TLSSock) ->
+    case catch get_receiver_nif(Port) of
+	{ok, Pid} when Pid /= self() ->
+	    case call_receiver(Pid, close) of
+		{error, closed} -> close_socket(TLSSock);
+		Res -> Res
+	    end;
+	_ ->
+	    close_socket(TLSSock)
+    end.
+
+close_socket(#tlssock{tcpsock = TCPSocket, tlsport = Port}) ->
     invalidate_nif(Port),
     gen_tcp:close(TCPSocket).
 
+%%% --------------------------------------------------------
+%%% Active mode
+%%% --------------------------------------------------------
+
+%% A receiver process becomes the controlling process of the TCP socket
+%% and does all I/O of the TLS socket from then on, so records reach the
+%% socket in the order OpenSSL produced them. The NIFs answer other
+%% processes with {via, Receiver} and their calls are forwarded.
+set_active(#tlssock{tlsport = Port} = TLSSock, Active)
+  when is_boolean(Active); Active == once;
+       is_integer(Active), Active >= -32768, Active =< 32767 ->
+    case catch get_receiver_nif(Port) of
+	{ok, Pid} -> call_receiver(Pid, {active, Active});
+	none when Active == false -> ok;
+	none -> start_receiver(TLSSock, Active);
+	{'EXIT', {badarg, _}} -> {error, einval}
+    end;
+set_active(_TLSSock, _Active) ->
+    {error, einval}.
+
+start_receiver(#tlssock{tcpsock = TCPSocket, tlsport = Port} = TLSSock,
+	       Active) ->
+    Owner = self(),
+    Pid = spawn(fun() -> receiver_init(TLSSock, Owner) end),
+    case gen_tcp:controlling_process(TCPSocket, Pid) of
+	ok ->
+	    case set_receiver_nif(Port, Pid) of
+		ok ->
+		    call_receiver(Pid, {active, Active});
+		Err ->
+		    exit(Pid, kill),
+		    Err
+	    end;
+	Err ->
+	    exit(Pid, kill),
+	    Err
+    end.
+
+call_receiver(Pid, Request) ->
+    MRef = erlang:monitor(process, Pid),
+    Pid ! {tls_call, {self(), MRef}, Request},
+    receive
+	{MRef, Reply} ->
+	    erlang:demonitor(MRef, [flush]),
+	    Reply;
+	{'DOWN', MRef, process, _, _} ->
+	    {error, closed}
+    end.
+
+reply({Pid, Tag}, Reply) ->
+    Pid ! {Tag, Reply}.
+
+receiver_init(TLSSock, Owner) ->
+    MRef = erlang:monitor(process, Owner),
+    receiver_loop(#receiver{tlssock = TLSSock, owner = Owner, mref = MRef}).
+
+receiver_loop(#receiver{tlssock = #tlssock{tcpsock = TCPSocket,
+					   nifsock = Ref} = TLSSock,
+			owner = Owner, mref = MRef} = R) ->
+    receive
+	{tcp, TCPSocket, Data} ->
+	    receiver_input(R, collect_tcp(TCPSocket, [Data], ?RECEIVER_BATCH));
+	{select, _, Ref, _} ->
+	    receiver_input(R, <<>>);
+	{tcp_closed, TCPSocket} ->
+	    Owner ! {tls_closed, TLSSock};
+	{tcp_error, TCPSocket, Reason} ->
+	    Owner ! {tls_error, TLSSock, Reason},
+	    receiver_loop(R);
+	{tls_writable, _} = Msg ->
+	    Owner ! Msg,
+	    receiver_loop(R);
+	{tls_call, From, Request} ->
+	    receiver_call(R, From, Request);
+	{'DOWN', MRef, process, Owner, _} ->
+	    %% Like a port, the socket does not outlive its owner
+	    close_socket(TLSSock)
+    end.
+
+%% Decrypts several TCP packets with one NIF call
+collect_tcp(_TCPSocket, Acc, 0) ->
+    lists:reverse(Acc);
+collect_tcp(TCPSocket, Acc, N) ->
+    receive
+	{tcp, TCPSocket, Data} ->
+	    collect_tcp(TCPSocket, [Data | Acc], N - 1)
+    after 0 ->
+	lists:reverse(Acc)
+    end.
+
+receiver_call(#receiver{active = Old} = R, From, {active, Active}) ->
+    New = if is_integer(Old), is_integer(Active) ->
+		  min(Old + Active, 32767);
+	     true ->
+		  Active
+	  end,
+    reply(From, ok),
+    R1 = receiver_mode(R, New),
+    case Old of
+	false -> receiver_input(R1, <<>>);
+	_ -> receiver_loop(R1)
+    end;
+receiver_call(#receiver{active = false, tlssock = TLSSock} = R, From,
+	      {recv, Length, Timeout}) ->
+    reply(From, recv(TLSSock, Length, Timeout)),
+    receiver_loop(R);
+receiver_call(R, From, {recv, _Length, _Timeout}) ->
+    reply(From, {error, einval}),
+    receiver_loop(R);
+receiver_call(#receiver{tlssock = TLSSock} = R, From, {send, Packet}) ->
+    reply(From, send(TLSSock, Packet)),
+    receiver_loop(R);
+receiver_call(#receiver{owner = Owner, mref = MRef} = R, {Owner, _} = From,
+	      {controlling_process, Pid}) ->
+    erlang:demonitor(MRef, [flush]),
+    reply(From, ok),
+    receiver_loop(R#receiver{owner = Pid,
+			     mref = erlang:monitor(process, Pid)});
+receiver_call(R, From, {controlling_process, _Pid}) ->
+    reply(From, {error, not_owner}),
+    receiver_loop(R);
+receiver_call(#receiver{tlssock = #tlssock{tcpsock = TCPSocket}} = R, From,
+	      {detach, Pid}) ->
+    receiver_mode(R, false),
+    reply(From, gen_tcp:controlling_process(TCPSocket, Pid));
+receiver_call(#receiver{tlssock = TLSSock}, From, close) ->
+    reply(From, close_socket(TLSSock)).
+
+receiver_input(#receiver{active = false} = R, <<>>) ->
+    receiver_loop(R);
+receiver_input(#receiver{active = false,
+			 tlssock = #tlssock{tlsport = Port}} = R, Data) ->
+    set_encrypted_input_nif(Port, Data),
+    receiver_loop(R);
+receiver_input(#receiver{tlssock = #tlssock{nifsock = false} = TLSSock} = R,
+	       Data) ->
+    receiver_deliver(R, recv_data(TLSSock, Data, 0));
+receiver_input(#receiver{tlssock = #tlssock{tlsport = Port,
+					    nifsock = Ref}} = R, _) ->
+    case catch socket_recv_nif(Port, 0, Ref) of
+	wait ->
+	    receiver_loop(R);
+	flush ->
+	    %% Stray select messages are ignored by the receiver loop
+	    receiver_input(R, <<>>);
+	{pending, AsyncRef} ->
+	    receive
+		{tls_async, AsyncRef} ->
+		    receiver_input(R, <<>>)
+	    after ?ASYNC_TIMEOUT ->
+		    receiver_deliver(R, {error, timeout})
+	    end;
+	{'EXIT', {badarg, _}} ->
+	    receiver_deliver(R, {error, einval});
+	Res ->
+	    receiver_deliver(R, Res)
+    end.
+
+receiver_deliver(R, {ok, <<>>}) ->
+    receiver_loop(R);
+receiver_deliver(#receiver{tlssock = TLSSock, owner = Owner,
+			   active = Active} = R, {ok, Data}) ->
+    Owner ! {tls, TLSSock, Data},
+    R1 = receiver_mode(R, case Active of
+			      true -> true;
+			      once -> false;
+			      N -> N - 1
+			  end),
+    case R1 of
+	#receiver{active = false} ->
+	    receiver_loop(R1);
+	#receiver{tlssock = #tlssock{nifsock = false}} ->
+	    receiver_loop(R1);
+	_ ->
+	    %% Drain the NIF socket until it would block
+	    receiver_input(R1, <<>>)
+    end;
+receiver_deliver(#receiver{tlssock = TLSSock, owner = Owner} = R,
+		 {error, closed}) ->
+    Owner ! {tls_closed, TLSSock},
+    receiver_loop(receiver_mode(R, false));
+receiver_deliver(#receiver{tlssock = TLSSock, owner = Owner} = R,
+		 {error, Reason}) ->
+    Owner ! {tls_error, TLSSock, Reason},
+    receiver_loop(receiver_mode(R, false)).
+
+%% The TCP socket is active while the TLS socket is. Ciphertext that
+%% arrived before it was made passive is kept for passive reads.
+receiver_mode(#receiver{tlssock = TLSSock, owner = Owner} = R, N)
+  when is_integer(N), N =< 0 ->
+    Owner ! {tls_passive, TLSSock},
+    receiver_mode(R, false);
+receiver_mode(#receiver{active = Old,
+			tlssock = #tlssock{tcpsock = TCPSocket,
+					   tlsport = Port,
+					   nifsock = false}} = R, New) ->
+    if Old == false, New /= false ->
+	    inet:setopts(TCPSocket, [{active, true}]);
+       Old /= false, New == false ->
+	    inet:setopts(TCPSocket, [{active, false}]),
+	    drain_tcp(TCPSocket, Port);
+       true ->
+	    ok
+    end,
+    R#receiver{active = New};
+receiver_mode(R, New) ->
+    R#receiver{active = New}.
+
+drain_tcp(TCPSocket, Port) ->
+    receive
+	{tcp, TCPSocket, Data} ->
+	    set_encrypted_input_nif(Port, Data),
+	    drain_tcp(TCPSocket, Port)
+    after 0 ->
+	ok
+    end.
+
 -spec get_peer_certificate(tls_socket()) -> error | {ok, cert()}.
 get_peer_certificate(TLSSock) ->
     get_peer_certificate(TLSSock, plain).
@@ -362,6 +1061,24 @@ get_negotiated_cipher(#tlssock{tlsport = Port}) ->
 				error
 		end.
 
+%% Whether the handshake resumed a cached session or a ticket
+-spec session_reused(tls_socket()) -> boolean().
+session_reused(#tlssock{tlsport = Port}) ->
+    case catch session_reused_nif(Port) of
+	true -> true;
+	_ -> false
+    end.
+
+%% Whether data sent before the handshake completed was accepted as
+%% early data. On a server such data may be a replay by an attacker,
+%% so requests that are not idempotent should be refused.
+-spec get_early_data_status(tls_socket()) -> accepted | rejected | not_sent.
+get_early_data_status(#tlssock{tlsport = Port}) ->
+    case catch get_early_data_status_nif(Port) of
+	Status when is_atom(Status) -> Status;
+	_ -> not_sent
+    end.
+
 -spec get_verify_result(tls_socket()) -> byte().
 
 get_verify_result(#tlssock{tlsport = Port}) ->
@@ -386,7 +1103,14 @@ cert_is_self_signed(#'Certificate'{} = Cert) ->
 cert_is_self_signed(Cert) ->
     public_key:pkix_is_self_signed(Cert).
 
--spec add_certfile(iodata(), iodata()) -> ok.
+%% @doc Sets the certificate file used when clients ask for `Domain'
+%% with SNI. Besides exact names, `*.example.com' matches one more
+%% label, like `www.example.com', and `.example.com' matches any
+%% number of them. An exact name wins over a wildcard, which wins over
+%% the longest suffix. Names are case insensitive. Names that can't
+%% match any domain, like `www..example.com' or `example.com.', are
+%% rejected.
+-spec add_certfile(iodata(), iodata()) -> ok | {error, einval | enomem}.
 add_certfile(Domain, File) ->
     add_certfile_nif(Domain, File).
 
@@ -400,13 +1124,202 @@ get_certfile(Domain) ->
 delete_certfile(Domain) ->
     delete_certfile_nif(Domain).
 
+%% @doc Loads a certificate and its private key from memory, e.g. from
+%% a database. `Data' is either a PEM binary with the certificate, the
+%% rest of the chain and the key, or `{Certs, Key}' with DER binaries,
+%% the server certificate first. The returned name is accepted as the
+%% `certfile' option and by add_certfile/2: SSL contexts are then built
+%% from the parsed certificate without any file access or PEM parsing.
+%% Loading the same data again returns the same name, and a key that
+%% doesn't match the certificate is an error.
+-spec load_certificate(binary() | {[binary(), ...], binary()}) ->
+                              {ok, binary()} |
+                              {error, einval | enomem | binary()}.
+load_certificate(Data) ->
+    Res = case Data of
+	      {Certs, Key} -> catch load_certificate_nif(Certs, Key);
+	      PEM -> catch load_certificate_nif(PEM, <<>>)
+	  end,
+    case Res of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	_ ->
+	    Res
+    end.
+
+%% @doc Returns `true` if the certificate is deleted, `false` otherwise.
+%% SSL contexts already built from it are kept until clear_cache/0.
+-spec delete_certificate(iodata()) -> boolean().
+delete_certificate(Name) ->
+    delete_certificate_nif(Name).
+
 %% @doc Clears cached SSL_CTX structures
-%% You MUST call this function if you change content
-%% of your CA, DH or certificate files
+%% Changes to CA, DH or certificate files are picked up by
+%% reload_certfiles/0 without clearing the whole cache
 -spec clear_cache() -> ok.
 clear_cache() ->
     clear_cache_nif().
 
+%% @doc Drops only the cached SSL contexts built from the given
+%% certificate, CA or DH file, or from the certificate added with
+%% add_certfile/2 for exactly that domain name (a wildcard entry is
+%% invalidated as `<<"*.example.com">>'), and returns how many were
+%% dropped. They are rebuilt on the next connection that needs them,
+%% and contexts being built meanwhile are not cached.
+-spec invalidate(iodata()) -> non_neg_integer().
+invalidate(Name) ->
+    invalidate_cache_nif(Name).
+
+%% @doc Builds the SSL context of a profile, or of a domain added with
+%% add_certfile/2, ahead of traffic, so that the first connections do
+%% not wait for it. A context already cached is rebuilt from the
+%% current files. Returns the build time in microseconds.
+-spec prewarm(tls_profile() | iodata()) ->
+                     {ok, non_neg_integer()} |
+                     {error, not_found | no_certfile | binary()}.
+prewarm(#tls_profile{} = Profile) ->
+    prewarm_ctx(Profile, <<>>);
+prewarm(Domain) ->
+    prewarm(Domain, []).
+
+%% @doc Builds the SSL context of the domain with the settings of the
+%% profile or the options of tcp_to_tls/2, see prewarm/1.
+-spec prewarm(iodata(), tls_profile() | [{atom(), any()} | atom()]) ->
+                     {ok, non_neg_integer()} |
+                     {error, not_found | no_certfile | binary()}.
+prewarm(<<>>, _) ->
+    {error, not_found};
+prewarm(Domain, #tls_profile{} = Profile) ->
+    prewarm_ctx(Profile, iolist_to_binary(Domain));
+prewarm(Domain, Options) ->
+    case new_profile(Options) of
+	{ok, Profile} ->
+	    prewarm(Domain, Profile);
+	Err ->
+	    Err
+    end.
+
+prewarm_ctx(#tls_profile{ref = Ref}, Domain) ->
+    Start = erlang:monotonic_time(microsecond),
+    case prewarm_nif(Ref, Domain) of
+	ok ->
+	    {ok, erlang:monotonic_time(microsecond) - Start};
+	Err ->
+	    Err
+    end.
+
+%% @doc Same as prewarm_all/2 without progress reports.
+-spec prewarm_all(tls_profile() | [{atom(), any()} | atom()]) ->
+                         {ok, non_neg_integer(), non_neg_integer(),
+                          non_neg_integer()} |
+                         {error, enomem | no_certfile | timeout | binary()}.
+prewarm_all(ProfileOrOptions) ->
+    prewarm_all(ProfileOrOptions, fun(_Done, _Total) -> ok end).
+
+%% @doc Builds the SSL contexts of all domains added with add_certfile/2,
+%% typically right after startup, on a pool of native threads. Contexts
+%% already cached are skipped, and connections arriving meanwhile only
+%% wait for the domain they need. `Progress(Done, Total)' is called
+%% about every percent of the domains. Returns the number of domains,
+%% how many of them failed to build and the total time in microseconds,
+%% or `{error, timeout}' if the workers stop reporting progress.
+-spec prewarm_all(tls_profile() | [{atom(), any()} | atom()],
+                  fun((non_neg_integer(), non_neg_integer()) -> any())) ->
+                         {ok, non_neg_integer(), non_neg_integer(),
+                          non_neg_integer()} |
+                         {error, enomem | no_certfile | timeout | binary()}.
+prewarm_all(#tls_profile{ref = Ref}, Progress) ->
+    Start = erlang:monotonic_time(microsecond),
+    case prewarm_all_nif(Ref) of
+	{ok, Tag} ->
+	    wait_prewarm(Tag, Progress, Start);
+	Err ->
+	    Err
+    end;
+prewarm_all(Options, Progress) ->
+    case new_profile(Options) of
+	{ok, Profile} ->
+	    prewarm_all(Profile, Progress);
+	Err ->
+	    Err
+    end.
+
+wait_prewarm(Tag, Progress, Start) ->
+    receive
+	{tls_prewarm, Tag, Total, Failed, Total} ->
+	    Progress(Total, Total),
+	    {ok, Total, Failed, erlang:monotonic_time(microsecond) - Start};
+	{tls_prewarm, Tag, Done, _Failed, Total} ->
+	    Progress(Done, Total),
+	    wait_prewarm(Tag, Progress, Start)
+    after ?PREWARM_TIMEOUT ->
+	    {error, timeout}
+    end.
+
+%% @doc Rebuilds the SSL contexts whose certificate, key, CA or DH
+%% files changed since they were built, and returns how many were
+%% replaced. Sockets opened before keep their old context. This also
+%% happens automatically: on Linux as soon as the files change, and
+%% everywhere every `certfile_check_interval' milliseconds if that
+%% application environment variable is set (`infinity' by default).
+-spec reload_certfiles() -> {ok, non_neg_integer()} | {error, enomem}.
+reload_certfiles() ->
+    case reload_certfiles_nif() of
+	{ok, Ref} ->
+	    receive {tls_reload, Ref, Num} -> {ok, Num} end;
+	Err ->
+	    Err
+    end.
+
+%% @doc Enables the server session cache, shared by all certificates
+%% and SNI contexts. Up to `Size' sessions are kept for `Timeout'
+%% seconds, and clients resuming one of them skip the certificate and
+%% key exchange crypto. A `Size' of 0 (the default) disables it.
+-spec set_session_cache(non_neg_integer(), pos_integer()) -> ok |
+                                                             {error, einval}.
+set_session_cache(Size, Timeout) ->
+    case catch set_session_cache_nif(Size, Timeout) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	Res ->
+	    Res
+    end.
+
+%% @doc Sets the keys protecting session tickets, issued to clients of
+%% sockets opened with the `tickets' option. Each key is a 48 or 80 byte
+%% binary: a 16 byte name, then the HMAC and AES keys (AES-128 or
+%% AES-256), as in nginx's ssl_session_ticket_key files. New tickets
+%% use the first key, the others are still accepted, so nodes sharing
+%% the keys resume each other's sessions while the keys are rotated.
+%% A random key is used until this is called, or again after
+%% `set_ticket_keys(local)'. Sockets with the `early_data' option
+%% refuse early data while shared keys are set: replays are only
+%% detected per node, so the same ClientHello would be accepted
+%% once by each node sharing the keys.
+-spec set_ticket_keys([binary(), ...] | local) -> ok | {error, einval | enomem}.
+set_ticket_keys(Keys) ->
+    case catch set_ticket_keys_nif(Keys) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	Res ->
+	    Res
+    end.
+
+%% @doc Enables session reuse for `connect' sockets with the `sni' option.
+%% The last session with each server is kept, for up to `Size' servers
+%% and `Timeout' seconds, and offered when connecting to the same server
+%% name with the same options again. A `Size' of 0 (the default)
+%% disables it.
+-spec set_client_session_cache(non_neg_integer(), pos_integer()) ->
+                                      ok | {error, einval}.
+set_client_session_cache(Size, Timeout) ->
+    case catch set_client_session_cache_nif(Size, Timeout) of
+	{'EXIT', {badarg, _}} ->
+	    {error, einval};
+	Res ->
+	    Res
+    end.
+
 cert_verify_code(0) -> <<"ok">>;
 cert_verify_code(2) ->
     <<"unable to get issuer certificate">>;
@@ -498,65 +1411,460 @@ load_nif_test() ->
     ?assertEqual(ok, load_nif(SOPath)).
 
 transmission_test() ->
-    {LPid, Port} = setup_listener([]),
+    transmit(setup_listener([]), []).
+
+large_payload_test() ->
+    {Client, Server} = tls_pair(),
+    %% Many records, each one a separate chunk of the output
+    Payload = << <<I:32>> || I <- lists:seq(1, 256 * 1024) >>,
+    Self = self(),
+    spawn_link(fun() -> Self ! {sent, send(Client, Payload)} end),
+    ?assertEqual({ok, Payload}, recv_all(Server, byte_size(Payload), <<>>)),
+    receive {sent, Res} -> ?assertEqual(ok, Res) after 5000 -> ?assert(false) end.
+
+deep_iolist_test() ->
+    {Client, Server} = tls_pair(),
+    %% Nested as deep as it is long, like an appended accumulator
+    Data = lists:foldl(fun(I, Acc) when I rem 2 == 0 -> [Acc, <<I:8>>];
+			  (I, Acc) -> [Acc, I rem 256]
+		       end, [], lists:seq(1, 200000)),
+    Self = self(),
+    spawn_link(fun() -> Self ! {sent, send(Client, Data)} end),
+    ?assertEqual({ok, iolist_to_binary(Data)},
+		 recv_all(Server, iolist_size(Data), <<>>)),
+    receive {sent, Res} -> ?assertEqual(ok, Res) after 5000 -> ?assert(false) end.
+
+%% Works whether or not the kernel and OpenSSL can do kTLS
+ktls_transmission_test() ->
+    {Client, Server} = tls_pair([ktls]),
+    Payload = << <<I:32>> || I <- lists:seq(1, 64 * 1024) >>,
+    Self = self(),
+    spawn_link(fun() -> Self ! {sent, send(Server, Payload)} end),
+    ?assertEqual({ok, Payload}, recv_all(Client, byte_size(Payload), <<>>)),
+    receive {sent, Res} -> ?assertEqual(ok, Res) after 5000 -> ?assert(false) end,
+    ok = send(Client, <<"pong">>),
+    ?assertEqual({ok, <<"pong">>}, recv_all(Server, 4, <<>>)).
+
+%% The NIF closes its descriptor when the socket owner exits
+nif_socket_owner_exit_test() ->
+    Self = self(),
+    spawn(fun() ->
+		  {Client, Server} = tls_pair([nif_socket]),
+		  ok = controlling_process(Client, Self),
+		  Self ! {pair, Client, Server}
+	  end),
+    Client = receive {pair, C, _} -> C after 5000 -> ?assert(false) end,
+    ?assertEqual({error, closed}, recv(Client, 0, 2000)).
+
+%% A peer trickling bytes doesn't extend the timeout
+nif_socket_recv_timeout_test() ->
+    {#tlssock{tcpsock = TCPSocket, tlsport = Port}, Server} =
+	tls_pair([nif_socket]),
+    {ok, Out} = encrypt_nif(Port, binary:copy(<<"x">>, 100)),
+    Record = iolist_to_binary(Out),
+    Self = self(),
+    spawn_link(fun() ->
+		       [begin
+			    ok = gen_tcp:send(TCPSocket, <<B>>),
+			    timer:sleep(10)
+			end || <<B>> <= Record],
+		       Self ! trickled
+	       end),
+    Start = erlang:monotonic_time(millisecond),
+    ?assertEqual({error, timeout}, recv(Server, 0, 200)),
+    ?assert(erlang:monotonic_time(millisecond) - Start < 1000),
+    receive trickled -> ok after 5000 -> ?assert(false) end,
+    receive {select, _, _, _} = Msg -> ?assertEqual(no_message, Msg)
+    after 0 -> ok
+    end,
+    ?assertEqual({ok, binary:copy(<<"x">>, 100)}, recv(Server, 0, 1000)).
+
+recv_timeout_test() ->
+    {#tlssock{tcpsock = TCPSocket, tlsport = Port}, Server} = tls_pair(),
+    {ok, Out} = encrypt_nif(Port, <<"split record">>),
+    Record = iolist_to_binary(Out),
+    Half = byte_size(Record) div 2,
+    <<Head:Half/binary, Tail/binary>> = Record,
+    ok = gen_tcp:send(TCPSocket, Head),
+    ?assertEqual({error, timeout}, recv_nonempty(Server, 200)),
+    ok = gen_tcp:send(TCPSocket, Tail),
+    ?assertEqual({ok, <<"split record">>}, recv_nonempty(Server, 1000)).
+
+async_handshake_test() ->
+    transmit(setup_listener([], fun async_handshake/1), []).
+
+nif_socket_transmission_test() ->
+    transmit(setup_listener([nif_socket]), [nif_socket]).
+
+active_transmission_test() ->
+    {ok, ListenSocket} = gen_tcp:listen(0,
+					[binary, {packet, 0}, {active, false},
+					 {reuseaddr, true}, {nodelay, true}]),
+    {ok, Port} = inet:port(ListenSocket),
+    Self = self(),
+    LPid = spawn(fun() ->
+	{ok, Socket} = gen_tcp:accept(ListenSocket),
+	{ok, TLSSock} = tcp_to_tls(Socket, [{certfile, <<"../tests/cert.pem">>}]),
+	ok = setopts(TLSSock, [{active, 2}]),
+	Self ! {received, active_loop(TLSSock, <<>>)}
+		 end),
     SPid = setup_sender(Port, []),
     SPid ! {stop, self()},
     receive
-	{result, Res} ->
+	{result, Res, _} ->
 	    ?assertEqual(ok, Res)
     end,
-    LPid ! {stop, self()},
     receive
 	{received, Msg} ->
 	    ?assertEqual(<<"abcdefghi">>, Msg)
+    end,
+    exit(LPid, kill).
+
+active_loop(TLSSock, Msg) ->
+    receive
+	{tls, TLSSock, Data} ->
+	    active_loop(TLSSock, <<Msg/binary, Data/binary>>);
+	{tls_passive, TLSSock} ->
+	    ok = setopts(TLSSock, [{active, true}]),
+	    active_loop(TLSSock, Msg);
+	{tls_closed, TLSSock} ->
+	    Msg
+    after 1000 ->
+	{timeout, Msg}
     end.
 
+session_cache_test() ->
+    ?assertEqual({error, einval}, set_session_cache(-1, 300)),
+    ?assertEqual({error, einval}, set_session_cache(100, 0)),
+    ?assertEqual(ok, set_session_cache(100, 300)),
+    ?assertEqual({error, einval}, set_client_session_cache(100, 0)),
+    ?assertEqual(ok, set_client_session_cache(100, 300)),
+    %% The second connection resumes the session of the first one
+    Transmit = fun() ->
+		       transmit(setup_listener([]), [{sni, <<"localhost">>}])
+	       end,
+    ?assertEqual({false, false}, Transmit()),
+    %% The client offered the session it cached
+    ?assertEqual({true, true}, Transmit()),
+    ?assertEqual(ok, set_client_session_cache(0, 300)),
+    ?assertEqual(ok, set_session_cache(0, 300)).
+
+ticket_keys_test() ->
+    ?assertEqual({error, einval}, set_ticket_keys([])),
+    ?assertEqual({error, einval}, set_ticket_keys([<<0:64/unit:8>>])),
+    Old = crypto:strong_rand_bytes(80),
+    ?assertEqual(ok, set_ticket_keys([Old, crypto:strong_rand_bytes(48)])),
+    ?assertEqual(ok, set_client_session_cache(100, 300)),
+    Opts = [tickets, {sni, <<"localhost">>}],
+    transmit(setup_listener([tickets]), Opts),
+    %% The ticket issued with the old key is still accepted
+    ?assertEqual(ok, set_ticket_keys([crypto:strong_rand_bytes(80), Old])),
+    ?assertEqual({true, true}, transmit(setup_listener([tickets]), Opts)),
+    ?assertEqual(ok, set_client_session_cache(0, 300)),
+    ?assertEqual(ok, set_ticket_keys(local)).
+
+early_data_test() ->
+    ?assertEqual(ok, set_ticket_keys(local)),
+    ?assertEqual(ok, set_client_session_cache(100, 300)),
+    {ok, ListenSocket} = gen_tcp:listen(0, [binary, {active, false}]),
+    {ok, Port} = inet:port(ListenSocket),
+    Opts = [tickets, early_data, {certfile, <<"../tests/cert.pem">>}],
+    spawn(fun() -> early_data_server(ListenSocket, Opts, 2) end),
+    Connect =
+	fun() ->
+		{ok, Socket} = tcp_connect({127, 0, 0, 1}, Port,
+					   [binary, {active, false}], 1000),
+		{ok, TLSSock} = tcp_to_tls(Socket, [connect,
+						    {sni, <<"localhost">>}
+						    | Opts]),
+		%% Sent before the handshake, as early data if resumed
+		ok = send(TLSSock, <<"ping">>),
+		{ok, <<"pong">>} = recv(TLSSock, 4, 1000),
+		Status = get_early_data_status(TLSSock),
+		close(TLSSock),
+		Status
+	end,
+    ?assertEqual(not_sent, Connect()),
+    ?assertEqual(accepted, Connect()),
+    ?assertEqual(ok, set_client_session_cache(0, 300)).
+
+early_data_server(_ListenSocket, _Opts, 0) ->
+    ok;
+early_data_server(ListenSocket, Opts, N) ->
+    {ok, Socket} = gen_tcp:accept(ListenSocket),
+    {ok, TLSSock} = tcp_to_tls(Socket, Opts),
+    {ok, <<"ping">>} = recv(TLSSock, 4, 1000),
+    ok = send(TLSSock, <<"pong">>),
+    %% Let the client read the session ticket
+    {error, _} = recv(TLSSock, 0, 1000),
+    close(TLSSock),
+    early_data_server(ListenSocket, Opts, N - 1).
+
+send_queue_limits_test() ->
+    {ok, TLSSock} = tcp_to_tls(undefined, [{certfile, <<"../tests/cert.pem">>}]),
+    ?assertEqual({error, einval}, set_send_queue_limits(TLSSock, 5, 10)),
+    ?assertEqual(ok, set_send_queue_limits(TLSSock, 10, 5)),
+    %% No handshake yet, so everything stays queued
+    ?assertEqual(ok, send(TLSSock, <<"0123456789">>)),
+    ?assertEqual({busy, 10}, send(TLSSock, <<"abc">>)),
+    ?assertEqual(ok, set_send_queue_limits(TLSSock, 0, 0)),
+    ?assertEqual(ok, send(TLSSock, [<<"abc">>, "def"])),
+    tls_to_tcp(TLSSock).
+
+load_certificate_test() ->
+    {ok, PEM} = file:read_file("../tests/cert.pem"),
+    ?assertEqual({error, einval}, load_certificate(foo)),
+    ?assertMatch({error, _}, load_certificate(<<"garbage">>)),
+    {ok, Name} = load_certificate(PEM),
+    ?assertEqual({ok, Name}, load_certificate(PEM)),
+    [{'Certificate', Cert, _}, {_, Key, _}] = public_key:pem_decode(PEM),
+    {ok, DERName} = load_certificate({[Cert], Key}),
+    OtherKey = public_key:der_encode(
+		 'RSAPrivateKey', public_key:generate_key({rsa, 1024, 65537})),
+    ?assertMatch({error, _}, load_certificate({[Cert], OtherKey})),
+    {ok, TLSSock} = tcp_to_tls(undefined, [{certfile, DERName}]),
+    tls_to_tcp(TLSSock),
+    ?assertEqual(true, delete_certificate(Name)),
+    ?assertEqual(false, delete_certificate(Name)),
+    ?assertEqual(true, delete_certificate(DERName)).
+
+reload_certfiles_test_() ->
+    {setup,
+     fun() ->
+	     Dir = filename:join(
+		     os:getenv("TMPDIR", "/tmp"),
+		     "fast_tls_" ++
+			 integer_to_list(erlang:unique_integer([positive]))),
+	     ok = file:make_dir(Dir),
+	     Dir
+     end,
+     fun(Dir) ->
+	     file:delete(filename:join(Dir, "cert.pem")),
+	     file:del_dir(Dir)
+     end,
+     fun(Dir) -> ?_test(reload_certfiles_in(Dir)) end}.
+
+reload_certfiles_in(Dir) ->
+    File = filename:join(Dir, "cert.pem"),
+    {ok, PEM} = file:read_file("../tests/cert.pem"),
+    ok = file:write_file(File, PEM),
+    {ok, Profile} = new_profile([{certfile, File}]),
+    {ok, TLSSock} = tcp_to_tls(undefined, Profile),
+    Generation = profile_generation_nif(Profile),
+    ok = file:change_time(File, {{2030, 1, 1}, {0, 0, 0}}),
+    %% Reloaded either here or by the watcher, but only once
+    reload_certfiles(),
+    wait_profile_generation(Profile, Generation + 1, 50),
+    ?assertEqual({ok, 0}, reload_certfiles()),
+    ?assertEqual(Generation + 1, profile_generation_nif(Profile)),
+    tls_to_tcp(TLSSock).
+
+%% Opening a socket picks up the reloaded context
+wait_profile_generation(Profile, Generation, N) ->
+    {ok, TLSSock} = tcp_to_tls(undefined, Profile),
+    tls_to_tcp(TLSSock),
+    case profile_generation_nif(Profile) of
+	Generation ->
+	    ok;
+	_ when N > 0 ->
+	    timer:sleep(100),
+	    wait_profile_generation(Profile, Generation, N - 1);
+	Other ->
+	    ?assertEqual(Generation, Other)
+    end.
+
+profile_test() ->
+    ?assertMatch({error, _},
+		 new_profile([{certfile, <<"../tests/nonexistent.pem">>}])),
+    {ok, Profile} = new_profile([{certfile, <<"../tests/cert.pem">>}]),
+    {ok, TLSSock1} = tcp_to_tls(undefined, Profile),
+    Generation = profile_generation_nif(Profile),
+    %% The profile gets a new context after the cache is cleared
+    clear_cache(),
+    {ok, TLSSock2} = tcp_to_tls(undefined, Profile),
+    ?assert(profile_generation_nif(Profile) > Generation),
+    tls_to_tcp(TLSSock1),
+    tls_to_tcp(TLSSock2).
+
+prewarm_test() ->
+    {ok, Profile} = new_profile([]),
+    ?assertEqual({error, not_found}, prewarm(<<"unknown.example">>, Profile)),
+    ok = add_certfile(<<"prewarm.example">>, <<"../tests/cert.pem">>),
+    {ok, _} = prewarm(<<"prewarm.example">>, Profile),
+    {ok, _} = prewarm(<<"PreWarm.example">>, Profile),
+    ?assert(invalidate(<<"prewarm.example">>) >= 1),
+    ?assertEqual(0, invalidate(<<"prewarm.example">>)),
+    delete_certfile(<<"prewarm.example">>).
+
+invalidate_wildcard_test() ->
+    ok = add_certfile(<<"*.invalidate.example">>, <<"../tests/cert.pem">>),
+    {ok, Profile} = new_profile([]),
+    {ok, _} = prewarm(<<"www.invalidate.example">>, Profile),
+    %% Names covered by the wildcard don't match it
+    ?assertEqual(0, invalidate(<<"www.invalidate.example">>)),
+    ?assert(invalidate(<<"*.Invalidate.example">>) >= 1),
+    ?assertEqual(0, invalidate(<<"*.invalidate.example">>)),
+    delete_certfile(<<"*.invalidate.example">>).
+
+certfile_lookup_test() ->
+    ok = add_certfile(<<"Exact.Lookup.example">>, <<"exact.pem">>),
+    ok = add_certfile(<<"*.lookup.example">>, <<"wildcard.pem">>),
+    ok = add_certfile(<<".lookup.example">>, <<"suffix.pem">>),
+    ?assertEqual(error, get_certfile(<<"lookup.example">>)),
+    ?assertEqual({ok, <<"exact.pem">>},
+		 get_certfile(<<"exact.lookup.EXAMPLE">>)),
+    ?assertEqual({ok, <<"wildcard.pem">>},
+		 get_certfile(<<"www.lookup.example">>)),
+    ?assertEqual({ok, <<"suffix.pem">>},
+		 get_certfile(<<"a.b.lookup.example">>)),
+    ?assertEqual(error, get_certfile(<<"www..lookup.example">>)),
+    ?assertEqual(true, delete_certfile(<<"*.Lookup.example">>)),
+    ?assertEqual({ok, <<"suffix.pem">>},
+		 get_certfile(<<"www.lookup.example">>)),
+    delete_certfile(<<".lookup.example">>),
+    ?assertEqual(error, get_certfile(<<"www.lookup.example">>)),
+    delete_certfile(<<"exact.lookup.example">>).
+
+certfile_negative_cache_test() ->
+    Domain = <<"miss.lookup.example">>,
+    %% Cached as a miss first
+    ?assertEqual(error, get_certfile(Domain)),
+    ?assertEqual(error, get_certfile(Domain)),
+    ok = add_certfile(Domain, <<"miss.pem">>),
+    ?assertEqual({ok, <<"miss.pem">>}, get_certfile(Domain)),
+    delete_certfile(Domain),
+    ?assertEqual(error, get_certfile(Domain)),
+    ?assertEqual({error, einval}, add_certfile(<<"www..miss.example">>,
+					       <<"bad.pem">>)),
+    ?assertEqual({error, einval}, add_certfile(<<"miss.example.">>,
+					       <<"bad.pem">>)),
+    ?assertEqual({error, einval}, add_certfile(<<>>, <<"bad.pem">>)),
+    ?assertEqual(false, delete_certfile(<<"miss.example.">>)).
+
+prewarm_all_test() ->
+    Domains = [<<"a.prewarm.example">>, <<"b.prewarm.example">>],
+    [ok = add_certfile(D, <<"../tests/cert.pem">>) || D <- Domains],
+    Self = self(),
+    {ok, Total, Failed, _} = prewarm_all([], fun(Done, T) ->
+						     Self ! {progress, Done, T}
+					     end),
+    ?assert(Total >= length(Domains)),
+    ?assertEqual(0, Failed),
+    receive
+	{progress, Total, Total} -> ok
+    after 1000 ->
+	    ?assert(false)
+    end,
+    [delete_certfile(D) || D <- Domains].
+
 not_compatible_protocol_options_test() ->
     {LPid, Port} = setup_listener([{protocol_options, <<"no_sslv2|no_sslv3|no_tlsv1_1|no_tlsv1_2|no_tlsv1_3">>}]),
     SPid = setup_sender(Port, [{protocol_options, <<"no_sslv2|no_sslv3|no_tlsv1|no_tlsv1_2|no_tlsv1_3">>}]),
     SPid ! {stop, self()},
     receive
-	{result, Res} ->
+	{result, Res, _} ->
 	    ?assertMatch({badmatch, {error, _}}, Res)
     end,
     LPid ! {stop, self()},
     receive
-	{received, {error, _, _} = Msg} ->
+	{received, {error, _, _} = Msg, _} ->
 	    ?assertMatch({error, _, <<>>}, Msg);
-	{received, Msg} ->
+	{received, Msg, _} ->
 	    ?assertMatch(<<>>, Msg)
     end.
 
+%% Returns a client and a server socket done with the handshake
+tls_pair() ->
+    tls_pair([]).
+
+tls_pair(ServerOpts) ->
+    {ok, ListenSocket} = gen_tcp:listen(0,
+					[binary, {packet, 0}, {active, false},
+					 {reuseaddr, true}, {nodelay, true}]),
+    {ok, Port} = inet:port(ListenSocket),
+    {ok, C} = gen_tcp:connect({127, 0, 0, 1}, Port,
+			      [binary, {packet, 0}, {active, false},
+			       {nodelay, true}]),
+    {ok, S} = gen_tcp:accept(ListenSocket),
+    gen_tcp:close(ListenSocket),
+    {ok, Client} = tcp_to_tls(C, [connect]),
+    {ok, Server} = tcp_to_tls(S, [{certfile, <<"../tests/cert.pem">>} |
+				  ServerOpts]),
+    ok = send(Client, <<"ping">>),
+    Self = self(),
+    Pid = spawn_link(fun() -> Self ! {self(), recv_all(Server, 4, <<>>)} end),
+    ?assertEqual({ok, <<"ping">>}, client_handshake(Client, Pid)),
+    {Client, Server}.
+
+client_handshake(Client, Pid) ->
+    recv(Client, 0, 100),
+    receive
+	{Pid, Res} -> Res
+    after 0 ->
+	client_handshake(Client, Pid)
+    end.
+
+recv_all(_TLSSock, Size, Acc) when byte_size(Acc) >= Size ->
+    {ok, Acc};
+recv_all(TLSSock, Size, Acc) ->
+    case recv(TLSSock, 0, 2000) of
+	{ok, Data} -> recv_all(TLSSock, Size, <<Acc/binary, Data/binary>>);
+	Err -> Err
+    end.
+
+%% Partial records give {ok, <<>>}
+recv_nonempty(TLSSock, Timeout) ->
+    case recv(TLSSock, 0, Timeout) of
+	{ok, <<>>} -> recv_nonempty(TLSSock, Timeout);
+	Res -> Res
+    end.
+
 setup_listener(Opts) ->
+    setup_listener(Opts, fun(_) -> ok end).
+
+setup_listener(Opts, Handshake) ->
     {ok, ListenSocket} = gen_tcp:listen(0,
 					[binary, {packet, 0}, {active, false},
 					 {reuseaddr, true}, {nodelay, true}]),
     Pid = spawn(fun() ->
 	{ok, Socket} = gen_tcp:accept(ListenSocket),
 	{ok, TLSSock} = tcp_to_tls(Socket, [{certfile, <<"../tests/cert.pem">>} | Opts]),
+	ok = Handshake(TLSSock),
 	listener_loop(TLSSock, <<>>)
 		end),
     {ok, Port} = inet:port(ListenSocket),
     {Pid, Port}.
 
+async_handshake(#tlssock{tcpsock = Socket} = TLSSock) ->
+    {ok, Packet} = gen_tcp:recv(Socket, 0, 1000),
+    {ok, Ref} = handshake_async(TLSSock, Packet),
+    receive
+	{tls_handshake, Ref, Res, Out} ->
+	    ok = gen_tcp:send(Socket, Out),
+	    case Res of
+		ok -> ok;
+		want_read -> async_handshake(TLSSock)
+	    end
+    end.
+
 listener_loop(TLSSock, Msg) ->
     case recv(TLSSock, 1, 1000) of
 	{error, timeout} ->
 	    receive
 		{stop, Pid} ->
-		    Pid ! {received, Msg}
+		    Pid ! {received, Msg, session_reused(TLSSock)}
 	    after 0 ->
 		listener_loop(TLSSock, Msg)
 	    end;
 	{error, closed} ->
 	    receive
 		{stop, Pid} ->
-		    Pid ! {received, Msg}
+		    Pid ! {received, Msg, session_reused(TLSSock)}
 	    end;
 	{error, Err} ->
 	    receive
 		{stop, Pid} ->
-		    Pid ! {received, {error, Err, Msg}}
+		    Pid ! {received, {error, Err, Msg}, false}
 	    end;
 	{ok, Data} ->
 	    listener_loop(TLSSock, <<Msg/binary, Data/binary>>)
@@ -572,24 +1880,42 @@ setup_sender(Port, Opts) ->
 	  end).
 
 sender_loop(TLSSock) ->
-    Res = try
-	      recv(TLSSock, 0, 1000),
-	      ok = send(TLSSock, <<"abc">>),
-	      recv(TLSSock, 0, 1000),
-	      ok = send(TLSSock, <<"def">>),
-	      recv(TLSSock, 0, 1000),
-	      ok = send(TLSSock, <<"ghi">>),
-	      recv(TLSSock, 0, 1000),
-	      close(TLSSock),
-	      ok
-	  catch
-	      _:Err ->
-	      close(TLSSock),
-	      Err
-	  end,
+    {Res, Reused} = try
+			recv(TLSSock, 0, 1000),
+			ok = send(TLSSock, <<"abc">>),
+			recv(TLSSock, 0, 1000),
+			ok = send(TLSSock, <<"def">>),
+			recv(TLSSock, 0, 1000),
+			ok = send(TLSSock, <<"ghi">>),
+			recv(TLSSock, 0, 1000),
+			R = session_reused(TLSSock),
+			close(TLSSock),
+			{ok, R}
+		    catch
+			_:Err ->
+			close(TLSSock),
+			{Err, false}
+		    end,
     receive
 	{stop, Pid} ->
-	    Pid ! {result, Res}
+	    Pid ! {result, Res, Reused}
+    end.
+
+%% Sends "abcdefghi" from a new sender to the listener. Returns whether
+%% the sender and the listener resumed a session.
+transmit({LPid, Port}, SenderOpts) ->
+    SPid = setup_sender(Port, SenderOpts),
+    SPid ! {stop, self()},
+    ClientReused = receive
+		       {result, Res, Reused} ->
+			   ?assertEqual(ok, Res),
+			   Reused
+		   end,
+    LPid ! {stop, self()},
+    receive
+	{received, Msg, ServerReused} ->
+	    ?assertEqual(<<"abcdefghi">>, Msg),
+	    {ClientReused, ServerReused}
     end.
 
 -endif.